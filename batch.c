@@ -0,0 +1,113 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "batch.h"
+#include "errors.h"
+#include "options.h"
+
+static int add_task(struct batch *batch, const char *line)
+{
+    int result;
+    struct task *task = batch->tasks + batch->count;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    if (!*line || *line == '#')
+        return DONE;
+
+    if (batch->count == BATCH_STEPS)
+        return INVALID_FILE_CONTENT;
+
+    snprintf(task->line, sizeof(task->line), "%s", line);
+
+    if ((result = split_options(task->line, task->words, task->argv + 1, BATCH_ARGUMENTS - 1, &task->argc)))
+        return INVALID_FILE_CONTENT;
+
+    task->argv[0] = "swamp-boot";
+    task->argc++;
+    batch->count++;
+    return DONE;
+}
+
+int open_batch(struct batch *batch, const char *file)
+{
+    int result = DONE;
+    char line[BATCH_LINE];
+    FILE *stream = fopen(file, "rt");
+
+    memset(batch, 0, sizeof(struct batch));
+    batch->absent = 1;
+
+    if (!stream)
+        return INTERNAL_ERROR;
+
+    while (!result && fgets(line, sizeof(line), stream))
+    {
+        const size_t length = strcspn(line, "\r\n");
+
+        if (!line[length] && !feof(stream))
+            result = INVALID_FILE_CONTENT;
+
+        line[length] = 0;
+
+        if (!result)
+            result = add_task(batch, line);
+    }
+
+    if (!result && ferror(stream))
+        result = INTERNAL_ERROR;
+
+    fclose(stream);
+
+    if (!result && !batch->count)
+        result = INVALID_FILE_CONTENT;
+
+    return result;
+}
+
+int fresh_batch(struct batch *batch, const struct session *session)
+{
+    const int changed = session->identified && (!batch->identified || memcmp(batch->uid, session->uid, DEVICE_UID_SIZE));
+
+    if (!batch->absent && !changed)
+        return 0;
+
+    memcpy(batch->uid, session->uid, DEVICE_UID_SIZE);
+    batch->identified = session->identified;
+    batch->absent = 0;
+    return 1;
+}
+
+void count_batch(struct batch *batch, int result)
+{
+    batch->board++;
+
+    if (!result)
+        return;
+
+    if (!batch->failed++)
+        batch->result = result;
+}
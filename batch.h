@@ -0,0 +1,61 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "session.h"
+
+#define BATCH_STEPS 32
+#define BATCH_LINE 1024
+#define BATCH_ARGUMENTS 64
+#define BATCH_POLL 100
+
+struct task
+{
+    char line[BATCH_LINE];
+    char words[BATCH_LINE];
+    int argc;
+    char *argv[BATCH_ARGUMENTS];
+};
+
+struct batch
+{
+    size_t count;
+    int board;
+    int failed;
+    int result;
+    int absent;
+    int identified;
+    uint8_t uid[DEVICE_UID_SIZE];
+    struct task tasks[BATCH_STEPS];
+};
+
+int open_batch(struct batch *batch, const char *file);
+int fresh_batch(struct batch *batch, const struct session *session);
+void count_batch(struct batch *batch, int result);
+
+#endif
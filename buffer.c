@@ -21,8 +21,22 @@
  * THE SOFTWARE.
  */
 
+#include <elf.h>
+#include <errno.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <memory.h>
+#include <unistd.h>
+#include <strings.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "crc.h"
+#include "lz4.h"
+#include "cache.h"
 #include "errors.h"
 #include "buffer.h"
 
@@ -31,15 +45,72 @@
 #define INTEL_EXTENDED_ADDRESS 0x04
 #define INTEL_START_ADDRESS 0x05
 
+#define PARALLEL_SIZE (1024*1024)
+#define PARALLEL_CHUNKS 8
+
+#define STREAM_SIZE (16*1024)
+#define OUTPUT_SIZE (256*1024)
+
+#define BUNDLE_MAGIC 0x4E425753
+#define BUNDLE_VERSION 1
+#define BUNDLE_LZ4 0x0001
+
+struct bundle_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t pid;
+    uint32_t startup;
+    uint32_t origin;
+    uint32_t size;
+    uint32_t count;
+    uint32_t pages;
+    uint32_t crc;
+};
+
+struct bundle_extent
+{
+    uint32_t origin;
+    uint32_t size;
+};
+
+struct bundle_block
+{
+    uint32_t offset;
+    uint16_t size;
+    uint16_t flags;
+};
+
 struct load_context
 {
     uint32_t startup;
-    uint32_t min;
-    uint32_t max;
     uint32_t origin;
     size_t size;
     uint8_t *data;
     uint16_t shadow;
+    size_t count;
+    struct extent *extents;
+    int (*emit)(void *argument, uint32_t origin, size_t size);
+    void *argument;
+    uint8_t *flushed;
+    uint32_t block;
+    uint32_t first;
+    uint32_t last;
+    int wake;
+    int exact;
+};
+
+struct chunk
+{
+    const char *begin;
+    const char *pending;
+    const char *end;
+    int deferred;
+    int result;
+    struct load_context context;
+    struct load_context deferred_context;
+    struct extent extents[BUFFER_EXTENTS];
+    struct extent deferred_extents[BUFFER_EXTENTS];
 };
 
 struct save_context
@@ -48,48 +119,232 @@ struct save_context
     size_t size;
     const uint8_t *data;
     uint16_t shadow;
+    size_t record;
+    int skip;
+    FILE *stream;
+    size_t used;
+    int skipping;
+    char *output;
 };
 
-static uint8_t *ihex32_data(struct load_context *context, uint32_t address)
+static uint8_t nibbles[256];
+static char pairs[256][2];
+static pthread_once_t nibbles_once = PTHREAD_ONCE_INIT;
+static pthread_once_t pairs_once = PTHREAD_ONCE_INIT;
+
+static int compare_extents(const void *left, const void *right)
 {
-    if (address >= context->origin && address <= context->origin + context->size - 1)
-        return context->data + address - context->origin;
+    const struct extent *a = left;
+    const struct extent *b = right;
 
-    return 0;
+    return a->origin < b->origin ? -1 : a->origin > b->origin;
 }
 
-static int read_ihex32_chunk(struct load_context *context, FILE *stream)
+static void merge_extents(struct load_context *context, size_t index)
 {
-    uint8_t size, scratch, checksum;
-    uint16_t offset;
+    struct extent *extents = context->extents;
 
-    if (fscanf(stream, ":%02hhX%04hX%02hhX", &size, &offset, &scratch) != 3)
-        return INTERNAL_ERROR;
+    while (index + 1 < context->count && extents[index + 1].origin <= extents[index].origin + extents[index].size)
+    {
+        const uint32_t end = extents[index + 1].origin + extents[index + 1].size;
+
+        if (end > extents[index].origin + extents[index].size)
+            extents[index].size = end - extents[index].origin;
 
-    checksum = size + scratch + offset + (offset >> 8);
+        memmove(extents + index + 1, extents + index + 2, (context->count - index - 2) * sizeof(struct extent));
+        context->count--;
+    }
+}
+
+static void add_extent(struct load_context *context, uint32_t begin, uint32_t end)
+{
+    struct extent *extents = context->extents;
+    size_t index = context->count;
 
-    switch (scratch)
+    if (!context->exact)
     {
-    case INTEL_DATA:
-        while (size--)
+        begin &= ~3;
+        end = (end + 3) & ~3;
+    }
+
+    while (index && extents[index - 1].origin > begin)
+        index--;
+
+    if (index && extents[index - 1].origin + extents[index - 1].size >= begin)
+    {
+        index--;
+    }
+    else if (context->count == BUFFER_EXTENTS)
+    {
+        if (index)
+        {
+            index--;
+        }
+        else
         {
-            uint32_t address = (context->shadow << 16) + offset++;
-            uint8_t *data = ihex32_data(context, address);
+            extents[0].size += extents[0].origin - begin;
+            extents[0].origin = begin;
+        }
+    }
+    else
+    {
+        memmove(extents + index + 1, extents + index, (context->count - index) * sizeof(struct extent));
+        extents[index].origin = begin;
+        extents[index].size = end - begin;
+        context->count++;
+    }
+
+    if (end > extents[index].origin + extents[index].size)
+        extents[index].size = end - extents[index].origin;
+
+    merge_extents(context, index);
+}
 
-            if (!data)
-                return INVALID_FILE_CONTENT;
+static void build_nibbles(void)
+{
+    int index;
 
-            if (address > context->max)
-                context->max = address;
+    for (index = 0; index < 256; index++)
+        nibbles[index] = 0x10;
 
-            if (address < context->min)
-                context->min = address;
+    for (index = 0; index < 10; index++)
+        nibbles['0' + index] = index;
 
-            if (fscanf(stream, "%02hhX", &scratch) != 1)
-                return INTERNAL_ERROR;
+    for (index = 0; index < 6; index++)
+        nibbles['A' + index] = nibbles['a' + index] = 10 + index;
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t' || *p == '\v' || *p == '\f'))
+        p++;
+
+    return p;
+}
+
+static size_t ihex32_length(const char *p, const char *end, uint8_t *type)
+{
+    uint8_t invalid;
+    size_t length;
+
+    if (end - p < 11 || *p != ':')
+        return 0;
+
+    invalid = nibbles[(uint8_t)p[1]] | nibbles[(uint8_t)p[2]] | nibbles[(uint8_t)p[7]] | nibbles[(uint8_t)p[8]];
+    length = 1 + 2 * (5 + (nibbles[(uint8_t)p[1]] << 4 | nibbles[(uint8_t)p[2]]));
+    *type = nibbles[(uint8_t)p[7]] << 4 | nibbles[(uint8_t)p[8]];
+
+    return invalid & 0x10 || (size_t)(end - p) < length ? 0 : length;
+}
+
+static int flush_block(struct load_context *context)
+{
+    const size_t index = (context->block - context->origin) / BUFFER_BLOCK;
+    const uint32_t first = context->first;
+    const uint32_t last = context->last;
+
+    if (first == last)
+        return DONE;
+
+    context->flushed[index / 8] |= 1 << index % 8;
+    context->first = context->last = 0;
+    return context->emit(context->argument, first, last - first);
+}
 
-            checksum += scratch;
-            *data = scratch;
+static int track_block(struct load_context *context, uint32_t begin, uint32_t end)
+{
+    begin &= ~3;
+    end = (end + 3) & ~3;
+
+    while (begin < end)
+    {
+        int result;
+        const uint32_t block = begin - (begin - context->origin) % BUFFER_BLOCK;
+        const uint32_t limit = end - block > BUFFER_BLOCK ? block + BUFFER_BLOCK : end;
+        const size_t index = (block - context->origin) / BUFFER_BLOCK;
+
+        if (block != context->block && (result = flush_block(context)))
+            return result;
+
+        if (context->flushed[index / 8] & 1 << index % 8)
+            return INVALID_FILE_CONTENT;
+
+        if (context->first == context->last)
+        {
+            context->block = block;
+            context->first = begin;
+            context->last = limit;
+        }
+        else
+        {
+            if (begin < context->first)
+                context->first = begin;
+
+            if (limit > context->last)
+                context->last = limit;
+        }
+
+        begin = limit;
+    }
+
+    return DONE;
+}
+
+static int store_data(struct load_context *context, uint32_t address, const uint8_t *data, size_t size)
+{
+    if (address < context->origin || address - context->origin > context->size || size > context->size - (address - context->origin))
+        return INVALID_FILE_CONTENT;
+
+    memcpy(context->data + address - context->origin, data, size);
+    add_extent(context, address, address + size);
+    return context->emit ? track_block(context, address, address + size) : DONE;
+}
+
+static int read_ihex32_record(struct load_context *context, const char **cursor, const char *end)
+{
+    const char *p = *cursor;
+    uint8_t record[4 + 255 + 1];
+    uint8_t type, checksum = 0, invalid = 0;
+    size_t length, index, size;
+    uint16_t offset;
+    int result;
+
+    if (!(length = ihex32_length(p, end, &type)))
+        return INTERNAL_ERROR;
+
+    for (index = 0, p++; index < length / 2; index++, p += 2)
+    {
+        const uint8_t high = nibbles[(uint8_t)p[0]];
+        const uint8_t low = nibbles[(uint8_t)p[1]];
+
+        invalid |= high | low;
+        record[index] = high << 4 | low;
+        checksum += record[index];
+    }
+
+    if (invalid & 0x10)
+        return INTERNAL_ERROR;
+
+    *cursor = p;
+    size = record[0];
+    offset = record[1] << 8 | record[2];
+
+    switch (type)
+    {
+    case INTEL_DATA:
+        if (size > 0x10000 - (size_t)offset)
+        {
+            const size_t first = 0x10000 - offset;
+
+            if ((result = store_data(context, (uint32_t)context->shadow << 16 | offset, record + 4, first)))
+                return result;
+
+            if ((result = store_data(context, (uint32_t)context->shadow << 16, record + 4 + first, size - first)))
+                return result;
+        }
+        else if (size && (result = store_data(context, (uint32_t)context->shadow << 16 | offset, record + 4, size)))
+        {
+            return result;
         }
         break;
 
@@ -97,153 +352,1577 @@ static int read_ihex32_chunk(struct load_context *context, FILE *stream)
         break;
 
     case INTEL_EXTENDED_ADDRESS:
-        if (fscanf(stream, "%04hX", &context->shadow) != 1)
-            return INTERNAL_ERROR;
+        if (size != 2)
+            return INVALID_FILE_CONTENT;
 
-        checksum += context->shadow + (context->shadow >> 8);
+        context->shadow = record[4] << 8 | record[5];
         break;
 
     case INTEL_START_ADDRESS:
-        if (fscanf(stream, "%08X", &context->startup) != 1)
-            return INTERNAL_ERROR;
+        if (size != 4)
+            return INVALID_FILE_CONTENT;
 
-        checksum += context->startup + (context->startup >> 8) + (context->startup >> 16) + (context->startup >> 24);
+        context->startup = (uint32_t)record[4] << 24 | record[5] << 16 | record[6] << 8 | record[7];
         break;
 
     default:
         return INVALID_FILE_CONTENT;
     }
 
-    if (fscanf(stream, "%02hhX\n", &scratch) != 1)
-        return INTERNAL_ERROR;
+    return checksum ? INVALID_FILE_CHECKSUM : DONE;
+}
 
-    if ((uint8_t)(checksum + scratch))
-        return INVALID_FILE_CHECKSUM;
+static int read_ihex32_records(struct load_context *context, const char *p, const char *end)
+{
+    while ((p = skip_space(p, end)) < end)
+    {
+        int result;
+
+        if ((result = read_ihex32_record(context, &p, end)))
+            return result;
+    }
 
     return DONE;
 }
 
-int load_file_buffer(struct buffer *buffer, const char *file)
+static void *read_ihex32_chunk(void *argument)
 {
-    struct load_context context =
+    struct chunk *chunk = argument;
+    const char *p = chunk->begin;
+
+    while (chunk->deferred && (p = skip_space(p, chunk->end)) < chunk->end)
     {
-        0, 0xFFFFFFFF, 0x00000000, buffer->origin, buffer->size, (uint8_t *)buffer->data, 0
-    };
+        uint8_t type;
+        const size_t length = ihex32_length(p, chunk->end, &type);
 
-    FILE *stream = fopen(file, "rt");
-    if (!stream)
-        return INTERNAL_ERROR;
+        if (!length || type == INTEL_EXTENDED_ADDRESS)
+            break;
+
+        p += length;
+    }
+
+    chunk->pending = p;
+    chunk->result = read_ihex32_records(&chunk->context, p, chunk->end);
+    return 0;
+}
 
-    while (!feof(stream))
+static int overlap_chunks(struct chunk *chunks, size_t count)
+{
+    struct extent *extents;
+    size_t index, total = 0;
+    int overlap = 0;
+
+    for (index = 0; index < count; index++)
+        total += chunks[index].deferred_context.count + chunks[index].context.count;
+
+    if (!(extents = malloc(total * sizeof(struct extent) + 1)))
+        return 1;
+
+    for (index = 0, total = 0; index < count; index++)
     {
-        int result;
-        if ((result = read_ihex32_chunk(&context, stream)))
-            return result;
+        memcpy(extents + total, chunks[index].deferred_context.extents, chunks[index].deferred_context.count * sizeof(struct extent));
+        total += chunks[index].deferred_context.count;
+        memcpy(extents + total, chunks[index].context.extents, chunks[index].context.count * sizeof(struct extent));
+        total += chunks[index].context.count;
     }
 
-    if (fclose(stream))
-        return INTERNAL_ERROR;
+    qsort(extents, total, sizeof(struct extent), compare_extents);
+
+    for (index = 1; index < total && !overlap; index++)
+        overlap = extents[index].origin < extents[index - 1].origin + extents[index - 1].size;
+
+    free(extents);
+    return overlap;
+}
+
+static void merge_chunk(struct load_context *context, const struct load_context *chunk)
+{
+    size_t index;
+
+    for (index = 0; index < chunk->count; index++)
+        add_extent(context, chunk->extents[index].origin, chunk->extents[index].origin + chunk->extents[index].size);
+
+    if (chunk->startup)
+        context->startup = chunk->startup;
+}
+
+static int read_ihex32_parallel(struct load_context *context, const char *begin, const char *end, size_t count)
+{
+    struct chunk chunks[PARALLEL_CHUNKS];
+    pthread_t threads[PARALLEL_CHUNKS];
+    uint16_t shadow = 0;
+    size_t index;
+
+    for (index = 0; index < count; index++)
+    {
+        struct chunk *chunk = chunks + index;
+        const struct load_context empty =
+        {
+            0, context->origin, context->size, context->data, 0, 0, chunk->extents
+        };
+        const struct load_context deferred =
+        {
+            0, context->origin, context->size, context->data, 0, 0, chunk->deferred_extents
+        };
+
+        chunk->context = empty;
+        chunk->context.exact = context->exact;
+        chunk->deferred_context = deferred;
+        chunk->deferred_context.exact = context->exact;
+        chunk->deferred = index != 0;
+        chunk->begin = index ? chunks[index - 1].end : begin;
+        chunk->end = index + 1 < count ? begin + (end - begin) * (index + 1) / count : end;
 
-    buffer->startup = context.startup;
+        if (chunk->end < chunk->begin)
+            chunk->end = chunk->begin;
+
+        if (chunk->end < end)
+        {
+            const char *line = memchr(chunk->end, '\n', end - chunk->end);
+            chunk->end = line ? line + 1 : end;
+        }
+    }
 
-    if (context.min > context.max)
+    for (index = 0; index < count; index++)
     {
-        buffer->size = 0;
+        if (pthread_create(threads + index, 0, read_ihex32_chunk, chunks + index))
+        {
+            while (index--)
+                pthread_join(threads[index], 0);
+
+            return read_ihex32_records(context, begin, end);
+        }
     }
-    else
+
+    for (index = 0; index < count; index++)
+        pthread_join(threads[index], 0);
+
+    for (index = 0; index < count; index++)
+    {
+        struct chunk *chunk = chunks + index;
+        int result;
+
+        chunk->deferred_context.shadow = shadow;
+
+        if ((result = read_ihex32_records(&chunk->deferred_context, chunk->begin, chunk->pending)))
+            return result;
+
+        if (chunk->result)
+            return chunk->result;
+
+        if (!chunk->deferred || skip_space(chunk->pending, chunk->end) < chunk->end)
+            shadow = chunk->context.shadow;
+    }
+
+    if (overlap_chunks(chunks, count))
+        return read_ihex32_records(context, begin, end);
+
+    for (index = 0; index < count; index++)
     {
-        buffer->size = context.max - context.min + 1;
-        buffer->data = buffer->data + context.min - buffer->origin;
-        buffer->origin = context.min;
+        merge_chunk(context, &chunks[index].deferred_context);
+        merge_chunk(context, &chunks[index].context);
     }
 
     return DONE;
 }
 
-static int write_ihex32_data(struct save_context *context, FILE *stream, uint8_t size)
+static long parallel_chunks(void)
+{
+    const char *threads = getenv("SWAMP_BOOT_THREADS");
+    char *tail;
+    long count;
+
+    if (!threads || !*threads || (count = strtol(threads, &tail, 10)) < 1 || *tail)
+        return sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count;
+}
+
+static int read_ihex32_file(struct load_context *context, const char *begin, const char *end)
 {
-    uint8_t checksum;
+    long count = parallel_chunks();
 
-    if (fprintf(stream, ":%02X%04X00", size, (uint16_t)context->origin) != 9)
+    if (skip_space(begin, end) == end)
         return INTERNAL_ERROR;
 
-    checksum = size + context->origin + (context->origin >> 8);
+    if (end - begin < PARALLEL_SIZE || count < 2)
+        return read_ihex32_records(context, begin, end);
 
-    while (size--)
+    return read_ihex32_parallel(context, begin, end, count < PARALLEL_CHUNKS ? count : PARALLEL_CHUNKS);
+}
+
+static int read_srec_record(struct load_context *context, const char **cursor, const char *end)
+{
+    static const size_t widths[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+    const char *p = *cursor;
+    uint8_t record[255];
+    uint8_t count, checksum, invalid;
+    size_t index, width;
+    uint32_t address = 0;
+    int type;
+
+    if (end - p < 4 || p[0] != 'S' || p[1] < '0' || p[1] > '9')
+        return INTERNAL_ERROR;
+
+    type = p[1] - '0';
+    invalid = nibbles[(uint8_t)p[2]] | nibbles[(uint8_t)p[3]];
+    count = checksum = nibbles[(uint8_t)p[2]] << 4 | nibbles[(uint8_t)p[3]];
+
+    if (invalid & 0x10 || (size_t)(end - p) < 4 + 2 * (size_t)count)
+        return INTERNAL_ERROR;
+
+    for (index = 0, p += 4; index < count; index++, p += 2)
     {
-        if (fprintf(stream, "%02X", *context->data) != 2)
-            return INTERNAL_ERROR;
+        const uint8_t high = nibbles[(uint8_t)p[0]];
+        const uint8_t low = nibbles[(uint8_t)p[1]];
 
-        checksum += *context->data++;
-        context->origin++;
-        context->size--;
+        invalid |= high | low;
+        record[index] = high << 4 | low;
+        checksum += record[index];
     }
 
-    if (fprintf(stream, "%02X\n", (uint8_t)-checksum) != 3)
+    if (invalid & 0x10)
         return INTERNAL_ERROR;
 
+    *cursor = p;
+    width = widths[type];
+
+    if (!width || count < width + 1)
+        return INVALID_FILE_CONTENT;
+
+    for (index = 0; index < width; index++)
+        address = address << 8 | record[index];
+
+    if (type >= 1 && type <= 3)
+    {
+        int result;
+
+        if (count > width + 1 && (result = store_data(context, address, record + width, count - width - 1)))
+            return result;
+    }
+    else if (type >= 7)
+    {
+        context->startup = address;
+    }
+
+    return checksum == 0xFF ? DONE : INVALID_FILE_CHECKSUM;
+}
+
+static int read_srec_file(struct load_context *context, const char *p, const char *end)
+{
+    while ((p = skip_space(p, end)) < end)
+    {
+        int result;
+
+        if ((result = read_srec_record(context, &p, end)))
+            return result;
+    }
+
     return DONE;
 }
 
-static int write_ihex32_address(struct save_context *context, FILE *stream)
+static int read_elf_file(struct load_context *context, const char *begin, const char *end)
 {
-    uint8_t checksum;
+    const size_t size = end - begin;
+    Elf32_Ehdr header;
+    size_t index;
 
-    if (context->origin >> 16 == context->shadow)
-        return DONE;
+    if (size < sizeof(header))
+        return INVALID_FILE_CONTENT;
 
-    context->shadow = context->origin >> 16;
-    checksum = 0x06 + context->shadow + (context->shadow >> 8);
+    memcpy(&header, begin, sizeof(header));
 
-    if (fprintf(stream, ":02000004%04X%02X\n", context->shadow, (uint8_t)(-checksum)) != 16)
-        return INTERNAL_ERROR;
+    if (header.e_ident[EI_CLASS] != ELFCLASS32 || header.e_ident[EI_DATA] != ELFDATA2LSB || header.e_phentsize != sizeof(Elf32_Phdr))
+        return INVALID_FILE_CONTENT;
+
+    if (header.e_phoff > size || header.e_phnum > (size - header.e_phoff) / sizeof(Elf32_Phdr))
+        return INVALID_FILE_CONTENT;
+
+    for (index = 0; index < header.e_phnum; index++)
+    {
+        Elf32_Phdr segment;
+        int result;
+
+        memcpy(&segment, begin + header.e_phoff + index * sizeof(segment), sizeof(segment));
+
+        if (segment.p_type != PT_LOAD || !segment.p_filesz)
+            continue;
+
+        if (segment.p_offset > size || segment.p_filesz > size - segment.p_offset)
+            return INVALID_FILE_CONTENT;
+
+        if ((result = store_data(context, segment.p_paddr, (const uint8_t *)begin + segment.p_offset, segment.p_filesz)))
+            return result;
+    }
 
+    context->startup = header.e_entry;
     return DONE;
 }
 
-static size_t ihex32_size(struct save_context *context)
+static int binary_file(const char *file, const char *begin, const char *end, uint32_t base)
 {
-    uint32_t end = context->origin + (context->size < 16 ? context->size : 16);
+    const size_t length = strlen(file);
+    const char *p = skip_space(begin, end);
 
-    if (context->origin >> 16 != end >> 16)
-        end = end & 0xFFFF0000;
+    if (length > 4 && !strcasecmp(file + length - 4, ".bin"))
+        return 1;
 
-    return end - context->origin;
+    if (end - begin >= SELFMAG && !memcmp(begin, ELFMAG, SELFMAG))
+        return 0;
+
+    if (p == end || *p == ':' || (*p == 'S' && end - p > 1 && p[1] >= '0' && p[1] <= '9'))
+        return 0;
+
+    return base ? 1 : -1;
 }
 
-int save_file_buffer(struct buffer *buffer, const char *file)
+static int bundle_file(const char *begin, size_t size)
 {
-    struct save_context context =
-    {
-        buffer->origin, buffer->size, (const uint8_t *)buffer->data, 0
-    };
+    uint32_t magic;
 
-    FILE *stream = fopen(file, "wt");
-    if (!stream)
-        return INTERNAL_ERROR;
+    if (size < sizeof(magic))
+        return 0;
 
-    while (context.size)
-    {
-        int result;
-        int count = ihex32_size(&context);
+    memcpy(&magic, begin, sizeof(magic));
+    return magic == BUNDLE_MAGIC;
+}
 
-        if ((result = write_ihex32_address(&context, stream)))
-            return result;
+static size_t bundle_pages(uint32_t origin, size_t size)
+{
+    const uint32_t first = origin & ~(BUFFER_PAGE - 1);
 
-        if ((result = write_ihex32_data(&context, stream, count)))
-            return result;
+    return size ? (origin + size - first + BUFFER_PAGE - 1) / BUFFER_PAGE : 0;
+}
+
+static uint32_t bundle_crc(const struct bundle_header *header, const void *tables, size_t size)
+{
+    struct bundle_header copy = *header;
+
+    copy.crc = 0;
+    return crc32(crc32(0, &copy, sizeof(copy)), tables, size);
+}
+
+static int read_bundle_page(const struct bundle_block *block, const uint8_t *begin, size_t size, uint8_t *page)
+{
+    if (!block->size)
+    {
+        memset(page, 0xFF, BUFFER_PAGE);
+        return DONE;
     }
 
-    if (fprintf(stream, ":00000001FF\n") != 12)
-        return INTERNAL_ERROR;
+    if (block->offset > size || block->size > size - block->offset)
+        return INVALID_FILE_CONTENT;
 
-    if (fclose(stream))
-        return INTERNAL_ERROR;
+    if (block->flags & BUNDLE_LZ4)
+        return decompress_lz4(begin + block->offset, block->size, page, BUFFER_PAGE) == BUFFER_PAGE ? DONE : INVALID_FILE_CONTENT;
+
+    if (block->size != BUFFER_PAGE)
+        return INVALID_FILE_CONTENT;
 
+    memcpy(page, begin + block->offset, BUFFER_PAGE);
     return DONE;
 }
 
-void clear_buffer(struct buffer *buffer, uint8_t value)
+static int read_bundle_file(struct buffer *buffer, char *map, size_t size)
+{
+    const struct bundle_header *header = (const struct bundle_header *)map;
+    const struct bundle_extent *extents = (const struct bundle_extent *)(header + 1);
+    const uint32_t *hashes;
+    const struct bundle_block *blocks;
+    const uint32_t first = header->origin & ~(BUFFER_PAGE - 1);
+    size_t tables;
+    size_t index;
+
+    if (size < sizeof(struct bundle_header) || header->version != BUNDLE_VERSION || header->count > BUFFER_EXTENTS || header->pages != bundle_pages(header->origin, header->size))
+        return INVALID_FILE_CONTENT;
+
+    tables = header->count * sizeof(struct bundle_extent) + header->pages * (sizeof(uint32_t) + sizeof(struct bundle_block));
+    hashes = (const uint32_t *)(extents + header->count);
+    blocks = (const struct bundle_block *)(hashes + header->pages);
+
+    if (tables > size - sizeof(struct bundle_header))
+        return INVALID_FILE_CONTENT;
+
+    if (bundle_crc(header, extents, tables) != header->crc)
+        return INVALID_FILE_CHECKSUM;
+
+    if (first < buffer->origin || first - buffer->origin > buffer->size || header->pages * BUFFER_PAGE > buffer->size - (first - buffer->origin))
+        return INVALID_FILE_CONTENT;
+
+    for (index = 0; index < header->count; index++)
+    {
+        if (extents[index].origin < header->origin || extents[index].origin - header->origin > header->size || extents[index].size > header->size - (extents[index].origin - header->origin))
+            return INVALID_FILE_CONTENT;
+
+        buffer->extents[index].origin = extents[index].origin;
+        buffer->extents[index].size = extents[index].size;
+    }
+
+    for (index = 0; index < header->pages; index++)
+    {
+        int result;
+        uint8_t *page = (uint8_t *)buffer->data + first + index * BUFFER_PAGE - buffer->origin;
+
+        if ((result = read_bundle_page(blocks + index, (const uint8_t *)map, size, page)))
+            return result;
+
+        if (crc32(0, page, BUFFER_PAGE) != hashes[index])
+            return INVALID_FILE_CHECKSUM;
+    }
+
+    buffer->startup = header->startup;
+    buffer->data = (uint8_t *)buffer->data + header->origin - buffer->origin;
+    buffer->origin = header->origin;
+    buffer->size = header->size;
+    buffer->count = header->count;
+    buffer->mapping = map;
+    buffer->mapped = size;
+    buffer->hashes = hashes;
+    buffer->hashed = header->pages;
+    buffer->pid = header->pid;
+    return DONE;
+}
+
+static int map_binary_file(struct buffer *buffer, char *map, size_t size, uint32_t base)
+{
+    if (base < buffer->origin || base - buffer->origin > buffer->size || size > buffer->size - (base - buffer->origin))
+        return INVALID_FILE_CONTENT;
+
+    buffer->startup = 0;
+    buffer->origin = base;
+    buffer->size = size;
+    buffer->data = map;
+    buffer->count = 1;
+    buffer->extents[0].origin = base;
+    buffer->extents[0].size = size;
+    buffer->mapping = map;
+    buffer->mapped = size;
+    buffer->hashes = 0;
+    buffer->hashed = 0;
+    buffer->pid = 0;
+    return DONE;
+}
+
+static void update_buffer(struct buffer *buffer, const struct load_context *context)
+{
+    buffer->startup = context->startup;
+    buffer->count = context->count;
+    buffer->hashes = 0;
+    buffer->hashed = 0;
+    buffer->pid = 0;
+
+    if (!context->count)
+    {
+        buffer->size = 0;
+    }
+    else
+    {
+        const struct extent *last = context->extents + context->count - 1;
+
+        buffer->size = last->origin + last->size - context->extents->origin;
+        buffer->data = (uint8_t *)buffer->data + context->extents->origin - buffer->origin;
+        buffer->origin = context->extents->origin;
+    }
+}
+
+static const char *last_line(const char *begin, const char *end)
+{
+    while (end > begin && end[-1] != '\n')
+        end--;
+
+    return end;
+}
+
+static ssize_t read_input(const struct load_context *context, int stream, void *data, size_t size)
+{
+    struct pollfd pollfds[2] =
+    {
+        {stream, POLLIN, 0},
+        {context->wake, POLLIN, 0}
+    };
+
+    while (context->wake >= 0 && !pollfds[0].revents)
+    {
+        if (poll(pollfds, 2, -1) < 0 && errno != EINTR)
+            return -1;
+
+        if (pollfds[1].revents)
+            return -1;
+    }
+
+    return read(stream, data, size);
+}
+
+static int read_text_stream(struct load_context *context, int stream, char *input, size_t used, int (*record)(struct load_context *, const char **, const char *))
+{
+    int last = 0;
+
+    for (;;)
+    {
+        int result;
+        ssize_t count;
+        const char *p = input;
+        const char *end = last ? input + used : last_line(input, input + used);
+
+        if (end == input && used == STREAM_SIZE)
+            return INTERNAL_ERROR;
+
+        while ((p = skip_space(p, end)) < end)
+        {
+            if ((result = record(context, &p, end)))
+                return result;
+        }
+
+        used = input + used - end;
+        memmove(input, end, used);
+
+        if (last)
+            return DONE;
+
+        if ((count = read_input(context, stream, input + used, STREAM_SIZE - used)) < 0)
+            return INTERNAL_ERROR;
+
+        last = !count;
+        used += count;
+    }
+}
+
+static int read_binary_stream(struct load_context *context, int stream, char *input, size_t used, uint32_t base)
+{
+    ssize_t count = used;
+
+    while (count)
+    {
+        int result;
+
+        if ((result = store_data(context, base, (const uint8_t *)input, count)))
+            return result;
+
+        base += count;
+
+        if ((count = read_input(context, stream, input, STREAM_SIZE)) < 0)
+            return INTERNAL_ERROR;
+    }
+
+    return DONE;
+}
+
+static int read_elf_stream(struct load_context *context, int stream, const char *input, size_t used)
+{
+    int result;
+    size_t size = used;
+    size_t capacity = 4 * STREAM_SIZE;
+    char *image = malloc(capacity);
+    ssize_t count = 1;
+
+    if (!image)
+        return INTERNAL_ERROR;
+
+    memcpy(image, input, used);
+
+    while (count)
+    {
+        if (size == capacity)
+        {
+            char *larger = realloc(image, 2 * capacity);
+
+            if (!larger)
+            {
+                free(image);
+                return INTERNAL_ERROR;
+            }
+
+            image = larger;
+            capacity *= 2;
+        }
+
+        if ((count = read_input(context, stream, image + size, capacity - size)) < 0)
+        {
+            free(image);
+            return INTERNAL_ERROR;
+        }
+
+        size += count;
+    }
+
+    result = read_elf_file(context, image, image + size);
+    free(image);
+    return result;
+}
+
+static int read_stream(struct load_context *context, int stream, const char *file, uint32_t base)
+{
+    char input[STREAM_SIZE];
+    const char *first;
+    size_t used = 0;
+    int binary;
+
+    while (used < SELFMAG || skip_space(input, input + used) == input + used)
+    {
+        const ssize_t count = read_input(context, stream, input + used, STREAM_SIZE - used);
+
+        if (count < 0)
+            return INTERNAL_ERROR;
+
+        if (!count || (used += count) == STREAM_SIZE)
+            break;
+    }
+
+    if ((first = skip_space(input, input + used)) == input + used)
+        return INTERNAL_ERROR;
+
+    if (bundle_file(input, used))
+        return INVALID_FILE_CONTENT;
+
+    if ((binary = binary_file(file, input, input + used, base)) < 0)
+        return INVALID_FILE_CONTENT;
+
+    if (binary)
+        return read_binary_stream(context, stream, input, used, base ? base : context->origin);
+
+    if (used >= SELFMAG && !memcmp(input, ELFMAG, SELFMAG))
+        return read_elf_stream(context, stream, input, used);
+
+    return read_text_stream(context, stream, input, used, *first == 'S' ? read_srec_record : read_ihex32_record);
+}
+
+static int load_stream_buffer(struct buffer *buffer, int stream, const char *file, uint32_t base, int wake, int exact, int (*emit)(void *argument, uint32_t origin, size_t size), void *argument)
+{
+    int result;
+    struct load_context context =
+    {
+        0, buffer->origin, buffer->size, (uint8_t *)buffer->data, 0, 0, buffer->extents, emit, argument, 0, 0, 0, 0, wake, exact
+    };
+
+    pthread_once(&nibbles_once, build_nibbles);
+
+    if (emit && !(context.flushed = calloc(buffer->size / BUFFER_BLOCK / 8 + 1, 1)))
+        return INTERNAL_ERROR;
+
+    clear_buffer(buffer, 0xFF);
+    result = read_stream(&context, stream, file, base);
+
+    if (!result && emit)
+        result = flush_block(&context);
+
+    free(context.flushed);
+
+    if (result)
+        return result;
+
+    update_buffer(buffer, &context);
+    return DONE;
+}
+
+static int stream_file(struct buffer *buffer, const char *file, uint32_t base, int wake, int exact, int (*emit)(void *argument, uint32_t origin, size_t size), void *argument)
+{
+    int result;
+    int stream = strcmp(file, "-") ? open(file, O_RDONLY) : STDIN_FILENO;
+
+    if (stream < 0)
+        return INTERNAL_ERROR;
+
+    result = load_stream_buffer(buffer, stream, file, base, wake, exact, emit, argument);
+
+    if (stream != STDIN_FILENO)
+        close(stream);
+
+    return result;
+}
+
+int stream_file_buffer(struct buffer *buffer, const char *file, uint32_t base, int wake, int (*emit)(void *argument, uint32_t origin, size_t size), void *argument)
+{
+    return stream_file(buffer, file, base, wake, 0, emit, argument);
+}
+
+int regular_file(const char *file)
+{
+    struct stat status;
+
+    return strcmp(file, "-") && !stat(file, &status) && S_ISREG(status.st_mode);
+}
+
+static uint32_t hash_range(const struct buffer *buffer, uint32_t origin, size_t size)
+{
+    static const uint8_t blank[64] =
+    {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+    const uint32_t end = origin + size;
+    uint32_t crc = 0;
+
+    while (origin < end)
+    {
+        size_t count;
+
+        if (origin >= buffer->origin && origin < buffer->origin + buffer->size)
+        {
+            count = buffer->origin + buffer->size - origin < end - origin ? buffer->origin + buffer->size - origin : end - origin;
+            crc = crc32(crc, (const uint8_t *)buffer->data + origin - buffer->origin, count);
+        }
+        else
+        {
+            count = end - origin;
+
+            if (origin < buffer->origin && buffer->origin - origin < count)
+                count = buffer->origin - origin;
+
+            if (count > sizeof(blank))
+                count = sizeof(blank);
+
+            crc = crc32(crc, blank, count);
+        }
+
+        origin += count;
+    }
+
+    return crc;
+}
+
+static void save_image(const struct buffer *buffer, const struct image_key *key)
+{
+    const uint32_t first = buffer->origin & ~(BUFFER_PAGE - 1);
+    const size_t hashed = buffer->size ? (buffer->origin + buffer->size - first + BUFFER_PAGE - 1) / BUFFER_PAGE : 0;
+    uint32_t *hashes;
+    size_t index;
+
+    if (!(hashes = malloc(hashed * sizeof(uint32_t) + 1)))
+        return;
+
+    for (index = 0; index < hashed; index++)
+        hashes[index] = hash_range(buffer, first + index * BUFFER_PAGE, BUFFER_PAGE);
+
+    save_image_cache(key, buffer, hashes, hashed);
+    free(hashes);
+}
+
+static int load_file(struct buffer *buffer, const char *file, uint32_t base, int exact)
+{
+    int result;
+    struct stat status;
+    const char *first;
+    char *map;
+    size_t size;
+    int stream;
+    int binary;
+    int cached;
+    struct image_key key;
+    struct load_context context =
+    {
+        0, buffer->origin, buffer->size, (uint8_t *)buffer->data, 0, 0, buffer->extents, 0, 0, 0, 0, 0, 0, -1, exact
+    };
+
+    if (!regular_file(file))
+        return stream_file(buffer, file, base, -1, exact, 0, 0);
+
+    stream = open(file, O_RDONLY);
+    if (stream < 0)
+        return INTERNAL_ERROR;
+
+    if (fstat(stream, &status) || !status.st_size)
+    {
+        close(stream);
+        return INTERNAL_ERROR;
+    }
+
+    size = status.st_size;
+    map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, stream, 0);
+    close(stream);
+
+    if (map == MAP_FAILED)
+        return INTERNAL_ERROR;
+
+    pthread_once(&nibbles_once, build_nibbles);
+
+    if (bundle_file(map, size))
+    {
+        if ((result = read_bundle_file(buffer, map, size)))
+            munmap(map, size);
+
+        return result;
+    }
+
+    if ((binary = binary_file(file, map, map + size, base)) < 0)
+    {
+        munmap(map, size);
+        return INVALID_FILE_CONTENT;
+    }
+
+    if (!base)
+        base = buffer->origin;
+
+    cached = !binary && !exact && limit_image_cache();
+
+    if (binary && !(base % 4) && !(size % 4))
+    {
+        if ((result = map_binary_file(buffer, map, size, base)))
+            munmap(map, size);
+
+        return result;
+    }
+
+    if (cached)
+    {
+        key_image_cache(&key, map, size, BUFFER_VERSION);
+
+        if (!load_image_cache(&key, buffer))
+        {
+            munmap(map, size);
+            return DONE;
+        }
+    }
+
+    clear_buffer(buffer, 0xFF);
+
+    if (binary)
+        result = store_data(&context, base, (const uint8_t *)map, size);
+    else if (size >= SELFMAG && !memcmp(map, ELFMAG, SELFMAG))
+        result = read_elf_file(&context, map, map + size);
+    else if ((first = skip_space(map, map + size)) < map + size && *first == 'S')
+        result = read_srec_file(&context, map, map + size);
+    else
+        result = read_ihex32_file(&context, map, map + size);
+
+    munmap(map, size);
+
+    if (result)
+        return result;
+
+    update_buffer(buffer, &context);
+
+    if (cached)
+        save_image(buffer, &key);
+
+    return DONE;
+}
+
+int load_file_buffer(struct buffer *buffer, const char *file, uint32_t base)
+{
+    return load_file(buffer, file, base, 0);
+}
+
+int load_patch_buffer(struct buffer *buffer, const char *file, uint32_t base)
+{
+    return load_file(buffer, file, base, 1);
+}
+
+void unload_file_buffer(struct buffer *buffer)
+{
+    if (buffer->mapping)
+        munmap(buffer->mapping, buffer->mapped);
+
+    buffer->mapping = 0;
+    buffer->mapped = 0;
+}
+
+static void build_pairs(void)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    int index;
+
+    for (index = 0; index < 256; index++)
+    {
+        pairs[index][0] = digits[index >> 4];
+        pairs[index][1] = digits[index & 0x0F];
+    }
+}
+
+static int flush_ihex32(struct save_context *context, size_t size)
+{
+    if (context->used + size <= OUTPUT_SIZE)
+        return DONE;
+
+    if (fwrite(context->output, 1, context->used, context->stream) != context->used)
+        return INTERNAL_ERROR;
+
+    context->used = 0;
+    return DONE;
+}
+
+static char *put_ihex32_byte(char *p, uint8_t value)
+{
+    p[0] = pairs[value][0];
+    p[1] = pairs[value][1];
+    return p + 2;
+}
+
+static int write_ihex32_record(struct save_context *context, uint8_t type, const uint8_t *data, uint8_t size)
+{
+    int result;
+    char *p;
+    uint8_t checksum = size + (context->origin >> 8) + context->origin + type;
+
+    if ((result = flush_ihex32(context, 1 + 2 * (4 + size + 1) + 1)))
+        return result;
+
+    p = context->output + context->used;
+    *p++ = ':';
+    p = put_ihex32_byte(p, size);
+    p = put_ihex32_byte(p, context->origin >> 8);
+    p = put_ihex32_byte(p, context->origin);
+    p = put_ihex32_byte(p, type);
+
+    while (size--)
+    {
+        const char *pair = pairs[*data];
+
+        p[0] = pair[0];
+        p[1] = pair[1];
+        p += 2;
+        checksum += *data++;
+    }
+
+    p = put_ihex32_byte(p, -checksum);
+    *p++ = '\n';
+
+    context->used = p - context->output;
+    return DONE;
+}
+
+static int write_ihex32_data(struct save_context *context, uint8_t size)
+{
+    int result;
+
+    if ((result = write_ihex32_record(context, INTEL_DATA, context->data, size)))
+        return result;
+
+    context->data += size;
+    context->origin += size;
+    context->size -= size;
+    return DONE;
+}
+
+static int write_ihex32_address(struct save_context *context)
+{
+    int result;
+    const uint32_t origin = context->origin;
+    uint8_t data[2];
+
+    if (context->origin >> 16 == context->shadow)
+        return DONE;
+
+    context->shadow = context->origin >> 16;
+    data[0] = context->shadow >> 8;
+    data[1] = context->shadow;
+
+    context->origin = 0;
+    result = write_ihex32_record(context, INTEL_EXTENDED_ADDRESS, data, 2);
+    context->origin = origin;
+
+    return result;
+}
+
+static size_t ihex32_size(struct save_context *context)
+{
+    uint32_t end = context->origin + (context->size < context->record ? context->size : context->record);
+
+    if (context->origin >> 16 != end >> 16)
+        end = end & 0xFFFF0000;
+
+    return end - context->origin;
+}
+
+static size_t ihex32_blank(struct save_context *context)
+{
+    size_t count = 0;
+
+    while (count < context->size && context->data[count] == 0xFF)
+        count++;
+
+    return count;
+}
+
+static int save_ihex32_extent(struct save_context *context, int more)
+{
+    while (context->size)
+    {
+        int result;
+        size_t count = context->skip ? ihex32_blank(context) : 0;
+        const int open = more && count == context->size;
+
+        if (open && count < context->record && !context->skipping)
+            return DONE;
+
+        if (count && (context->skipping || count >= context->record || count == context->size))
+        {
+            context->data += count;
+            context->origin += count;
+            context->size -= count;
+            context->skipping = open;
+            continue;
+        }
+
+        context->skipping = 0;
+        count = ihex32_size(context);
+
+        if (more && count == context->size && count < context->record)
+            return DONE;
+
+        if ((result = write_ihex32_address(context)))
+            return result;
+
+        if ((result = write_ihex32_data(context, count)))
+            return result;
+    }
+
+    return DONE;
+}
+
+static int save_ihex32_buffer(struct save_context *context, struct buffer *buffer)
+{
+    size_t index;
+
+    if (!buffer->count)
+    {
+        int result;
+
+        if ((result = save_ihex32_extent(context, 0)))
+            return result;
+    }
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        int result;
+
+        context->origin = buffer->extents[index].origin;
+        context->size = buffer->extents[index].size;
+        context->data = (const uint8_t *)buffer->data + context->origin - buffer->origin;
+
+        if ((result = save_ihex32_extent(context, 0)))
+            return result;
+    }
+
+    context->origin = 0;
+    return write_ihex32_record(context, INTEL_END_OF_FILE, 0, 0);
+}
+
+static int save_ihex32_stream(struct save_context *context, int (*pull)(void *argument, struct extent *block, uint8_t *data), void *argument)
+{
+    uint8_t carry[2 * BUFFER_BLOCK];
+    struct extent block;
+    size_t used = 0;
+    int started = 0;
+
+    for (;;)
+    {
+        int result;
+        const int pulled = pull(argument, &block, carry + used);
+        const int joined = pulled > 0 && started && block.origin == context->origin + used;
+
+        if (pulled < 0)
+            return INTERNAL_ERROR;
+
+        if (used && !joined)
+        {
+            context->data = carry;
+            context->size = used;
+
+            if ((result = save_ihex32_extent(context, 0)))
+                return result;
+
+            if (pulled)
+                memmove(carry, carry + used, block.size);
+
+            used = 0;
+        }
+
+        if (!pulled)
+            break;
+
+        if (!joined)
+        {
+            context->origin = block.origin;
+            context->skipping = 0;
+            started = 1;
+        }
+
+        context->data = carry;
+        context->size = used + block.size;
+
+        if ((result = save_ihex32_extent(context, 1)))
+            return result;
+
+        used = context->size;
+        memmove(carry, context->data, used);
+    }
+
+    context->origin = 0;
+    return write_ihex32_record(context, INTEL_END_OF_FILE, 0, 0);
+}
+
+static int finish_ihex32(struct save_context *context, int result)
+{
+    if (!result)
+        result = flush_ihex32(context, OUTPUT_SIZE + 1);
+
+    free(context->output);
+
+    if (fclose(context->stream) && !result)
+        return INTERNAL_ERROR;
+
+    return result;
+}
+
+static int write_binary(int stream, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    while (size)
+    {
+        const ssize_t count = write(stream, p, size);
+
+        if (count <= 0)
+            return INTERNAL_ERROR;
+
+        p += count;
+        size -= count;
+    }
+
+    return DONE;
+}
+
+static int write_blank(int stream, size_t size)
+{
+    static const uint8_t blank[4096] =
+    {
+        [0 ... 4095] = 0xFF
+    };
+
+    while (size)
+    {
+        int result;
+        const size_t count = size < sizeof(blank) ? size : sizeof(blank);
+
+        if ((result = write_binary(stream, blank, count)))
+            return result;
+
+        size -= count;
+    }
+
+    return DONE;
+}
+
+static int save_binary_buffer(struct buffer *buffer, int stream)
+{
+    const struct extent whole = {buffer->origin, buffer->size};
+    const struct extent *extents = buffer->count ? buffer->extents : &whole;
+    const size_t count = buffer->count ? buffer->count : 1;
+    uint32_t address = extents[0].origin;
+    size_t index;
+
+    for (index = 0; index < count; index++)
+    {
+        int result;
+
+        if ((result = write_blank(stream, extents[index].origin - address)))
+            return result;
+
+        if ((result = write_binary(stream, (const uint8_t *)buffer->data + extents[index].origin - buffer->origin, extents[index].size)))
+            return result;
+
+        address = extents[index].origin + extents[index].size;
+    }
+
+    return DONE;
+}
+
+static int save_binary_stream(int stream, int (*pull)(void *argument, struct extent *block, uint8_t *data), void *argument)
+{
+    uint8_t data[BUFFER_BLOCK];
+    struct extent block;
+    uint32_t address = 0;
+    int started = 0;
+    int pulled;
+
+    while ((pulled = pull(argument, &block, data)) > 0)
+    {
+        int result;
+
+        if (started && (result = write_blank(stream, block.origin - address)))
+            return result;
+
+        if ((result = write_binary(stream, data, block.size)))
+            return result;
+
+        address = block.origin + block.size;
+        started = 1;
+    }
+
+    return pulled < 0 ? INTERNAL_ERROR : DONE;
+}
+
+static int binary_output(const char *file)
+{
+    const size_t length = strlen(file);
+
+    return length > 4 && !strcasecmp(file + length - 4, ".bin");
+}
+
+int bundle_output(const char *file)
+{
+    const size_t length = strlen(file);
+
+    return length > 4 && !strcasecmp(file + length - 4, ".swb");
+}
+
+static void copy_bundle_page(const struct buffer *buffer, uint32_t origin, uint8_t *page)
+{
+    const uint32_t begin = origin > buffer->origin ? origin : buffer->origin;
+    const uint32_t end = origin + BUFFER_PAGE < buffer->origin + buffer->size ? origin + BUFFER_PAGE : buffer->origin + buffer->size;
+
+    memset(page, 0xFF, BUFFER_PAGE);
+
+    if (begin < end)
+        memcpy(page + begin - origin, (const uint8_t *)buffer->data + begin - buffer->origin, end - begin);
+}
+
+static int save_bundle_pages(const struct buffer *buffer, int stream, uint32_t *hashes, struct bundle_block *blocks, size_t pages, uint32_t offset)
+{
+    const uint32_t first = buffer->origin & ~(BUFFER_PAGE - 1);
+    uint8_t page[BUFFER_PAGE];
+    uint8_t packed[BUFFER_PAGE];
+    size_t index;
+
+    for (index = 0; index < pages; index++)
+    {
+        int result;
+        size_t size;
+        struct buffer view =
+        {
+            0, first + index * BUFFER_PAGE, BUFFER_PAGE, page
+        };
+
+        copy_bundle_page(buffer, view.origin, page);
+        hashes[index] = crc32(0, page, BUFFER_PAGE);
+        blocks[index].offset = offset;
+        blocks[index].flags = 0;
+        blocks[index].size = 0;
+
+        if (blank_buffer(&view, view.origin, BUFFER_PAGE))
+            continue;
+
+        if ((size = compress_lz4(page, BUFFER_PAGE, packed, BUFFER_PAGE - 1)))
+        {
+            blocks[index].flags = BUNDLE_LZ4;
+            result = write_binary(stream, packed, size);
+        }
+        else
+        {
+            size = BUFFER_PAGE;
+            result = write_binary(stream, page, size);
+        }
+
+        if (result)
+            return result;
+
+        blocks[index].size = size;
+        offset += size;
+    }
+
+    return DONE;
+}
+
+static int save_bundle_buffer(const struct buffer *buffer, int stream)
+{
+    int result;
+    struct bundle_header header =
+    {
+        BUNDLE_MAGIC, BUNDLE_VERSION, buffer->pid, buffer->startup, buffer->origin, buffer->size, buffer->count, bundle_pages(buffer->origin, buffer->size), 0
+    };
+    const size_t tables = header.count * sizeof(struct bundle_extent) + header.pages * (sizeof(uint32_t) + sizeof(struct bundle_block));
+    struct bundle_extent *extents;
+    uint32_t *hashes;
+    size_t index;
+
+    if (!(extents = malloc(tables + 1)))
+        return INTERNAL_ERROR;
+
+    hashes = (uint32_t *)(extents + header.count);
+
+    for (index = 0; index < header.count; index++)
+    {
+        extents[index].origin = buffer->extents[index].origin;
+        extents[index].size = buffer->extents[index].size;
+    }
+
+    if (lseek(stream, sizeof(header) + tables, SEEK_SET) < 0)
+        result = INTERNAL_ERROR;
+    else
+        result = save_bundle_pages(buffer, stream, hashes, (struct bundle_block *)(hashes + header.pages), header.pages, sizeof(header) + tables);
+
+    header.crc = bundle_crc(&header, extents, tables);
+
+    if (!result && lseek(stream, 0, SEEK_SET) < 0)
+        result = INTERNAL_ERROR;
+
+    if (!result && !(result = write_binary(stream, &header, sizeof(header))))
+        result = write_binary(stream, extents, tables);
+
+    free(extents);
+    return result;
+}
+
+static int create_output(const char *file, char *temporary, size_t size)
+{
+    struct stat status;
+
+    if (stat(file, &status) < 0 ? errno != ENOENT : !S_ISREG(status.st_mode))
+        snprintf(temporary, size, "%s", file);
+    else
+        snprintf(temporary, size, "%s.%d", file, (int)getpid());
+
+    return open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+static int commit_output(const char *file, const char *temporary, int result)
+{
+    if (!strcmp(file, temporary))
+        return result;
+
+    if (!result && rename(temporary, file) < 0)
+        result = INTERNAL_ERROR;
+
+    if (result)
+        unlink(temporary);
+
+    return result;
+}
+
+static int open_ihex32_output(struct save_context *context, const char *file, char *temporary, size_t size)
+{
+    const int stream = create_output(file, temporary, size);
+
+    if (stream < 0)
+        return INTERNAL_ERROR;
+
+    if (!(context->stream = fdopen(stream, "wt")))
+    {
+        close(stream);
+        return commit_output(file, temporary, INTERNAL_ERROR);
+    }
+
+    return DONE;
+}
+
+int save_file_buffer(struct buffer *buffer, const char *file, size_t record, int skip)
+{
+    int result;
+    char temporary[PATH_MAX + 16];
+    struct save_context context =
+    {
+        buffer->origin, buffer->size, (const uint8_t *)buffer->data, 0, record, skip, 0, 0
+    };
+
+    if (record < 1 || record > 255)
+        return INTERNAL_ERROR;
+
+    if (binary_output(file) || bundle_output(file))
+    {
+        int stream = create_output(file, temporary, sizeof(temporary));
+        if (stream < 0)
+            return INTERNAL_ERROR;
+
+        result = bundle_output(file) ? save_bundle_buffer(buffer, stream) : save_binary_buffer(buffer, stream);
+
+        if (close(stream) && !result)
+            result = INTERNAL_ERROR;
+
+        return commit_output(file, temporary, result);
+    }
+
+    pthread_once(&pairs_once, build_pairs);
+
+    if ((result = open_ihex32_output(&context, file, temporary, sizeof(temporary))))
+        return result;
+
+    if (!(context.output = malloc(OUTPUT_SIZE)))
+    {
+        fclose(context.stream);
+        return commit_output(file, temporary, INTERNAL_ERROR);
+    }
+
+    return commit_output(file, temporary, finish_ihex32(&context, save_ihex32_buffer(&context, buffer)));
+}
+
+int save_file_stream(const char *file, int descriptor, size_t record, int skip, int (*pull)(void *argument, struct extent *block, uint8_t *data), void *argument)
+{
+    int result;
+    char temporary[PATH_MAX + 16];
+    struct save_context context =
+    {
+        0, 0, 0, 0, record, skip, 0, 0
+    };
+
+    if (record < 1 || record > 255)
+        return INTERNAL_ERROR;
+
+    snprintf(temporary, sizeof(temporary), "%s", file);
+
+    if (binary_output(file))
+    {
+        int stream = descriptor < 0 ? create_output(file, temporary, sizeof(temporary)) : dup(descriptor);
+        if (stream < 0)
+            return INTERNAL_ERROR;
+
+        result = save_binary_stream(stream, pull, argument);
+
+        if (close(stream) && !result)
+            result = INTERNAL_ERROR;
+
+        return commit_output(file, temporary, result);
+    }
+
+    pthread_once(&pairs_once, build_pairs);
+
+    if (descriptor < 0)
+    {
+        if ((result = open_ihex32_output(&context, file, temporary, sizeof(temporary))))
+            return result;
+    }
+    else
+    {
+        int stream = dup(descriptor);
+        if (stream < 0)
+            return INTERNAL_ERROR;
+
+        if (!(context.stream = fdopen(stream, "wt")))
+        {
+            close(stream);
+            return INTERNAL_ERROR;
+        }
+    }
+
+    if (!(context.output = malloc(OUTPUT_SIZE)))
+    {
+        fclose(context.stream);
+        return commit_output(file, temporary, INTERNAL_ERROR);
+    }
+
+    return commit_output(file, temporary, finish_ihex32(&context, save_ihex32_stream(&context, pull, argument)));
+}
+
+static int store_buffer(struct buffer *buffer, uint32_t origin, const void *data, size_t size, int exact)
+{
+    int result;
+    struct load_context context;
+
+    memset(&context, 0, sizeof(context));
+    context.origin = buffer->origin;
+    context.size = buffer->size;
+    context.data = buffer->data;
+    context.count = buffer->count;
+    context.extents = buffer->extents;
+    context.exact = exact;
+
+    if ((result = store_data(&context, origin, data, size)))
+        return result;
+
+    buffer->count = context.count;
+    buffer->hashes = 0;
+    buffer->hashed = 0;
+    return DONE;
+}
+
+int patch_buffer(struct buffer *buffer, uint32_t origin, const void *data, size_t size)
+{
+    return store_buffer(buffer, origin, data, size, 1);
+}
+
+int merge_buffer(struct buffer *target, const struct buffer *source)
+{
+    size_t index;
+
+    if (!source->count)
+        return store_buffer(target, source->origin, source->data, source->size, 0);
+
+    for (index = 0; index < source->count; index++)
+    {
+        int result;
+        const struct extent *extent = source->extents + index;
+
+        if ((result = store_buffer(target, extent->origin, (const uint8_t *)source->data + extent->origin - source->origin, extent->size, 0)))
+            return result;
+    }
+
+    return DONE;
+}
+
+void clear_buffer(struct buffer *buffer, uint8_t value)
 {
     memset(buffer->data, value, buffer->size);
 }
+
+int overlap_buffer(const struct buffer *buffer, uint32_t origin, size_t size)
+{
+    size_t index;
+
+    if (!buffer->count)
+        return buffer->size && origin < buffer->origin + buffer->size && origin + size > buffer->origin;
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        const struct extent *extent = buffer->extents + index;
+
+        if (origin < extent->origin + extent->size && origin + size > extent->origin)
+            return 1;
+    }
+
+    return 0;
+}
+
+int blank_buffer(const struct buffer *buffer, uint32_t origin, size_t size)
+{
+    const uint8_t *data = (const uint8_t *)buffer->data + origin - buffer->origin;
+    uint64_t words[4] = {~0ULL, ~0ULL, ~0ULL, ~0ULL};
+    uint64_t word;
+
+    while (size >= sizeof(words))
+    {
+        uint64_t scratch[4];
+
+        memcpy(scratch, data, sizeof(scratch));
+        words[0] &= scratch[0];
+        words[1] &= scratch[1];
+        words[2] &= scratch[2];
+        words[3] &= scratch[3];
+        data += sizeof(scratch);
+        size -= sizeof(scratch);
+    }
+
+    word = words[0] & words[1] & words[2] & words[3];
+
+    while (size--)
+        word &= 0xFFFFFFFFFFFFFF00ULL | *data++;
+
+    return word == ~0ULL;
+}
+
+uint32_t hash_buffer(const struct buffer *buffer, uint32_t origin, size_t size)
+{
+    const uint32_t first = buffer->origin & ~(BUFFER_PAGE - 1);
+    const uint32_t end = origin + size;
+    uint32_t crc = 0;
+
+    while (origin < end)
+    {
+        const size_t index = (origin - first) / BUFFER_PAGE;
+        size_t count = BUFFER_PAGE - origin % BUFFER_PAGE;
+        uint32_t hash;
+
+        if (count > end - origin)
+            count = end - origin;
+
+        if (count == BUFFER_PAGE && origin >= first && index < buffer->hashed)
+            hash = buffer->hashes[index];
+        else
+            hash = hash_range(buffer, origin, count);
+
+        crc = crc32(crc, &hash, sizeof(hash));
+        origin += count;
+    }
+
+    return crc;
+}
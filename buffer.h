@@ -27,16 +27,45 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#define BUFFER_EXTENTS 256
+#define BUFFER_BLOCK 256
+#define BUFFER_PAGE 1024
+#define BUFFER_VERSION 1
+
+struct extent
+{
+    uint32_t origin;
+    size_t size;
+};
+
 struct buffer
 {
     uint32_t startup;
     uint32_t origin;
     size_t size;
     void *data;
+    size_t count;
+    struct extent extents[BUFFER_EXTENTS];
+    void *mapping;
+    size_t mapped;
+    const uint32_t *hashes;
+    size_t hashed;
+    uint16_t pid;
 };
 
-int load_file_buffer(struct buffer *buffer, const char *file);
-int save_file_buffer(struct buffer *buffer, const char *file);
+int regular_file(const char *file);
+int load_file_buffer(struct buffer *buffer, const char *file, uint32_t base);
+int load_patch_buffer(struct buffer *buffer, const char *file, uint32_t base);
+int stream_file_buffer(struct buffer *buffer, const char *file, uint32_t base, int wake, int (*emit)(void *argument, uint32_t origin, size_t size), void *argument);
+void unload_file_buffer(struct buffer *buffer);
+int bundle_output(const char *file);
+int save_file_buffer(struct buffer *buffer, const char *file, size_t record, int skip);
+int save_file_stream(const char *file, int descriptor, size_t record, int skip, int (*pull)(void *argument, struct extent *block, uint8_t *data), void *argument);
+int patch_buffer(struct buffer *buffer, uint32_t origin, const void *data, size_t size);
+int merge_buffer(struct buffer *target, const struct buffer *source);
 void clear_buffer(struct buffer *buffer, uint8_t value);
+int overlap_buffer(const struct buffer *buffer, uint32_t origin, size_t size);
+int blank_buffer(const struct buffer *buffer, uint32_t origin, size_t size);
+uint32_t hash_buffer(const struct buffer *buffer, uint32_t origin, size_t size);
 
 #endif
@@ -0,0 +1,491 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "crc.h"
+#include "errors.h"
+#include "cache.h"
+
+#define CACHE_MAGIC 0x504D5753
+#define CACHE_VERSION 2
+#define IMAGE_MAGIC 0x494D5753
+#define IMAGE_VERSION 3
+#define IMAGE_LIMIT 64
+
+struct header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t pid;
+    uint32_t count;
+};
+
+struct image_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t loader;
+    uint64_t length;
+    uint64_t hash;
+    uint32_t crc;
+    uint32_t startup;
+    uint32_t origin;
+    uint32_t size;
+    uint32_t count;
+    uint32_t hashed;
+};
+
+struct image_extent
+{
+    uint32_t origin;
+    uint32_t size;
+};
+
+struct image_entry
+{
+    struct timespec time;
+    off_t size;
+    char name[NAME_MAX + 1];
+};
+
+static int make_directory(const char *path)
+{
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        return INTERNAL_ERROR;
+
+    return DONE;
+}
+
+static int cache_directory(char *path, size_t size, int create)
+{
+    int result;
+    const char *base = getenv("XDG_CACHE_HOME");
+
+    if (base && *base)
+    {
+        snprintf(path, size, "%s", base);
+    }
+    else
+    {
+        if (!(base = getenv("HOME")))
+            return INTERNAL_ERROR;
+
+        snprintf(path, size, "%s/.cache", base);
+    }
+
+    if (create && (result = make_directory(path)))
+        return result;
+
+    strncat(path, "/swamp-boot", size - strlen(path) - 1);
+    return create ? make_directory(path) : DONE;
+}
+
+static FILE *open_temporary(const char *path, char *temporary, size_t size)
+{
+    int stream;
+    FILE *file;
+
+    snprintf(temporary, size, "%s.XXXXXX", path);
+
+    if ((stream = mkstemp(temporary)) < 0)
+        return 0;
+
+    if (!(file = fdopen(stream, "wb")))
+    {
+        close(stream);
+        unlink(temporary);
+        return 0;
+    }
+
+    return file;
+}
+
+static int device_cache_file(const uint8_t *uid, char *path, size_t size, int create)
+{
+    int result;
+    int index;
+
+    if ((result = cache_directory(path, size, create)))
+        return result;
+
+    strncat(path, "/device-", size - strlen(path) - 1);
+
+    for (index = 0; index < DEVICE_UID_SIZE; index++)
+        snprintf(path + strlen(path), size - strlen(path), "%02X", uid[index]);
+
+    return DONE;
+}
+
+int load_device_cache(const uint8_t *uid, uint16_t pid, uint32_t *hashes, size_t count)
+{
+    int result;
+    char path[PATH_MAX];
+    struct header header;
+    FILE *stream;
+
+    if ((result = device_cache_file(uid, path, sizeof(path), 0)))
+        return result;
+
+    if (!(stream = fopen(path, "rb")))
+        return INTERNAL_ERROR;
+
+    if (fread(&header, sizeof(header), 1, stream) != 1 || header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.pid != pid || header.count != count)
+    {
+        fclose(stream);
+        return INVALID_FILE_CONTENT;
+    }
+
+    if (fread(hashes, sizeof(uint32_t), count, stream) != count)
+    {
+        fclose(stream);
+        return INVALID_FILE_CONTENT;
+    }
+
+    if (fclose(stream))
+        return INTERNAL_ERROR;
+
+    return DONE;
+}
+
+int save_device_cache(const uint8_t *uid, uint16_t pid, const uint32_t *hashes, size_t count)
+{
+    int result;
+    char path[PATH_MAX];
+    char temporary[PATH_MAX + 16];
+    struct header header = {CACHE_MAGIC, CACHE_VERSION, pid, count};
+    FILE *stream;
+
+    if ((result = device_cache_file(uid, path, sizeof(path), 1)))
+        return result;
+
+    if (!(stream = open_temporary(path, temporary, sizeof(temporary))))
+        return INTERNAL_ERROR;
+
+    if (fwrite(&header, sizeof(header), 1, stream) != 1 || fwrite(hashes, sizeof(uint32_t), count, stream) != count)
+    {
+        fclose(stream);
+        unlink(temporary);
+        return INTERNAL_ERROR;
+    }
+
+    if (fclose(stream) || rename(temporary, path) < 0)
+    {
+        unlink(temporary);
+        return INTERNAL_ERROR;
+    }
+
+    return DONE;
+}
+
+int drop_device_cache(const uint8_t *uid)
+{
+    int result;
+    char path[PATH_MAX];
+
+    if ((result = device_cache_file(uid, path, sizeof(path), 0)))
+        return result;
+
+    if (unlink(path) < 0 && errno != ENOENT)
+        return INTERNAL_ERROR;
+
+    return DONE;
+}
+
+static int image_cache_file(const struct image_key *key, char *path, size_t size, int create)
+{
+    int result;
+
+    if ((result = cache_directory(path, size, create)))
+        return result;
+
+    snprintf(path + strlen(path), size - strlen(path), "/image-%04X-%08X%016llX", key->version, key->crc, (unsigned long long)key->hash);
+    return DONE;
+}
+
+static int valid_image_header(const struct image_header *header, const struct image_key *key, const struct buffer *buffer)
+{
+    if (header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION || header->loader != key->version)
+        return 0;
+
+    if (header->length != key->length || header->hash != key->hash || header->crc != key->crc)
+        return 0;
+
+    if (header->count > BUFFER_EXTENTS || header->hashed > header->size / BUFFER_PAGE + 2)
+        return 0;
+
+    return header->origin >= buffer->origin && header->origin - buffer->origin <= buffer->size && header->size <= buffer->size - (header->origin - buffer->origin);
+}
+
+size_t limit_image_cache(void)
+{
+    const char *limit = getenv("SWAMP_BOOT_CACHE");
+    unsigned long size;
+    char *end;
+
+    if (!limit || !*limit)
+        return (size_t)IMAGE_LIMIT << 20;
+
+    size = strtoul(limit, &end, 10);
+
+    if (*end || size > SIZE_MAX >> 20)
+        return (size_t)IMAGE_LIMIT << 20;
+
+    return (size_t)size << 20;
+}
+
+static int compare_entries(const void *first, const void *second)
+{
+    const struct image_entry *a = first;
+    const struct image_entry *b = second;
+
+    if (a->time.tv_sec != b->time.tv_sec)
+        return a->time.tv_sec < b->time.tv_sec ? -1 : 1;
+
+    if (a->time.tv_nsec != b->time.tv_nsec)
+        return a->time.tv_nsec < b->time.tv_nsec ? -1 : 1;
+
+    return 0;
+}
+
+static void trim_image_cache(size_t limit)
+{
+    char path[PATH_MAX];
+    struct image_entry *entries = 0;
+    struct dirent *entry;
+    size_t capacity = 0;
+    size_t count = 0;
+    size_t total = 0;
+    size_t index;
+    DIR *directory;
+
+    if (cache_directory(path, sizeof(path), 0) || !(directory = opendir(path)))
+        return;
+
+    while ((entry = readdir(directory)))
+    {
+        struct stat status;
+
+        if (strncmp(entry->d_name, "image-", 6) || strchr(entry->d_name, '.'))
+            continue;
+
+        if (fstatat(dirfd(directory), entry->d_name, &status, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(status.st_mode))
+            continue;
+
+        if (count == capacity)
+        {
+            struct image_entry *larger = realloc(entries, (capacity ? 2 * capacity : 16) * sizeof(struct image_entry));
+
+            if (!larger)
+                break;
+
+            entries = larger;
+            capacity = capacity ? 2 * capacity : 16;
+        }
+
+        entries[count].time = status.st_mtim;
+        entries[count].size = status.st_size;
+        snprintf(entries[count].name, sizeof(entries[count].name), "%s", entry->d_name);
+        total += status.st_size;
+        count++;
+    }
+
+    qsort(entries, count, sizeof(struct image_entry), compare_entries);
+
+    for (index = 0; index < count && total > limit; index++)
+    {
+        if (!unlinkat(dirfd(directory), entries[index].name, 0) || errno == ENOENT)
+            total -= entries[index].size;
+    }
+
+    closedir(directory);
+    free(entries);
+}
+
+void key_image_cache(struct image_key *key, const void *source, size_t length, uint16_t version)
+{
+    const uint8_t *bytes = source;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    size_t index;
+
+    for (index = 0; index + sizeof(uint64_t) <= length; index += sizeof(uint64_t))
+    {
+        uint64_t word;
+
+        memcpy(&word, bytes + index, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ULL;
+        hash ^= hash >> 32;
+    }
+
+    for (; index < length; index++)
+        hash = (hash ^ bytes[index]) * 0x100000001B3ULL;
+
+    key->length = length;
+    key->hash = hash;
+    key->crc = crc32(0, source, length);
+    key->version = version;
+}
+
+int load_image_cache(const struct image_key *key, struct buffer *buffer)
+{
+    int result;
+    int stream;
+    char path[PATH_MAX];
+    struct stat status;
+    const struct image_header *header;
+    const struct image_extent *extents;
+    const uint8_t *bytes;
+    uint8_t *map;
+    size_t offset;
+    size_t total = 0;
+    size_t index;
+
+    if ((result = image_cache_file(key, path, sizeof(path), 0)))
+        return result;
+
+    if ((stream = open(path, O_RDONLY)) < 0)
+        return INTERNAL_ERROR;
+
+    if (fstat(stream, &status) || (size_t)status.st_size < sizeof(struct image_header))
+    {
+        close(stream);
+        return INVALID_FILE_CONTENT;
+    }
+
+    map = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, stream, 0);
+    futimens(stream, 0);
+    close(stream);
+
+    if (map == MAP_FAILED)
+        return INTERNAL_ERROR;
+
+    header = (const struct image_header *)map;
+    extents = (const struct image_extent *)(header + 1);
+    offset = sizeof(struct image_header) + header->count * sizeof(struct image_extent) + header->hashed * sizeof(uint32_t);
+
+    if (!valid_image_header(header, key, buffer) || offset > (size_t)status.st_size)
+    {
+        munmap(map, status.st_size);
+        return INVALID_FILE_CONTENT;
+    }
+
+    for (index = 0; index < header->count; index++)
+    {
+        if (extents[index].origin < header->origin || extents[index].origin - header->origin > header->size || extents[index].size > header->size - (extents[index].origin - header->origin))
+        {
+            munmap(map, status.st_size);
+            return INVALID_FILE_CONTENT;
+        }
+
+        total += extents[index].size;
+    }
+
+    if (offset + total != (size_t)status.st_size)
+    {
+        munmap(map, status.st_size);
+        return INVALID_FILE_CONTENT;
+    }
+
+    buffer->data = (uint8_t *)buffer->data + (header->origin - buffer->origin);
+    buffer->origin = header->origin;
+    buffer->size = header->size;
+    clear_buffer(buffer, 0xFF);
+
+    for (index = 0, bytes = map + offset; index < header->count; bytes += extents[index].size, index++)
+    {
+        memcpy((uint8_t *)buffer->data + extents[index].origin - header->origin, bytes, extents[index].size);
+        buffer->extents[index].origin = extents[index].origin;
+        buffer->extents[index].size = extents[index].size;
+    }
+
+    buffer->startup = header->startup;
+    buffer->count = header->count;
+    buffer->mapping = map;
+    buffer->mapped = status.st_size;
+    buffer->hashes = (const uint32_t *)(extents + header->count);
+    buffer->hashed = header->hashed;
+    buffer->pid = 0;
+    return DONE;
+}
+
+int save_image_cache(const struct image_key *key, const struct buffer *buffer, const uint32_t *hashes, size_t hashed)
+{
+    int result;
+    char path[PATH_MAX];
+    char temporary[PATH_MAX + 16];
+    struct image_header header =
+    {
+        IMAGE_MAGIC, IMAGE_VERSION, key->version, key->length, key->hash, key->crc, buffer->startup, buffer->origin, buffer->size, buffer->count, hashed
+    };
+    const size_t limit = limit_image_cache();
+    FILE *stream;
+    size_t total = 0;
+    size_t index;
+
+    for (index = 0; index < buffer->count; index++)
+        total += buffer->extents[index].size;
+
+    if (sizeof(header) + buffer->count * sizeof(struct image_extent) + hashed * sizeof(uint32_t) + total > limit)
+        return DONE;
+
+    if ((result = image_cache_file(key, path, sizeof(path), 1)))
+        return result;
+
+    if (!(stream = open_temporary(path, temporary, sizeof(temporary))))
+        return INTERNAL_ERROR;
+
+    result = fwrite(&header, sizeof(header), 1, stream) != 1;
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        const struct image_extent extent = {buffer->extents[index].origin, buffer->extents[index].size};
+
+        result |= fwrite(&extent, sizeof(extent), 1, stream) != 1;
+    }
+
+    result |= fwrite(hashes, sizeof(uint32_t), hashed, stream) != hashed;
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        const uint8_t *data = (const uint8_t *)buffer->data + buffer->extents[index].origin - buffer->origin;
+
+        result |= fwrite(data, 1, buffer->extents[index].size, stream) != buffer->extents[index].size;
+    }
+
+    if (fclose(stream) || result || rename(temporary, path) < 0)
+    {
+        unlink(temporary);
+        return INTERNAL_ERROR;
+    }
+
+    trim_image_cache(limit);
+    return DONE;
+}
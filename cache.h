@@ -0,0 +1,49 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "buffer.h"
+
+#define DEVICE_UID_SIZE 12
+
+struct image_key
+{
+    uint64_t length;
+    uint64_t hash;
+    uint32_t crc;
+    uint16_t version;
+};
+
+int load_device_cache(const uint8_t *uid, uint16_t pid, uint32_t *hashes, size_t count);
+int save_device_cache(const uint8_t *uid, uint16_t pid, const uint32_t *hashes, size_t count);
+int drop_device_cache(const uint8_t *uid);
+size_t limit_image_cache(void);
+void key_image_cache(struct image_key *key, const void *source, size_t length, uint16_t version);
+int load_image_cache(const struct image_key *key, struct buffer *buffer);
+int save_image_cache(const struct image_key *key, const struct buffer *buffer, const uint32_t *hashes, size_t hashed);
+
+#endif
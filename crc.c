@@ -0,0 +1,93 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <pthread.h>
+#include "crc.h"
+
+static uint32_t table[256];
+static uint32_t words_table[256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static pthread_once_t words_table_once = PTHREAD_ONCE_INIT;
+
+static void build_table(void)
+{
+    uint32_t index;
+
+    for (index = 0; index < 256; index++)
+    {
+        uint32_t value = index;
+        int count = 8;
+
+        while (count--)
+            value = value & 1 ? (value >> 1) ^ 0xEDB88320 : value >> 1;
+
+        table[index] = value;
+    }
+}
+
+static void build_words_table(void)
+{
+    uint32_t index;
+
+    for (index = 0; index < 256; index++)
+    {
+        uint32_t value = index << 24;
+        int count = 8;
+
+        while (count--)
+            value = value & 0x80000000 ? (value << 1) ^ 0x04C11DB7 : value << 1;
+
+        words_table[index] = value;
+    }
+}
+
+uint32_t crc32(uint32_t crc, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    pthread_once(&table_once, build_table);
+
+    crc = ~crc;
+
+    while (size--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+uint32_t crc32_words(uint32_t crc, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    pthread_once(&words_table_once, build_words_table);
+
+    for (; size >= 4; size -= 4, p += 4)
+    {
+        int index = 4;
+
+        while (index--)
+            crc = words_table[(crc >> 24 ^ p[index]) & 0xFF] ^ crc << 8;
+    }
+
+    return crc;
+}
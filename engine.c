@@ -0,0 +1,862 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "cache.h"
+#include "engine.h"
+#include "errors.h"
+#include "options.h"
+
+#define HEAD_ACK 0x01
+#define TAIL_ACK 0x02
+#define TIMED_ACK 0x04
+
+static int enter_machine(struct machine *machine, enum state state);
+
+static int engine_step(const struct step *step)
+{
+    const struct settings *settings = &step->settings;
+
+    switch (step->action)
+    {
+    case ERASE_ACTION:
+    case DISCONNECT_ACTION:
+        return 1;
+
+    case WRITE_ACTION:
+        return !(settings->loader && settings->loader->count) && !settings->delta_write && !settings->page_erase;
+
+    default:
+        return 0;
+    }
+}
+
+int accept_engine(const struct gang *gang)
+{
+    size_t index;
+
+    for (index = 0; index < gang->steps; index++)
+    {
+        if (!engine_step(gang->plan + index))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int watch_machine(struct machine *machine, int events)
+{
+    struct epoll_event event;
+
+    if (machine->events == events)
+        return DONE;
+
+    event.events = events;
+    event.data.ptr = machine;
+
+    if (epoll_ctl(machine->epoll, machine->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, machine->port->session.serial.fd, &event) < 0)
+        return INTERNAL_ERROR;
+
+    machine->events = events;
+    return DONE;
+}
+
+static void stop_machine(struct machine *machine, int result)
+{
+    struct port *port = machine->port;
+
+    if (machine->events && port->session.serial.fd >= 0)
+        epoll_ctl(machine->epoll, EPOLL_CTL_DEL, port->session.serial.fd, 0);
+
+    machine->events = 0;
+    machine->active = 0;
+    port->result = result;
+    port->error = errno;
+}
+
+static int send_machine(struct machine *machine)
+{
+    struct session *session = &machine->port->session;
+
+    while (machine->sent < machine->size)
+    {
+        const ssize_t count = write(session->serial.fd, session->buffer + machine->sent, machine->size - machine->sent);
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN)
+                break;
+
+            return INTERNAL_ERROR;
+        }
+
+        machine->sent += count;
+    }
+
+    return watch_machine(machine, machine->sent < machine->size ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+static int exchange_machine(struct machine *machine, size_t size, size_t want, int timeout, int flags)
+{
+    machine->size = size;
+    machine->sent = 0;
+    machine->want = want;
+    machine->got = 0;
+    machine->flags = flags;
+    machine->start = clock_serial_port();
+    machine->deadline = machine->start + (int64_t)session_timeout(&machine->port->session, timeout, size + want) * 1000;
+    return send_machine(machine);
+}
+
+static int request_machine(struct machine *machine, size_t size, size_t want, int timeout, int flags)
+{
+    struct session *session = &machine->port->session;
+
+    session->buffer[size] = session_checksum(session->buffer, size);
+    return exchange_machine(machine, size + 1, want, timeout, flags | HEAD_ACK | TIMED_ACK);
+}
+
+static int pause_machine(struct machine *machine, int ms)
+{
+    machine->size = 0;
+    machine->sent = 0;
+    machine->want = 0;
+    machine->got = 0;
+    machine->flags = 0;
+    machine->deadline = clock_serial_port() + (int64_t)ms * 1000;
+    return DONE;
+}
+
+static int address_machine(struct machine *machine)
+{
+    struct session *session = &machine->port->session;
+
+    session->buffer[0] = machine->origin >> 24;
+    session->buffer[1] = machine->origin >> 16;
+    session->buffer[2] = machine->origin >> 8;
+    session->buffer[3] = machine->origin;
+    return request_machine(machine, 4, 1, ACK_TIMEOUT, 0);
+}
+
+static int read_machine(struct machine *machine, uint32_t address, uint8_t *data, size_t count)
+{
+    machine->back = machine->state;
+    machine->origin = address;
+    machine->target = data;
+    machine->amount = count;
+    return enter_machine(machine, READ_STATE);
+}
+
+static int write_machine(struct machine *machine, uint32_t address, const uint8_t *data, size_t count)
+{
+    machine->back = machine->state;
+    machine->origin = address;
+    machine->source = data;
+    machine->amount = count;
+    return enter_machine(machine, WRITE_STATE);
+}
+
+static int reset_machine(struct machine *machine, int phase)
+{
+    struct session *session = &machine->port->session;
+    const int state[2][6] =
+    {
+        {1, 0, 1, 0, 1, 0},
+        {0, 1, 1, 0, 1, 0}
+    };
+
+    return control_serial_port(&session->serial, state[phase][session->settings->rts_mode], state[phase][session->settings->dtr_mode]);
+}
+
+static int restart_machine(struct machine *machine, int baud)
+{
+    int result;
+    struct session *session = &machine->port->session;
+
+    if ((result = speed_serial_port(&session->serial, baud)))
+        return result;
+
+    session->baud = baud;
+    return enter_machine(machine, RESET_STATE);
+}
+
+static int negotiate_machine(struct machine *machine)
+{
+    struct session *session = &machine->port->session;
+
+    while (session_baud(session->baud_index))
+    {
+        int result;
+
+        if ((result = restart_machine(machine, session_baud(session->baud_index))) != INVALID_OPTIONS_ARGUMENT)
+            return result;
+
+        session->baud_index++;
+    }
+
+    session->baud_index = 0;
+    return NO_DEVICE_REPLY;
+}
+
+static int retry_machine(struct machine *machine, int result)
+{
+    if (!machine->negotiating || (result != NO_DEVICE_REPLY && result != INVALID_DEVICE_REPLY))
+        return result;
+
+    machine->port->session.baud_index++;
+    return negotiate_machine(machine);
+}
+
+static int recover_machine(struct machine *machine, int result)
+{
+    struct session *session = &machine->port->session;
+
+    if (session->baud_index < 0 || (result != NO_DEVICE_REPLY && result != INVALID_DEVICE_REPLY))
+        return result;
+
+    if (session->errors++)
+    {
+        if (!session_baud(session->baud_index + 1))
+            return result;
+
+        session->baud_index++;
+        session->errors = 0;
+    }
+
+    session->blocks = 0;
+    fprintf(session->console, TTY_NONE "%d baud...", session_baud(session->baud_index));
+    machine->again = machine->state;
+    return restart_machine(machine, session_baud(session->baud_index));
+}
+
+static int start_machine(struct machine *machine)
+{
+    int result;
+    int flags;
+    struct port *port = machine->port;
+    struct session *session = &port->session;
+
+    if ((result = open_serial_port(&session->serial, port->file)))
+        return result;
+
+    if ((flags = fcntl(session->serial.fd, F_GETFL)) < 0 || fcntl(session->serial.fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return INTERNAL_ERROR;
+
+    session->baud_index = session->settings->baud_rate ? -1 : 0;
+    session->erased = 0;
+    session->identified = 0;
+    session->running = 0;
+
+    if (session->settings->low_latency && (result = latency_serial_port(&session->serial)))
+        return result;
+
+    if ((result = watch_machine(machine, EPOLLIN)))
+        return result;
+
+    machine->active = 1;
+    machine->again = GET_STATE;
+
+    if (session->baud_index < 0)
+    {
+        fprintf(session->console, TTY_NONE "%d baud...", session->settings->baud_rate);
+        return restart_machine(machine, session->settings->baud_rate);
+    }
+
+    machine->negotiating = 1;
+    return negotiate_machine(machine);
+}
+
+static int next_machine(struct machine *machine)
+{
+    machine->step++;
+    return enter_machine(machine, STEP_STATE);
+}
+
+static int rewind_machine(struct machine *machine, enum state state)
+{
+    machine->extent = 0;
+    machine->address = 0;
+    machine->match = 1;
+    machine->mismatches = 0;
+    return enter_machine(machine, state);
+}
+
+static int block_machine(struct machine *machine)
+{
+    const struct buffer *view = &machine->view;
+    const struct extent whole = {view->origin, view->size};
+
+    while (machine->extent < (view->count ? view->count : 1))
+    {
+        const struct extent *extent = view->count ? view->extents + machine->extent : &whole;
+
+        if (machine->address < extent->origin)
+            machine->address = extent->origin;
+
+        machine->end = extent->origin + extent->size;
+
+        if (machine->address < machine->end)
+        {
+            machine->length = machine->end - machine->address < 256 ? machine->end - machine->address : 256;
+            return 1;
+        }
+
+        machine->extent++;
+    }
+
+    return 0;
+}
+
+static const uint8_t *machine_data(const struct machine *machine)
+{
+    return (const uint8_t *)machine->view.data + machine->address - machine->view.origin;
+}
+
+static int step_machine(struct machine *machine)
+{
+    int result;
+    struct port *port = machine->port;
+    struct session *session = &port->session;
+    const struct step *step = port->gang->plan + machine->step;
+
+    if (machine->step == port->gang->steps)
+    {
+        stop_machine(machine, DONE);
+        return DONE;
+    }
+
+    session->settings = &step->settings;
+
+    switch (step->action)
+    {
+    case ERASE_ACTION:
+        fprintf(session->console, TTY_NONE "Erasing...");
+        return enter_machine(machine, IDENTIFY_STATE);
+
+    case WRITE_ACTION:
+        fprintf(session->console, TTY_NONE "Writing...");
+
+        if ((result = fit_gang(&machine->view, step->buffer, FLASH_ORIGIN, session->size)))
+            return result;
+
+        if (step->buffer->pid && step->buffer->pid != session->device->pid)
+            return UNSUPPORTED_DEVICE;
+
+        session->skipped = 0;
+        session->skipped_bytes = 0;
+        return enter_machine(machine, IDENTIFY_STATE);
+
+    case DISCONNECT_ACTION:
+        if (machine->events)
+            epoll_ctl(machine->epoll, EPOLL_CTL_DEL, session->serial.fd, 0);
+
+        machine->events = 0;
+
+        if ((result = disconnect_session(session)))
+            return result;
+
+        return next_machine(machine);
+
+    default:
+        return INTERNAL_ERROR;
+    }
+}
+
+static int identify_machine(struct machine *machine)
+{
+    struct port *port = machine->port;
+    struct session *session = &port->session;
+
+    if (session->identified)
+        drop_device_cache(session->uid);
+
+    if (port->gang->plan[machine->step].action == ERASE_ACTION)
+        return enter_machine(machine, ERASE_STATE);
+
+    return rewind_machine(machine, PROGRAM_STATE);
+}
+
+static int program_machine(struct machine *machine)
+{
+    struct session *session = &machine->port->session;
+
+    while (block_machine(machine))
+    {
+        if (!session->erased || machine->address < FLASH_ORIGIN || machine->address >= FLASH_ORIGIN + session->size || !blank_buffer(&machine->view, machine->address, machine->length))
+            return write_machine(machine, machine->address, machine_data(machine), machine->length);
+
+        session->skipped++;
+        session->skipped_bytes += machine->length;
+        account_session(session);
+        machine->address += machine->length;
+    }
+
+    report_session(session);
+
+    if (!session->settings->verify_write)
+        return next_machine(machine);
+
+    fprintf(session->console, TTY_NONE "Verifying...");
+
+    if (!machine->view.count)
+        return next_machine(machine);
+
+    return rewind_machine(machine, VERIFY_STATE);
+}
+
+static int verify_machine(struct machine *machine)
+{
+    struct session *session = &machine->port->session;
+
+    if (block_machine(machine))
+        return read_machine(machine, machine->address, session->window, machine->length);
+
+    return machine->mismatches ? INVALID_DEVICE_MEMORY : next_machine(machine);
+}
+
+static int compare_machine(struct machine *machine)
+{
+    struct session *session = &machine->port->session;
+
+    if (memcmp(session->window, machine_data(machine), machine->length))
+        machine->match = 0;
+
+    machine->address += machine->length;
+
+    if (machine->address < machine->end)
+        return enter_machine(machine, VERIFY_STATE);
+
+    if (!machine->match)
+    {
+        fprintf(session->console, TTY_NONE "%08X-%08X mismatch...", machine->view.extents[machine->extent].origin, machine->end - 1);
+        machine->mismatches++;
+    }
+
+    machine->match = 1;
+    return enter_machine(machine, VERIFY_STATE);
+}
+
+static int enter_machine(struct machine *machine, enum state state)
+{
+    struct session *session = &machine->port->session;
+
+    machine->state = state;
+
+    switch (state)
+    {
+    case RESET_STATE:
+        if (reset_machine(machine, 0))
+            return INTERNAL_ERROR;
+
+        return pause_machine(machine, 1);
+
+    case SYNC_STATE:
+        return pause_machine(machine, 5);
+
+    case HANDSHAKE_STATE:
+        if (flush_serial_port(&session->serial))
+            return INTERNAL_ERROR;
+
+        session->buffer[0] = 0x7F;
+        return exchange_machine(machine, 1, 1, HANDSHAKE_TIMEOUT, HEAD_ACK);
+
+    case GET_STATE:
+        session->buffer[0] = 0x00;
+        return request_machine(machine, 1, 2, ACK_TIMEOUT, 0);
+
+    case COMMANDS_STATE:
+        return exchange_machine(machine, 0, machine->count + 2, ACK_TIMEOUT, TAIL_ACK);
+
+    case ID_STATE:
+        session->buffer[0] = 0x02;
+        return request_machine(machine, 1, session->settings->experimental ? 7 : 5, ACK_TIMEOUT, TAIL_ACK);
+
+    case PROBE_STATE:
+        if (!session->device->capacity)
+            return enter_machine(machine, STEP_STATE);
+
+        return read_machine(machine, session->device->capacity, session->window, 2);
+
+    case STEP_STATE:
+        return step_machine(machine);
+
+    case IDENTIFY_STATE:
+        if (session->identified || !session->device->uid)
+            return identify_machine(machine);
+
+        return read_machine(machine, session->device->uid, session->uid, DEVICE_UID_SIZE);
+
+    case ERASE_STATE:
+        session->buffer[0] = session->erase_command;
+        return request_machine(machine, 1, 1, ACK_TIMEOUT, 0);
+
+    case MASS_STATE:
+        session->buffer[0] = 0xFF;
+        session->buffer[1] = 0xFF;
+        return request_machine(machine, session->erase_command == 0x44 ? 2 : 1, 1, session_erase_timeout(session), 0);
+
+    case PROGRAM_STATE:
+        return program_machine(machine);
+
+    case VERIFY_STATE:
+        return verify_machine(machine);
+
+    case READ_STATE:
+        session->buffer[0] = 0x11;
+        return request_machine(machine, 1, 1, ACK_TIMEOUT, 0);
+
+    case WRITE_STATE:
+        session->buffer[0] = 0x31;
+        return request_machine(machine, 1, 1, ACK_TIMEOUT, 0);
+
+    case READ_ADDRESS_STATE:
+    case WRITE_ADDRESS_STATE:
+        return address_machine(machine);
+
+    case READ_COUNT_STATE:
+        session->buffer[0] = machine->amount - 1;
+        return request_machine(machine, 1, 1 + machine->amount, BLOCK_TIMEOUT, 0);
+
+    case WRITE_DATA_STATE:
+        session->buffer[0] = machine->amount - 1;
+        memcpy(session->buffer + 1, machine->source, machine->amount);
+        return request_machine(machine, 1 + machine->amount, 1, BLOCK_TIMEOUT, 0);
+    }
+
+    return INTERNAL_ERROR;
+}
+
+static int return_machine(struct machine *machine, int result);
+
+static int complete_machine(struct machine *machine, int result)
+{
+    struct session *session = &machine->port->session;
+
+    switch (machine->state)
+    {
+    case RESET_STATE:
+        if (result || reset_machine(machine, 1))
+            return INTERNAL_ERROR;
+
+        machine->tries = 5;
+        return enter_machine(machine, SYNC_STATE);
+
+    case SYNC_STATE:
+        return result ? result : enter_machine(machine, HANDSHAKE_STATE);
+
+    case HANDSHAKE_STATE:
+        if (!result)
+        {
+            if (machine->negotiating)
+                fprintf(session->console, TTY_NONE "%d baud...", session->baud);
+
+            machine->negotiating = 0;
+            return enter_machine(machine, machine->again);
+        }
+
+        if (--machine->tries)
+            return enter_machine(machine, SYNC_STATE);
+
+        return retry_machine(machine, result);
+
+    case GET_STATE:
+        if (result)
+            return result;
+
+        machine->count = machine->reply[1];
+
+        if (machine->count < 7 || machine->count + 2 > sizeof(machine->reply))
+            return INVALID_DEVICE_REPLY;
+
+        return enter_machine(machine, COMMANDS_STATE);
+
+    case COMMANDS_STATE:
+        if (result)
+            return result;
+
+        session->version = machine->reply[0];
+        session->erase_command = machine->reply[7];
+        session->checksum_command = memchr(machine->reply + 1, 0xA1, machine->count) != 0;
+        fprintf(session->console, TTY_NONE "V%1X.%1X...", session->version >> 4, session->version & 0x0F);
+        return enter_machine(machine, ID_STATE);
+
+    case ID_STATE:
+        if (result)
+            return result;
+
+        if ((result = select_session(session, machine->reply[2] << 8 | machine->reply[3])))
+            return result;
+
+        return enter_machine(machine, PROBE_STATE);
+
+    case PROBE_STATE:
+        if (result && result != INVALID_DEVICE_REPLY)
+            return result;
+
+        if (!result)
+            resize_session(session, session->window);
+
+        machine->step = 0;
+        return enter_machine(machine, STEP_STATE);
+
+    case STEP_STATE:
+        return result;
+
+    case IDENTIFY_STATE:
+        if (result && result != INVALID_DEVICE_REPLY)
+            return result;
+
+        session->identified = !result;
+        return identify_machine(machine);
+
+    case ERASE_STATE:
+        return result ? result : enter_machine(machine, MASS_STATE);
+
+    case MASS_STATE:
+        if (result)
+            return result;
+
+        session->erased = 1;
+        return next_machine(machine);
+
+    case PROGRAM_STATE:
+        if (result)
+            return recover_machine(machine, result);
+
+        account_session(session);
+        machine->address += machine->length;
+        return enter_machine(machine, PROGRAM_STATE);
+
+    case VERIFY_STATE:
+        if (result)
+            return recover_machine(machine, result);
+
+        account_session(session);
+        return compare_machine(machine);
+
+    case READ_STATE:
+    case WRITE_STATE:
+        return result ? return_machine(machine, result) : enter_machine(machine, machine->state + 1);
+
+    case READ_ADDRESS_STATE:
+    case WRITE_ADDRESS_STATE:
+        return result ? return_machine(machine, result) : enter_machine(machine, machine->state + 1);
+
+    case READ_COUNT_STATE:
+        if (!result)
+            memcpy(machine->target, machine->reply + 1, machine->amount);
+
+        return return_machine(machine, result);
+
+    case WRITE_DATA_STATE:
+        return return_machine(machine, result);
+    }
+
+    return INTERNAL_ERROR;
+}
+
+static int return_machine(struct machine *machine, int result)
+{
+    machine->state = machine->back;
+    return complete_machine(machine, result);
+}
+
+static void finish_machine(struct machine *machine, int result)
+{
+    if ((result = complete_machine(machine, result)))
+        stop_machine(machine, result);
+}
+
+static void receive_machine(struct machine *machine, int events)
+{
+    struct session *session = &machine->port->session;
+
+    for (;;)
+    {
+        uint8_t spare[64];
+        const int expected = machine->got < machine->want;
+        uint8_t *data = expected ? machine->reply + machine->got : spare;
+        const ssize_t count = read(session->serial.fd, data, expected ? machine->want - machine->got : sizeof(spare));
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN)
+                finish_machine(machine, INTERNAL_ERROR);
+
+            return;
+        }
+
+        if (count == 0)
+        {
+            if (events & (EPOLLHUP | EPOLLERR))
+                finish_machine(machine, NO_DEVICE_REPLY);
+
+            return;
+        }
+
+        if (!expected)
+            continue;
+
+        if (!machine->got && (machine->flags & TIMED_ACK))
+        {
+            session->ack_time += clock_serial_port() - machine->start;
+            session->acks++;
+        }
+
+        machine->got += count;
+
+        if ((machine->flags & HEAD_ACK) && machine->reply[0] != 0x79)
+        {
+            finish_machine(machine, INVALID_DEVICE_REPLY);
+            return;
+        }
+
+        if (machine->got == machine->want)
+        {
+            const int valid = !(machine->flags & TAIL_ACK) || machine->reply[machine->want - 1] == 0x79;
+
+            finish_machine(machine, valid ? DONE : INVALID_DEVICE_REPLY);
+            return;
+        }
+    }
+}
+
+static void handle_machine(struct machine *machine, int events)
+{
+    int result;
+
+    if (!machine->active)
+        return;
+
+    if ((events & EPOLLOUT) && (result = send_machine(machine)))
+    {
+        stop_machine(machine, result);
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        receive_machine(machine, events);
+}
+
+static void expire_machine(struct machine *machine, int64_t time)
+{
+    if (!machine->active || machine->deadline > time)
+        return;
+
+    finish_machine(machine, machine->want || machine->sent < machine->size ? NO_DEVICE_REPLY : DONE);
+}
+
+static int engine_timeout(const struct machine *machines, size_t count, int64_t time)
+{
+    int64_t rest = -1;
+    size_t index;
+
+    for (index = 0; index < count; index++)
+    {
+        const struct machine *machine = machines + index;
+
+        if (machine->active && (rest < 0 || machine->deadline - time < rest))
+            rest = machine->deadline > time ? machine->deadline - time : 0;
+    }
+
+    return rest < 0 ? -1 : (int)((rest + 999) / 1000);
+}
+
+int run_engine(struct gang *gang)
+{
+    int result = DONE;
+    int epoll;
+    size_t index;
+    size_t active = 0;
+    struct machine *machines;
+
+    if (!(machines = calloc(gang->count, sizeof(struct machine))))
+        return INTERNAL_ERROR;
+
+    if ((epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        free(machines);
+        return INTERNAL_ERROR;
+    }
+
+    for (index = 0; index < gang->count; index++)
+    {
+        struct machine *machine = machines + index;
+        int failure;
+
+        machine->port = gang->ports + index;
+        machine->epoll = epoll;
+
+        if (machine->port->console && (failure = start_machine(machine)))
+            stop_machine(machine, failure);
+    }
+
+    for (;;)
+    {
+        struct epoll_event events[ENGINE_EVENTS];
+        int count;
+
+        for (index = 0, active = 0; index < gang->count; index++)
+            active += machines[index].active;
+
+        if (!active)
+            break;
+
+        if ((count = epoll_wait(epoll, events, ENGINE_EVENTS, engine_timeout(machines, gang->count, clock_serial_port()))) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            result = INTERNAL_ERROR;
+            break;
+        }
+
+        while (count--)
+            handle_machine(events[count].data.ptr, events[count].events);
+
+        for (index = 0; index < gang->count; index++)
+            expire_machine(machines + index, clock_serial_port());
+    }
+
+    for (index = 0; index < gang->count; index++)
+    {
+        if (machines[index].active)
+            stop_machine(machines + index, result);
+    }
+
+    close(epoll);
+    free(machines);
+    return result;
+}
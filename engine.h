@@ -0,0 +1,95 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+#include "gang.h"
+
+#define ENGINE_EVENTS 64
+#define ENGINE_REPLY 516
+
+enum state
+{
+    RESET_STATE,
+    SYNC_STATE,
+    HANDSHAKE_STATE,
+    GET_STATE,
+    COMMANDS_STATE,
+    ID_STATE,
+    PROBE_STATE,
+    STEP_STATE,
+    IDENTIFY_STATE,
+    ERASE_STATE,
+    MASS_STATE,
+    PROGRAM_STATE,
+    VERIFY_STATE,
+    READ_STATE,
+    READ_ADDRESS_STATE,
+    READ_COUNT_STATE,
+    WRITE_STATE,
+    WRITE_ADDRESS_STATE,
+    WRITE_DATA_STATE
+};
+
+struct machine
+{
+    struct port *port;
+    int epoll;
+    int events;
+    int active;
+    enum state state;
+    enum state back;
+    enum state again;
+    int negotiating;
+    int tries;
+    size_t step;
+    size_t size;
+    size_t sent;
+    size_t want;
+    size_t got;
+    int flags;
+    int64_t start;
+    int64_t deadline;
+    size_t count;
+    struct buffer view;
+    size_t extent;
+    uint32_t address;
+    uint32_t end;
+    size_t length;
+    int match;
+    int mismatches;
+    uint32_t origin;
+    size_t amount;
+    uint8_t *target;
+    const uint8_t *source;
+    uint8_t reply[ENGINE_REPLY];
+};
+
+int accept_engine(const struct gang *gang);
+int run_engine(struct gang *gang);
+
+#endif
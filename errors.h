@@ -35,7 +35,8 @@ enum
     INVALID_DEVICE_REPLY,
     UNSUPPORTED_DEVICE,
     INVALID_FILE_CONTENT,
-    INVALID_FILE_CHECKSUM
+    INVALID_FILE_CHECKSUM,
+    INVALID_DEVICE_MEMORY
 };
 
 #endif
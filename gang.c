@@ -0,0 +1,326 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <glob.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gang.h"
+#include "engine.h"
+#include "errors.h"
+#include "options.h"
+
+int gang_pattern(const char *pattern)
+{
+    return strpbrk(pattern, ",*?[") != 0;
+}
+
+static int add_port(struct gang *gang, size_t *capacity, const char *file)
+{
+    struct port *port;
+
+    if (gang->count == *capacity)
+    {
+        const size_t count = *capacity ? *capacity * 2 : 8;
+
+        if (!(port = realloc(gang->ports, count * sizeof(struct port))))
+            return INTERNAL_ERROR;
+
+        gang->ports = port;
+        *capacity = count;
+    }
+
+    port = gang->ports + gang->count;
+    memset(port, 0, sizeof(struct port));
+    init_session(&port->session, &gang->settings, 0);
+
+    if (snprintf(port->file, sizeof(port->file), "%s", file) >= (int)sizeof(port->file))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    gang->count++;
+    return DONE;
+}
+
+static int expand_ports(struct gang *gang, size_t *capacity, const char *pattern)
+{
+    int result = DONE;
+    size_t index;
+    glob_t matches;
+
+    switch (glob(pattern, 0, 0, &matches))
+    {
+    case 0:
+        break;
+
+    case GLOB_NOMATCH:
+        return strpbrk(pattern, "*?[") ? INVALID_OPTIONS_ARGUMENT : add_port(gang, capacity, pattern);
+
+    default:
+        return INTERNAL_ERROR;
+    }
+
+    for (index = 0; index < matches.gl_pathc && !result; index++)
+        result = add_port(gang, capacity, matches.gl_pathv[index]);
+
+    globfree(&matches);
+    return result;
+}
+
+int open_gang(struct gang *gang, const char *pattern, const struct settings *settings)
+{
+    int result = DONE;
+    size_t capacity = 0;
+    char *list = strdup(pattern);
+    char *save = 0;
+    char *item;
+
+    memset(gang, 0, sizeof(struct gang));
+    gang->settings = *settings;
+
+    if (!list)
+        return INTERNAL_ERROR;
+
+    for (item = strtok_r(list, ",", &save); item && !result; item = strtok_r(0, ",", &save))
+        result = expand_ports(gang, &capacity, item);
+
+    free(list);
+
+    if (!result && !gang->count)
+        result = INVALID_OPTIONS_ARGUMENT;
+
+    if (result)
+        close_gang(gang);
+
+    return result;
+}
+
+int load_gang(struct gang *gang, const char *file, uint32_t origin, size_t size, uint32_t base, const struct buffer **buffer)
+{
+    int result;
+    struct buffer *image;
+
+    if (gang->images == GANG_STEPS)
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if (!(image = malloc(sizeof(struct buffer) + size)))
+        return INTERNAL_ERROR;
+
+    memset(image, 0, sizeof(struct buffer));
+    image->origin = origin;
+    image->size = size;
+    image->data = image + 1;
+
+    if ((result = load_file_buffer(image, file, base)))
+    {
+        unload_file_buffer(image);
+        free(image);
+        return result;
+    }
+
+    gang->buffers[gang->images++] = image;
+    *buffer = image;
+    return DONE;
+}
+
+int plan_gang(struct gang *gang, enum action action, const struct settings *settings, const struct buffer *buffer, int value)
+{
+    struct step *step = gang->plan + gang->steps;
+
+    if (gang->steps == GANG_STEPS)
+        return INVALID_OPTIONS_ARGUMENT;
+
+    step->action = action;
+    step->settings = *settings;
+    step->buffer = buffer;
+    step->value = value;
+    gang->steps++;
+    return DONE;
+}
+
+int fit_gang(struct buffer *view, const struct buffer *buffer, uint32_t origin, size_t size)
+{
+    size_t index;
+
+    *view = *buffer;
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        const struct extent *extent = buffer->extents + index;
+
+        if (extent->origin < origin || (uint64_t)extent->origin + extent->size > (uint64_t)origin + size)
+            return INVALID_FILE_CONTENT;
+    }
+
+    return DONE;
+}
+
+static int run_step(struct port *port, const struct step *step)
+{
+    int result;
+    struct buffer view;
+    struct session *session = &port->session;
+
+    session->settings = &step->settings;
+
+    switch (step->action)
+    {
+    case UNPROTECT_ACTION:
+        return unprotect_session(session);
+
+    case ERASE_ACTION:
+        return erase_session(session);
+
+    case ADJUST_ACTION:
+        return adjust_session(session, step->value);
+
+    case WRITE_ACTION:
+        fprintf(port->console, TTY_NONE "Writing...");
+
+        if ((result = fit_gang(&view, step->buffer, FLASH_ORIGIN, session->size)))
+            return result;
+
+        return write_session(session, &view);
+
+    case RUN_ACTION:
+        fprintf(port->console, TTY_NONE "Running...");
+
+        if ((result = fit_gang(&view, step->buffer, RAM_ORIGIN, session->device->ram)))
+            return result;
+
+        return run_session(session, &view);
+
+    case PROTECT_ACTION:
+        return protect_session(session);
+
+    case TRACE_ACTION:
+        return trace_session(session);
+
+    case DISCONNECT_ACTION:
+        return disconnect_session(session);
+    }
+
+    return INTERNAL_ERROR;
+}
+
+static void *work_port(void *argument)
+{
+    struct port *port = argument;
+    const struct gang *gang = port->gang;
+    size_t index;
+
+    if (!(port->result = connect_session(&port->session, port->file)))
+    {
+        for (index = 0; index < gang->steps && !port->result; index++)
+            port->result = run_step(port, gang->plan + index);
+    }
+
+    port->error = errno;
+    return 0;
+}
+
+int run_gang(struct gang *gang)
+{
+    int result = DONE;
+    size_t index;
+
+    for (index = 0; index < gang->count; index++)
+    {
+        struct port *port = gang->ports + index;
+
+        port->gang = gang;
+        port->result = INTERNAL_ERROR;
+
+        if ((port->console = open_memstream(&port->log, &port->length)))
+            init_session(&port->session, &gang->settings, port->console);
+    }
+
+    if (accept_engine(gang))
+    {
+        run_engine(gang);
+    }
+    else
+    {
+        for (index = 0; index < gang->count; index++)
+        {
+            struct port *port = gang->ports + index;
+
+            if (port->console && pthread_create(&port->thread, 0, work_port, port))
+            {
+                fclose(port->console);
+                port->console = 0;
+            }
+        }
+
+        for (index = 0; index < gang->count; index++)
+        {
+            struct port *port = gang->ports + index;
+
+            if (port->console)
+                pthread_join(port->thread, 0);
+        }
+    }
+
+    for (index = 0; index < gang->count; index++)
+    {
+        struct port *port = gang->ports + index;
+
+        if (port->console)
+        {
+            fclose(port->console);
+            port->console = 0;
+        }
+
+        if (!result)
+            result = port->result;
+    }
+
+    return result;
+}
+
+void close_gang(struct gang *gang)
+{
+    size_t index;
+
+    for (index = 0; index < gang->count; index++)
+    {
+        struct port *port = gang->ports + index;
+
+        if (port->session.serial.fd >= 0)
+            close_serial_port(&port->session.serial);
+
+        free(port->log);
+    }
+
+    for (index = 0; index < gang->images; index++)
+    {
+        unload_file_buffer(gang->buffers[index]);
+        free(gang->buffers[index]);
+    }
+
+    free(gang->ports);
+    gang->ports = 0;
+    gang->count = 0;
+    gang->steps = 0;
+    gang->images = 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef GANG_H
+#define GANG_H
+
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+#include "buffer.h"
+#include "session.h"
+
+#define GANG_STEPS 64
+
+enum action
+{
+    UNPROTECT_ACTION,
+    ERASE_ACTION,
+    ADJUST_ACTION,
+    WRITE_ACTION,
+    RUN_ACTION,
+    PROTECT_ACTION,
+    TRACE_ACTION,
+    DISCONNECT_ACTION
+};
+
+struct step
+{
+    enum action action;
+    struct settings settings;
+    const struct buffer *buffer;
+    int value;
+};
+
+struct gang;
+
+struct port
+{
+    const struct gang *gang;
+    char file[PATH_MAX];
+    struct session session;
+    pthread_t thread;
+    FILE *console;
+    char *log;
+    size_t length;
+    int result;
+    int error;
+};
+
+struct gang
+{
+    struct settings settings;
+    size_t count;
+    struct port *ports;
+    size_t steps;
+    struct step plan[GANG_STEPS];
+    size_t images;
+    struct buffer *buffers[GANG_STEPS];
+};
+
+int gang_pattern(const char *pattern);
+int open_gang(struct gang *gang, const char *pattern, const struct settings *settings);
+int load_gang(struct gang *gang, const char *file, uint32_t origin, size_t size, uint32_t base, const struct buffer **buffer);
+int plan_gang(struct gang *gang, enum action action, const struct settings *settings, const struct buffer *buffer, int value);
+int fit_gang(struct buffer *view, const struct buffer *buffer, uint32_t origin, size_t size);
+int run_gang(struct gang *gang);
+void close_gang(struct gang *gang);
+
+#endif
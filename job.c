@@ -0,0 +1,1100 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "errors.h"
+#include "queue.h"
+#include "job.h"
+
+struct image
+{
+    struct queue queue;
+    struct buffer *buffer;
+    const uint8_t *data;
+    uint32_t origin;
+    uint32_t base;
+    const char *file;
+};
+
+static void init_memory(struct buffer *buffer, uint32_t origin, size_t size, void *data)
+{
+    memset(buffer, 0, sizeof(struct buffer));
+    buffer->origin = origin;
+    buffer->size = size;
+    buffer->data = data;
+}
+
+int init_job(struct job *job, const char *synopsis, const struct option options[], const struct error errors[], classify_t classify)
+{
+    const struct settings settings =
+    {
+        BOOT_LINE, RESET_LINE, 0, 0, DEFAULT_BAUD, 0, 0, 0, 0, 0, 16, 0, &job->loader, 4096, 5, 0
+    };
+
+    memset(job, 0, sizeof(struct job));
+    job->synopsis = synopsis;
+    job->options = options;
+    job->errors = errors;
+    job->classify = classify;
+    job->settings = settings;
+    job->output = STDOUT_FILENO;
+
+    init_session(&job->session, &job->settings, stdout);
+    init_server(&job->server);
+
+    if (!(job->device_memory = malloc(3 * JOB_MEMORY + JOB_LOADER)))
+        return INTERNAL_ERROR;
+
+    job->patch_memory = job->device_memory + JOB_MEMORY;
+    job->image_memory = job->patch_memory + JOB_MEMORY;
+    job->loader_memory = job->image_memory + JOB_MEMORY;
+    init_memory(&job->patches, FLASH_ORIGIN, JOB_MEMORY, job->patch_memory);
+    return DONE;
+}
+
+void close_job(struct job *job)
+{
+    close_gang(&job->gang);
+    close_server(&job->server);
+    unload_file_buffer(&job->loader);
+    free(job->device_memory);
+    job->device_memory = 0;
+}
+
+static void merge_ranges(struct job *job, size_t index)
+{
+    struct extent *extents = job->ranges.extents;
+
+    while (index + 1 < job->ranges.count && extents[index + 1].origin <= extents[index].origin + extents[index].size)
+    {
+        const uint32_t end = extents[index + 1].origin + extents[index + 1].size;
+
+        if (end > extents[index].origin + extents[index].size)
+            extents[index].size = end - extents[index].origin;
+
+        memmove(extents + index + 1, extents + index + 2, (job->ranges.count - index - 2) * sizeof(struct extent));
+        job->ranges.count--;
+    }
+}
+
+int range_job(struct job *job, uint32_t origin, size_t size)
+{
+    size_t index = job->ranges.count;
+
+    if (job->ranges.count == BUFFER_EXTENTS)
+        return INVALID_OPTIONS_ARGUMENT;
+
+    while (index && job->ranges.extents[index - 1].origin > origin)
+        index--;
+
+    memmove(job->ranges.extents + index + 1, job->ranges.extents + index, (job->ranges.count - index) * sizeof(struct extent));
+    job->ranges.extents[index].origin = origin;
+    job->ranges.extents[index].size = size;
+    job->ranges.count++;
+
+    merge_ranges(job, index);
+
+    if (index)
+        merge_ranges(job, index - 1);
+
+    return DONE;
+}
+
+static int valid_patch(struct job *job, uint32_t origin)
+{
+    if (origin < FLASH_ORIGIN || origin - FLASH_ORIGIN >= JOB_MEMORY)
+        return 0;
+
+    if (!job->patches.count)
+        clear_buffer(&job->patches, 0xFF);
+
+    return 1;
+}
+
+int patch_job(struct job *job, uint32_t origin, const uint8_t *data, size_t size)
+{
+    if (!valid_patch(job, origin))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    return patch_buffer(&job->patches, origin, data, size) ? INVALID_OPTIONS_ARGUMENT : DONE;
+}
+
+int patch_file_job(struct job *job, uint32_t origin, const char *file)
+{
+    int result;
+    size_t index;
+    struct buffer buffer;
+
+    if (!valid_patch(job, origin))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    init_memory(&buffer, FLASH_ORIGIN, JOB_MEMORY, job->image_memory);
+
+    if ((result = load_patch_buffer(&buffer, file, origin)))
+        return result;
+
+    for (index = 0; index < buffer.count && !result; index++)
+        result = patch_buffer(&job->patches, buffer.extents[index].origin, (const uint8_t *)buffer.data + buffer.extents[index].origin - buffer.origin, buffer.extents[index].size);
+
+    unload_file_buffer(&buffer);
+    return result;
+}
+
+int convert_job(struct job *job, const char *source, const char *output, int pid)
+{
+    int result;
+    struct buffer buffer;
+
+    init_memory(&buffer, FLASH_ORIGIN, JOB_MEMORY, job->image_memory);
+
+    if ((result = load_file_buffer(&buffer, source, job->base)))
+        return result;
+
+    if (pid >= 0)
+        buffer.pid = pid;
+    else if (job->session.serial.fd >= 0 && job->session.selected && !buffer.pid)
+        buffer.pid = job->session.device->pid;
+
+    result = save_file_buffer(&buffer, output, job->settings.record_size, 0);
+    unload_file_buffer(&buffer);
+    return result;
+}
+
+int loader_job(struct job *job, const char *file)
+{
+    int result;
+    struct buffer buffer;
+
+    init_memory(&buffer, RAM_ORIGIN, JOB_LOADER, job->loader_memory);
+
+    if ((result = load_file_buffer(&buffer, file, job->base)))
+        return result;
+
+    if (!buffer.count)
+    {
+        unload_file_buffer(&buffer);
+        return INVALID_FILE_CONTENT;
+    }
+
+    unload_file_buffer(&job->loader);
+    job->loader = buffer;
+    return DONE;
+}
+
+static int connect_port(struct job *job, const char *file)
+{
+    int result;
+
+    if (job->gang.count)
+        return SERIAL_PORT_ALREADY_OPEN;
+
+    if (job->server.fd >= 0 && job->session.serial.fd >= 0)
+    {
+        if (job->warm && !strcmp(file, job->file))
+        {
+            fprintf(stdout, TTY_NONE "kept open...");
+            job->session.identified = 0;
+            return DONE;
+        }
+
+        if ((result = close_serial_port(&job->session.serial)))
+            return result;
+    }
+
+    if ((result = connect_session(&job->session, file)))
+        return result;
+
+    snprintf(job->file, sizeof(job->file), "%s", file);
+    job->warm = 1;
+    return DONE;
+}
+
+int connect_job(struct job *job, const char *file)
+{
+    int result;
+
+    if (job->batch.count)
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if (!gang_pattern(file))
+        return connect_port(job, file);
+
+    if (job->gang.count || job->session.serial.fd >= 0)
+        return SERIAL_PORT_ALREADY_OPEN;
+
+    if ((result = open_gang(&job->gang, file, &job->settings)))
+        return result;
+
+    fprintf(stdout, TTY_NONE "%d ports...", (int)job->gang.count);
+    return DONE;
+}
+
+static int plan_device(struct job *job, enum action action, const char *name, const struct buffer *buffer, int value)
+{
+    fprintf(stdout, TTY_NONE "Planning %s...", name);
+    return plan_gang(&job->gang, action, &job->settings, buffer, value);
+}
+
+static int finish_gang(struct job *job)
+{
+    size_t index;
+    int error = 0;
+    int result = run_gang(&job->gang);
+
+    for (index = 0; index < job->gang.count; index++)
+    {
+        const struct port *port = job->gang.ports + index;
+
+        fprintf(stdout, TTY_NONE "Port \"%s\"...%.*s", port->file, (int)port->length, port->log);
+        errno = port->error;
+
+        if (report_options(job->errors, port->result) && !error)
+            error = port->error;
+    }
+
+    close_gang(&job->gang);
+    errno = error;
+    return result;
+}
+
+static int running_job(const struct job *job)
+{
+    return job->server.client >= 0 || job->batch.count;
+}
+
+int unprotect_job(struct job *job)
+{
+    return job->gang.count ? plan_device(job, UNPROTECT_ACTION, "unprotect", 0, 0) : unprotect_session(&job->session);
+}
+
+int read_job(struct job *job, const char *file)
+{
+    if (job->gang.count || bundle_output(file) || (running_job(job) && !strcmp(file, "-")))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    return read_session(&job->session, file, strcmp(file, "-") ? -1 : job->output, job->ranges.extents, job->ranges.count);
+}
+
+int erase_job(struct job *job)
+{
+    return job->gang.count ? plan_device(job, ERASE_ACTION, "erase", 0, 0) : erase_session(&job->session);
+}
+
+int adjust_job(struct job *job, int voltage)
+{
+    return job->gang.count ? plan_device(job, ADJUST_ACTION, "adjust", 0, voltage) : adjust_session(&job->session, voltage);
+}
+
+static int plan_image(struct job *job, enum action action, const char *file, uint32_t origin)
+{
+    int result;
+    const struct buffer *buffer;
+
+    fprintf(stdout, TTY_NONE "Loading \"%s\"...", file);
+
+    if ((result = load_gang(&job->gang, file, origin, JOB_MEMORY, job->base, &buffer)))
+        return result;
+
+    return plan_device(job, action, action == WRITE_ACTION ? "write" : "run", buffer, 0);
+}
+
+static int push_image_block(void *argument, uint32_t origin, size_t size)
+{
+    struct image *image = argument;
+
+    return push_queue(&image->queue, origin, image->data + origin - image->origin, size);
+}
+
+static int pull_image_block(void *argument, struct extent *block, uint8_t *data)
+{
+    struct image *image = argument;
+
+    return pull_queue(&image->queue, block, data);
+}
+
+static int parse_image(void *argument)
+{
+    struct image *image = argument;
+
+    return stream_file_buffer(image->buffer, image->file, image->base, image->queue.wake[0], push_image_block, image);
+}
+
+static int write_device_image(struct job *job, struct buffer *buffer, const char *file)
+{
+    int result;
+    struct image image;
+
+    image.buffer = buffer;
+    image.data = buffer->data;
+    image.origin = buffer->origin;
+    image.base = job->base;
+    image.file = file;
+
+    if ((result = open_queue(&image.queue, parse_image, &image)))
+        return result;
+
+    if ((result = close_queue(&image.queue, stream_session(&job->session, buffer, pull_image_block, &image))))
+        return result;
+
+    return job->settings.verify_write ? verify_session(&job->session, buffer) : DONE;
+}
+
+static int load_held_image(struct job *job, struct buffer *buffer, const char *file)
+{
+    int result;
+    const struct buffer *image;
+
+    if ((result = load_server(&job->server, file, buffer->origin, JOB_MEMORY, job->base, &image)))
+        return result;
+
+    return fit_gang(buffer, image, buffer->origin, buffer->size);
+}
+
+static void *load_preload(void *argument)
+{
+    struct preload *preload = argument;
+
+    preload->result = load_file_buffer(&preload->buffer, preload->file, preload->base);
+    preload->error = errno;
+    return 0;
+}
+
+static void start_preload(struct job *job, const char *file)
+{
+    struct preload *preload = &job->preload;
+
+    init_memory(&preload->buffer, FLASH_ORIGIN, JOB_MEMORY, job->device_memory);
+    preload->file = file;
+    preload->base = job->base;
+
+    if (pthread_create(&preload->thread, 0, load_preload, preload))
+        preload->file = 0;
+}
+
+static int join_preload(struct job *job)
+{
+    pthread_join(job->preload.thread, 0);
+    job->preload.file = 0;
+    errno = job->preload.error;
+    return job->preload.result;
+}
+
+static void drop_preload(struct job *job)
+{
+    if (job->preload.file && !join_preload(job))
+        unload_file_buffer(&job->preload.buffer);
+}
+
+static int write_patched_image(struct job *job, const struct buffer *image)
+{
+    int result;
+    struct buffer buffer;
+
+    if (!job->patches.count)
+        return write_session(&job->session, image);
+
+    init_memory(&buffer, FLASH_ORIGIN, job->session.size, job->image_memory);
+    clear_buffer(&buffer, 0xFF);
+
+    if ((result = merge_buffer(&buffer, image)) || (result = merge_buffer(&buffer, &job->patches)))
+        return result;
+
+    buffer.pid = image->pid;
+
+    return write_session(&job->session, &buffer);
+}
+
+int write_job(struct job *job, const char *file)
+{
+    int result;
+    struct buffer buffer;
+
+    if (job->gang.count)
+        return job->patches.count ? INVALID_OPTIONS_ARGUMENT : plan_image(job, WRITE_ACTION, file, FLASH_ORIGIN);
+
+    fprintf(stdout, TTY_NONE "Writing from \"%s\"...", file);
+    init_memory(&buffer, FLASH_ORIGIN, job->session.size, job->device_memory);
+
+    if (running_job(job) && !strcmp(file, "-"))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if (job->server.fd >= 0 || job->batch.count)
+    {
+        if ((result = load_held_image(job, &buffer, file)))
+            return result;
+
+        return write_patched_image(job, &buffer);
+    }
+
+    if (job->preload.file == file)
+    {
+        if ((result = join_preload(job)))
+            return result;
+
+        if (!(result = fit_gang(&buffer, &job->preload.buffer, FLASH_ORIGIN, job->session.size)))
+            result = write_patched_image(job, &buffer);
+
+        unload_file_buffer(&job->preload.buffer);
+        return result;
+    }
+
+    if (!regular_file(file) && !job->settings.delta_write && !job->settings.page_erase && !job->loader.count && !job->patches.count)
+        return write_device_image(job, &buffer, file);
+
+    if ((result = load_file_buffer(&buffer, file, job->base)))
+        return result;
+
+    result = write_patched_image(job, &buffer);
+    unload_file_buffer(&buffer);
+    return result;
+}
+
+int launch_job(struct job *job, const char *file)
+{
+    int result;
+    struct buffer buffer;
+
+    if (job->gang.count)
+        return plan_image(job, RUN_ACTION, file, RAM_ORIGIN);
+
+    fprintf(stdout, TTY_NONE "Running from \"%s\"...", file);
+    init_memory(&buffer, RAM_ORIGIN, job->session.device->ram, job->device_memory);
+    job->warm = 0;
+
+    if (running_job(job) && !strcmp(file, "-"))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if (job->server.fd >= 0 || job->batch.count)
+    {
+        if ((result = load_held_image(job, &buffer, file)))
+            return result;
+
+        return run_session(&job->session, &buffer);
+    }
+
+    if ((result = load_file_buffer(&buffer, file, job->base)))
+        return result;
+
+    result = run_session(&job->session, &buffer);
+    unload_file_buffer(&buffer);
+    return result;
+}
+
+int protect_job(struct job *job)
+{
+    return job->gang.count ? plan_device(job, PROTECT_ACTION, "protect", 0, 0) : protect_session(&job->session);
+}
+
+int trace_job(struct job *job)
+{
+    if (job->gang.count)
+        return plan_device(job, TRACE_ACTION, "trace", 0, 0);
+
+    job->warm = 0;
+    return trace_session(&job->session);
+}
+
+int disconnect_job(struct job *job)
+{
+    int result;
+    const int count = job->gang.count;
+
+    if (job->batch.count)
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if (!count)
+        return disconnect_session(&job->session);
+
+    if ((result = plan_gang(&job->gang, DISCONNECT_ACTION, &job->settings, 0, 0)))
+        return result;
+
+    result = finish_gang(job);
+    fprintf(stdout, TTY_NONE "Disconnecting %d ports...", count);
+    return result;
+}
+
+static void save_defaults(struct job *job)
+{
+    job->defaults = job->settings;
+    job->default_base = job->base;
+}
+
+static void restore_defaults(struct job *job)
+{
+    job->settings = job->defaults;
+    job->base = job->default_base;
+    job->ranges.count = 0;
+    job->patches.count = 0;
+}
+
+int listen_job(struct job *job, const char *path)
+{
+    int result;
+
+    if (job->gang.count || job->batch.count)
+        return SERIAL_PORT_ALREADY_OPEN;
+
+    if ((result = open_server(&job->server, path)))
+        return result;
+
+    save_defaults(job);
+    return DONE;
+}
+
+int batch_job(struct job *job, const char *file)
+{
+    int result;
+
+    if (job->gang.count || job->batch.count || job->server.fd >= 0 || job->session.serial.fd < 0)
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if ((result = open_batch(&job->batch, file)))
+        return result;
+
+    save_defaults(job);
+    return DONE;
+}
+
+int finish_job(struct job *job, int result)
+{
+    int count;
+
+    if (result || !job->gang.count)
+    {
+        close_gang(&job->gang);
+        return result;
+    }
+
+    count = job->gang.count;
+    result = finish_gang(job);
+    fprintf(stdout, TTY_NONE "Finishing %d ports...", count);
+    return report_options(job->errors, result);
+}
+
+static int setting_operation(enum operation operation)
+{
+    return operation < CONNECT_OPERATION;
+}
+
+static int leave_erase(const struct job *job, int index)
+{
+    int page_erase = job->settings.page_erase;
+    int delta_write = job->settings.delta_write;
+    int next;
+
+    for (next = 0; next < index; next++)
+    {
+        page_erase |= job->plan[next].operation == PAGE_ERASE_OPERATION;
+        delta_write |= job->plan[next].operation == DELTA_OPERATION;
+    }
+
+    for (next = index + 1; next < job->script.count && setting_operation(job->plan[next].operation); next++)
+    {
+        page_erase |= job->plan[next].operation == PAGE_ERASE_OPERATION;
+        delta_write |= job->plan[next].operation == DELTA_OPERATION;
+    }
+
+    return next < job->script.count && job->plan[next].operation == WRITE_OPERATION && page_erase && !delta_write ? next : 0;
+}
+
+static void keep_erase(struct job *job, struct planned *step)
+{
+    if (!step->leave || (!job->gang.count && job->session.selected && job->session.page_count))
+        return;
+
+    step->skip = 0;
+    job->plan[step->leave].blank = 1;
+}
+
+static void plan_options(struct job *job)
+{
+    enum operation last = SETTING_OPERATION;
+    const char *preloaded = 0;
+    int connected = job->session.serial.fd >= 0;
+    int erased = 0;
+    int based = 0;
+    int index;
+
+    for (index = 0; index < job->script.count; index++)
+        job->plan[index].operation = job->classify(job->script.calls + index);
+
+    for (index = 0; index < job->script.count; index++)
+    {
+        struct planned *step = job->plan + index;
+        const struct call *call = job->script.calls + index;
+
+        step->skip = 0;
+        step->blank = 0;
+        step->leave = 0;
+        job->dry_run |= step->operation == DRY_RUN_OPERATION;
+        based |= step->operation == BASE_OPERATION || step->operation == RUN_OPERATION || step->operation == HOST_OPERATION;
+
+        switch (step->operation)
+        {
+        case CONNECT_OPERATION:
+            connected = !gang_pattern(call->argument);
+            erased = 0;
+            break;
+
+        case UNPROTECT_OPERATION:
+            if (erased && last == UNPROTECT_OPERATION)
+                step->skip = "unprotected already";
+
+            erased = 1;
+            break;
+
+        case ERASE_OPERATION:
+            if (erased)
+                step->skip = last == UNPROTECT_OPERATION ? "erased by unprotect" : "erased already";
+            else if ((step->leave = leave_erase(job, index)))
+                step->skip = "left to page erase of following write";
+            else
+                erased = 1;
+
+            break;
+
+        case WRITE_OPERATION:
+            step->blank = erased;
+            erased = 0;
+
+            if (!preloaded && !based && connected && job->server.fd < 0 && !job->batch.count && regular_file(call->argument))
+                preloaded = call->argument;
+
+            based = 1;
+            break;
+
+        case READ_OPERATION:
+        case HOST_OPERATION:
+            break;
+
+        default:
+            if (!setting_operation(step->operation))
+                erased = 0;
+
+            break;
+        }
+
+        if (!setting_operation(step->operation) && step->operation != HOST_OPERATION && !step->skip)
+            last = step->operation;
+    }
+
+    if (preloaded && !job->dry_run)
+        start_preload(job, preloaded);
+}
+
+static void print_call(const char *action, const struct call *call)
+{
+    const struct option *option = call->option;
+
+    if (option->role == OTHER_OPTION)
+        fprintf(stdout, TTY_NONE "%s \"%s\"...", action, call->argument);
+    else if (call->argument)
+        fprintf(stdout, TTY_NONE "%s \"--%s %s\"...", action, option->long_name, call->argument);
+    else
+        fprintf(stdout, TTY_NONE "%s \"--%s\"...", action, option->long_name);
+}
+
+static int estimate_transfer(const struct job *job, size_t bytes, size_t commands)
+{
+    const int baud = job->settings.baud_rate ? job->settings.baud_rate : DEFAULT_BAUD;
+
+    return (int)((uint64_t)bytes * 10000 / baud + commands * PLAN_TURNAROUND);
+}
+
+static int estimate_erase(const struct job *job, const struct buffer *buffer)
+{
+    const struct session *session = &job->session;
+    size_t page;
+    int time = 0;
+    const int mass = session->selected && session->device->mass ? session->device->mass : PLAN_MASS_ERASE;
+
+    if (!buffer || (session->selected && !session->page_count))
+        return mass;
+
+    if (!session->selected)
+    {
+        uint32_t origin;
+
+        for (origin = buffer->origin & ~(BUFFER_PAGE - 1); origin < buffer->origin + buffer->size; origin += BUFFER_PAGE)
+            time += overlap_buffer(buffer, origin, BUFFER_PAGE) ? PLAN_PAGE_ERASE : 0;
+    }
+
+    for (page = 0; page < session->page_count; page++)
+    {
+        if (overlap_buffer(buffer, session->page_origins[page], session->page_origins[page + 1] - session->page_origins[page]))
+            time += session->page_times[page];
+    }
+
+    return time < mass ? time : mass;
+}
+
+static int estimate_image(struct job *job, const struct planned *step, const char *file, int *time)
+{
+    int result;
+    size_t index;
+    size_t bytes = 0;
+    size_t blocks = 0;
+    struct buffer buffer;
+
+    init_memory(&buffer, step->operation == WRITE_OPERATION ? FLASH_ORIGIN : RAM_ORIGIN, JOB_MEMORY, job->device_memory);
+
+    if (!strcmp(file, "-") || (!regular_file(file) && !access(file, F_OK)))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if ((result = load_file_buffer(&buffer, file, job->base)))
+        return result;
+
+    for (index = 0; index < buffer.count; index++)
+    {
+        bytes += buffer.extents[index].size;
+        blocks += (buffer.extents[index].size + BUFFER_BLOCK - 1) / BUFFER_BLOCK;
+    }
+
+    fprintf(stdout, TTY_NONE "%d bytes...", (int)bytes);
+    *time = estimate_transfer(job, bytes + blocks * 10, blocks * 3);
+
+    if (step->operation == RUN_OPERATION)
+    {
+        *time += estimate_transfer(job, 7, 2);
+    }
+    else
+    {
+        if (job->settings.page_erase && !job->settings.delta_write && !step->blank)
+        {
+            fprintf(stdout, TTY_NONE "page erase...");
+            *time += estimate_erase(job, &buffer);
+        }
+
+        if (job->settings.verify_write)
+        {
+            fprintf(stdout, TTY_NONE "verify...");
+            *time += estimate_transfer(job, bytes + blocks * 10, blocks * 3);
+        }
+    }
+
+    unload_file_buffer(&buffer);
+    return DONE;
+}
+
+static int estimate_read(const struct job *job, int *time)
+{
+    size_t index;
+    size_t bytes = job->ranges.count ? 0 : job->session.size;
+
+    for (index = 0; index < job->ranges.count; index++)
+        bytes += job->ranges.extents[index].size;
+
+    if (!bytes)
+        return INVALID_DEVICE_MEMORY;
+
+    fprintf(stdout, TTY_NONE "%d bytes...", (int)bytes);
+    *time = estimate_transfer(job, bytes + (bytes + BUFFER_BLOCK - 1) / BUFFER_BLOCK * 9, (bytes + BUFFER_BLOCK - 1) / BUFFER_BLOCK * 3);
+    return DONE;
+}
+
+static int estimate_call(struct job *job, int index, int *total)
+{
+    int result = DONE;
+    int time = 0;
+    struct planned *step = job->plan + index;
+    const struct call *call = job->script.calls + index;
+
+    if (setting_operation(step->operation))
+        return call_options(&job->script, call);
+
+    print_call("Planning", call);
+    keep_erase(job, step);
+
+    if (step->skip)
+    {
+        fprintf(stdout, TTY_NONE "skipped, %s...", step->skip);
+        return report_options(job->errors, DONE);
+    }
+
+    switch (step->operation)
+    {
+    case CONNECT_OPERATION:
+        time = PLAN_CONNECT + estimate_transfer(job, 64, 6);
+        break;
+
+    case UNPROTECT_OPERATION:
+        time = estimate_erase(job, 0) + PLAN_CONNECT + estimate_transfer(job, 24, 4);
+        break;
+
+    case ERASE_OPERATION:
+        time = estimate_erase(job, 0) + estimate_transfer(job, 5, 2);
+        break;
+
+    case WRITE_OPERATION:
+    case RUN_OPERATION:
+        result = estimate_image(job, step, call->argument, &time);
+        break;
+
+    case READ_OPERATION:
+        result = estimate_read(job, &time);
+        break;
+
+    case TRACE_OPERATION:
+        result = INVALID_OPTIONS_ARGUMENT;
+        break;
+
+    case PROTECT_OPERATION:
+        time = PLAN_CONNECT + estimate_transfer(job, 24, 4);
+        break;
+
+    case ADJUST_OPERATION:
+        time = estimate_transfer(job, 4, 2);
+        break;
+
+    case DISCONNECT_OPERATION:
+        time = PLAN_TURNAROUND;
+        break;
+
+    default:
+        fprintf(stdout, TTY_NONE "not run...");
+        break;
+    }
+
+    if (result == INVALID_OPTIONS_ARGUMENT || result == INVALID_DEVICE_MEMORY)
+    {
+        fprintf(stdout, TTY_NONE "not estimated...");
+        result = DONE;
+    }
+    else if (!result)
+    {
+        fprintf(stdout, TTY_NONE "%d ms...", time);
+        *total += time;
+    }
+
+    return report_options(job->errors, result);
+}
+
+static int execute_call(struct job *job, int index)
+{
+    int result;
+    struct planned *step = job->plan + index;
+    const struct call *call = job->script.calls + index;
+    const int page_erase = job->settings.page_erase;
+
+    keep_erase(job, step);
+
+    if (step->skip)
+    {
+        print_call("Skipping", call);
+        fprintf(stdout, TTY_NONE "%s...", step->skip);
+        return report_options(job->errors, DONE);
+    }
+
+    if (step->blank)
+        job->settings.page_erase = 0;
+
+    result = call_options(&job->script, call);
+
+    if (step->blank)
+        job->settings.page_erase = page_erase;
+
+    return result;
+}
+
+int run_job(struct job *job, int argc, char *argv[])
+{
+    int result;
+    int index;
+    int total = 0;
+
+    if ((result = parse_options(&job->script, job->synopsis, job->options, job->errors, argc, argv)))
+        return result;
+
+    plan_options(job);
+
+    for (index = 0; index < job->script.count && !result; index++)
+        result = job->dry_run ? estimate_call(job, index, &total) : execute_call(job, index);
+
+    drop_preload(job);
+
+    if (job->dry_run && !result)
+    {
+        if (job->settings.baud_rate)
+            fprintf(stdout, TTY_NONE "Estimating %d options at %d baud...%d ms...", job->script.count, job->settings.baud_rate, total);
+        else
+            fprintf(stdout, TTY_NONE "Estimating %d options at %d baud, auto...%d ms...", job->script.count, DEFAULT_BAUD, total);
+
+        result = report_options(job->errors, DONE);
+    }
+
+    job->dry_run = 0;
+    return result;
+}
+
+static int serve_client(struct job *job, int result)
+{
+    const int console = dup(STDOUT_FILENO);
+
+    fflush(stdout);
+
+    if (console < 0 || dup2(job->server.client, STDOUT_FILENO) < 0)
+    {
+        if (console >= 0)
+            close(console);
+
+        return INTERNAL_ERROR;
+    }
+
+    restore_defaults(job);
+
+    if (!result)
+        result = finish_job(job, run_job(job, job->server.argc, job->server.argv));
+
+    if (result)
+        job->warm = 0;
+
+    fprintf(stdout, TTY_NONE "Finishing job...");
+    report_options(job->errors, result);
+
+    if (fflush(stdout) || ferror(stdout))
+    {
+        __fpurge(stdout);
+        clearerr(stdout);
+    }
+
+    dup2(console, STDOUT_FILENO);
+    close(console);
+    return result;
+}
+
+int serve_job(struct job *job)
+{
+    int result = DONE;
+
+    while (!job->stopping)
+    {
+        if ((result = accept_server(&job->server)) && job->server.client < 0)
+        {
+            const int error = errno;
+
+            if (error == EBADF || error == EINVAL)
+                break;
+
+            if (error != EINTR)
+            {
+                fprintf(stdout, TTY_NONE "Accepting job...");
+                report_options(job->errors, result);
+                wait_serial_port(100);
+            }
+
+            result = DONE;
+            continue;
+        }
+
+        fprintf(stdout, TTY_NONE "Job \"%s\"...", job->server.request);
+        result = serve_client(job, result);
+        finish_server(&job->server);
+        report_options(job->errors, result);
+    }
+
+    close_server(&job->server);
+    fprintf(stdout, TTY_NONE "Stopping daemon...");
+
+    if (job->session.serial.fd >= 0)
+    {
+        const int status = disconnect_session(&job->session);
+
+        if (!result)
+            result = status;
+    }
+
+    return report_options(job->errors, job->stopping ? DONE : result);
+}
+
+static int wait_board(struct job *job)
+{
+    int result = DONE;
+    char *log = 0;
+    size_t length = 0;
+    FILE *console = open_memstream(&log, &length);
+
+    fprintf(stdout, TTY_NONE "Waiting for board %d...", job->batch.board + 1);
+    fflush(stdout);
+
+    if (!console)
+        return INTERNAL_ERROR;
+
+    job->session.console = console;
+
+    while (!job->stopping)
+    {
+        fseek(console, 0, SEEK_SET);
+
+        if (!(result = restart_session(&job->session)) && !(result = identify_session(&job->session)) && fresh_batch(&job->batch, &job->session))
+            break;
+
+        if (result)
+            job->batch.absent = 1;
+
+        wait_serial_port(BATCH_POLL);
+    }
+
+    job->session.console = stdout;
+    fclose(console);
+
+    if (job->stopping)
+        fprintf(stdout, TTY_NONE "stopped...");
+    else
+        fprintf(stdout, TTY_NONE "%.*s", (int)length, log);
+
+    free(log);
+    return report_options(job->errors, job->stopping ? DONE : result) || job->stopping;
+}
+
+int repeat_job(struct job *job)
+{
+    if (!identify_session(&job->session))
+        fresh_batch(&job->batch, &job->session);
+
+    do
+    {
+        size_t index;
+        int result = DONE;
+
+        restore_defaults(job);
+
+        for (index = 0; index < job->batch.count && !result; index++)
+            result = finish_job(job, run_job(job, job->batch.tasks[index].argc, job->batch.tasks[index].argv));
+
+        fprintf(stdout, TTY_NONE "Board %d...", job->batch.board + 1);
+        count_batch(&job->batch, report_options(job->errors, result));
+    }
+    while (!job->stopping && !wait_board(job));
+
+    fprintf(stdout, TTY_NONE "Finishing %d boards, %d failed...", job->batch.board, job->batch.failed);
+
+    if (job->session.serial.fd >= 0)
+        close_serial_port(&job->session.serial);
+
+    return report_options(job->errors, job->batch.result);
+}
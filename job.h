@@ -0,0 +1,142 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef JOB_H
+#define JOB_H
+
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "batch.h"
+#include "buffer.h"
+#include "gang.h"
+#include "options.h"
+#include "server.h"
+#include "session.h"
+
+#define JOB_MEMORY (1024*1024)
+#define JOB_LOADER (64*1024)
+
+#define PLAN_CONNECT 10
+#define PLAN_TURNAROUND 1
+#define PLAN_MASS_ERASE 40
+#define PLAN_PAGE_ERASE 20
+
+enum operation
+{
+    SETTING_OPERATION,
+    BASE_OPERATION,
+    PAGE_ERASE_OPERATION,
+    DELTA_OPERATION,
+    DRY_RUN_OPERATION,
+    CONNECT_OPERATION,
+    UNPROTECT_OPERATION,
+    ERASE_OPERATION,
+    WRITE_OPERATION,
+    RUN_OPERATION,
+    READ_OPERATION,
+    ADJUST_OPERATION,
+    PROTECT_OPERATION,
+    TRACE_OPERATION,
+    DISCONNECT_OPERATION,
+    HOST_OPERATION
+};
+
+typedef enum operation (* classify_t)(const struct call *call);
+
+struct planned
+{
+    enum operation operation;
+    const char *skip;
+    int blank;
+    int leave;
+};
+
+struct preload
+{
+    pthread_t thread;
+    const char *file;
+    uint32_t base;
+    int result;
+    int error;
+    struct buffer buffer;
+};
+
+struct job
+{
+    const char *synopsis;
+    const struct option *options;
+    const struct error *errors;
+    classify_t classify;
+    struct settings settings;
+    struct settings defaults;
+    uint32_t base;
+    uint32_t default_base;
+    int output;
+    uint8_t *device_memory;
+    uint8_t *patch_memory;
+    uint8_t *image_memory;
+    uint8_t *loader_memory;
+    struct buffer loader;
+    struct buffer ranges;
+    struct buffer patches;
+    struct session session;
+    struct gang gang;
+    struct server server;
+    struct batch batch;
+    char file[PATH_MAX];
+    int warm;
+    int dry_run;
+    volatile sig_atomic_t stopping;
+    struct script script;
+    struct planned plan[OPTIONS_CALLS];
+    struct preload preload;
+};
+
+int init_job(struct job *job, const char *synopsis, const struct option options[], const struct error errors[], classify_t classify);
+void close_job(struct job *job);
+int range_job(struct job *job, uint32_t origin, size_t size);
+int patch_job(struct job *job, uint32_t origin, const uint8_t *data, size_t size);
+int patch_file_job(struct job *job, uint32_t origin, const char *file);
+int convert_job(struct job *job, const char *source, const char *output, int pid);
+int loader_job(struct job *job, const char *file);
+int connect_job(struct job *job, const char *file);
+int unprotect_job(struct job *job);
+int read_job(struct job *job, const char *file);
+int erase_job(struct job *job);
+int adjust_job(struct job *job, int voltage);
+int write_job(struct job *job, const char *file);
+int launch_job(struct job *job, const char *file);
+int protect_job(struct job *job);
+int trace_job(struct job *job);
+int disconnect_job(struct job *job);
+int listen_job(struct job *job, const char *path);
+int batch_job(struct job *job, const char *file);
+int run_job(struct job *job, int argc, char *argv[]);
+int finish_job(struct job *job, int result);
+int serve_job(struct job *job);
+int repeat_job(struct job *job);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "crc.h"
+#include "lz4.h"
+#include "errors.h"
+#include "serial.h"
+#include "loader.h"
+
+#define LOADER_TIMEOUT 1000
+#define LOADER_RETRIES 5
+
+struct frame
+{
+    uint8_t sequence;
+    uint32_t address;
+    size_t size;
+    int retries;
+};
+
+struct window
+{
+    const struct buffer *buffer;
+    size_t extent;
+    uint32_t address;
+    uint8_t sequence;
+    size_t count;
+    struct frame frames[LOADER_WINDOW];
+};
+
+static void put_u16(uint8_t *p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    put_u16(p, value);
+    put_u16(p + 2, value >> 16);
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return get_u16(p) | (uint32_t)get_u16(p + 2) << 16;
+}
+
+static int send_frame(struct loader *loader, uint8_t command, const struct frame *frame, const uint8_t *data, int compress)
+{
+    size_t size = 0;
+    uint8_t flags = 0;
+
+    if (data)
+    {
+        size = compress ? compress_lz4(data, frame->size, loader->packet + 12, frame->size - 1) : 0;
+
+        if (size)
+        {
+            flags |= LOADER_COMPRESSED;
+        }
+        else
+        {
+            size = frame->size;
+            memcpy(loader->packet + 12, data, size);
+        }
+    }
+
+    loader->packet[0] = LOADER_REQUEST;
+    loader->packet[1] = command;
+    loader->packet[2] = frame->sequence;
+    loader->packet[3] = flags;
+    put_u32(loader->packet + 4, frame->address);
+    put_u16(loader->packet + 8, size);
+    put_u16(loader->packet + 10, frame->size);
+    put_u32(loader->packet + 12 + size, crc32(0, loader->packet, 12 + size));
+
+    return write_serial_port(loader->serial, loader->packet, 12 + size + 4);
+}
+
+static int receive_frame(struct loader *loader, uint8_t *sequence, uint8_t *status, size_t *size)
+{
+    int result;
+
+    if ((result = configure_serial_port(loader->serial, LOADER_TIMEOUT)))
+        return result;
+
+    do
+    {
+        if ((result = read_serial_port(loader->serial, loader->reply, 1)))
+            return result;
+    }
+    while (loader->reply[0] != LOADER_REPLY);
+
+    if ((result = read_serial_port(loader->serial, loader->reply + 1, 4)))
+        return result;
+
+    if ((*size = get_u16(loader->reply + 3)) > LOADER_FRAME)
+        return INVALID_DEVICE_REPLY;
+
+    if ((result = read_serial_port(loader->serial, loader->reply + 5, *size + 4)))
+        return result;
+
+    if (crc32(0, loader->reply, 5 + *size) != get_u32(loader->reply + 5 + *size))
+        return INVALID_DEVICE_REPLY;
+
+    *sequence = loader->reply[1];
+    *status = loader->reply[2];
+    memcpy(loader->payload, loader->reply + 5, *size);
+
+    return DONE;
+}
+
+int sync_loader(struct loader *loader)
+{
+    int result;
+    uint8_t sequence;
+    uint8_t status;
+    size_t size;
+
+    if ((result = receive_frame(loader, &sequence, &status, &size)))
+        return result;
+
+    return sequence == LOADER_HELLO && !status ? DONE : INVALID_DEVICE_REPLY;
+}
+
+static int next_frame(struct window *window, struct frame *frame)
+{
+    const struct buffer *buffer = window->buffer;
+
+    while (window->extent < buffer->count)
+    {
+        const struct extent *extent = buffer->extents + window->extent;
+        const uint32_t end = extent->origin + extent->size;
+
+        if (window->address < extent->origin)
+            window->address = extent->origin;
+
+        if (window->address < end)
+        {
+            frame->sequence = window->sequence++;
+            frame->address = window->address;
+            frame->size = end - window->address < LOADER_FRAME ? end - window->address : LOADER_FRAME;
+            frame->retries = 0;
+            window->address += frame->size;
+            return 1;
+        }
+
+        window->extent++;
+    }
+
+    return 0;
+}
+
+static struct frame *find_frame(struct window *window, uint8_t sequence)
+{
+    size_t index;
+
+    for (index = 0; index < window->count; index++)
+    {
+        if (window->frames[index].sequence == sequence)
+            return window->frames + index;
+    }
+
+    return 0;
+}
+
+static void release_frame(struct window *window, struct frame *frame)
+{
+    *frame = window->frames[--window->count];
+}
+
+static const uint8_t *frame_data(const struct buffer *buffer, const struct frame *frame)
+{
+    return (const uint8_t *)buffer->data + frame->address - buffer->origin;
+}
+
+static int resend_frame(struct loader *loader, uint8_t command, const struct window *window, struct frame *frame, int compress)
+{
+    if (++frame->retries > LOADER_RETRIES)
+        return NO_DEVICE_REPLY;
+
+    return send_frame(loader, command, frame, command == LOADER_WRITE ? frame_data(window->buffer, frame) : 0, compress);
+}
+
+static int resend_window(struct loader *loader, uint8_t command, struct window *window, int compress)
+{
+    int result;
+    size_t index;
+
+    memset(loader->packet, 0, sizeof(loader->packet));
+
+    if ((result = write_serial_port(loader->serial, loader->packet, sizeof(loader->packet))))
+        return result;
+
+    for (index = 0; index < window->count; index++)
+    {
+        if ((result = resend_frame(loader, command, window, window->frames + index, compress)))
+            return result;
+    }
+
+    return DONE;
+}
+
+static int receive_window(struct loader *loader, uint8_t command, struct window *window, int compress, struct frame **frame, uint8_t *status, size_t *size)
+{
+    for (;;)
+    {
+        int result;
+        uint8_t sequence;
+
+        if ((result = receive_frame(loader, &sequence, status, size)) == NO_DEVICE_REPLY || result == INVALID_DEVICE_REPLY)
+        {
+            if ((result = resend_window(loader, command, window, compress)))
+                return result;
+
+            continue;
+        }
+
+        if (result)
+            return result;
+
+        if ((*frame = find_frame(window, sequence)))
+            return DONE;
+    }
+}
+
+int write_loader_memory(struct loader *loader, const struct buffer *buffer, int compress, int *blocks, size_t *bytes)
+{
+    struct window window = {buffer, 0, 0, 0, 0};
+    struct frame *frame;
+
+    for (;;)
+    {
+        int result;
+        uint8_t status;
+        size_t size;
+
+        while (window.count < LOADER_WINDOW && next_frame(&window, window.frames + window.count))
+        {
+            frame = window.frames + window.count;
+
+            if (blocks && blank_buffer(buffer, frame->address, frame->size))
+            {
+                *blocks += 1;
+                *bytes += frame->size;
+                continue;
+            }
+
+            if ((result = send_frame(loader, LOADER_WRITE, frame, frame_data(buffer, frame), compress)))
+                return result;
+
+            window.count++;
+        }
+
+        if (!window.count)
+            return DONE;
+
+        if ((result = receive_window(loader, LOADER_WRITE, &window, compress, &frame, &status, &size)))
+            return result;
+
+        if (!status)
+        {
+            release_frame(&window, frame);
+            continue;
+        }
+
+        if ((result = resend_frame(loader, LOADER_WRITE, &window, frame, compress)))
+            return result == NO_DEVICE_REPLY ? INVALID_DEVICE_REPLY : result;
+    }
+}
+
+int read_loader_memory(struct loader *loader, const struct buffer *buffer)
+{
+    const struct extent whole = {buffer->origin, buffer->size};
+    struct buffer scratch = *buffer;
+    struct window window = {&scratch, 0, 0, 0, 0};
+    struct frame *frame;
+
+    if (!scratch.count)
+    {
+        scratch.count = 1;
+        scratch.extents[0] = whole;
+    }
+
+    for (;;)
+    {
+        int result;
+        uint8_t status;
+        size_t size;
+
+        while (window.count < LOADER_WINDOW && next_frame(&window, window.frames + window.count))
+        {
+            if ((result = send_frame(loader, LOADER_READ, window.frames + window.count, 0, 0)))
+                return result;
+
+            window.count++;
+        }
+
+        if (!window.count)
+            return DONE;
+
+        if ((result = receive_window(loader, LOADER_READ, &window, 0, &frame, &status, &size)))
+            return result;
+
+        if (!status && size == frame->size)
+        {
+            memcpy((uint8_t *)buffer->data + frame->address - buffer->origin, loader->payload, size);
+            release_frame(&window, frame);
+            continue;
+        }
+
+        if ((result = resend_frame(loader, LOADER_READ, &window, frame, 0)))
+            return result == NO_DEVICE_REPLY ? INVALID_DEVICE_REPLY : result;
+    }
+}
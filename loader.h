@@ -0,0 +1,51 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "buffer.h"
+#include "serial.h"
+
+#define LOADER_REQUEST 0x5A
+#define LOADER_REPLY 0xA5
+#define LOADER_WRITE 0x01
+#define LOADER_READ 0x02
+#define LOADER_COMPRESSED 0x01
+#define LOADER_HELLO 0xFF
+#define LOADER_FRAME 1024
+#define LOADER_WINDOW 2
+
+struct loader
+{
+    struct serial *serial;
+    uint8_t packet[12 + LOADER_FRAME + 4];
+    uint8_t reply[5 + LOADER_FRAME + 4];
+    uint8_t payload[LOADER_FRAME];
+};
+
+int sync_loader(struct loader *loader);
+int write_loader_memory(struct loader *loader, const struct buffer *buffer, int compress, int *blocks, size_t *bytes);
+int read_loader_memory(struct loader *loader, const struct buffer *buffer);
+
+#endif
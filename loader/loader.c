@@ -0,0 +1,437 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define REG32(address) (*(volatile uint32_t *)(address))
+#define REG16(address) (*(volatile uint16_t *)(address))
+
+#if defined(FAMILY_F0)
+#define USART_BASE 0x40013800
+#define USART_STATUS REG32(USART_BASE + 0x1C)
+#define USART_CLEAR REG32(USART_BASE + 0x20)
+#define USART_RX REG32(USART_BASE + 0x24)
+#define USART_TX REG32(USART_BASE + 0x28)
+#elif defined(FAMILY_F1)
+#define USART_BASE 0x40013800
+#define USART_STATUS REG32(USART_BASE + 0x00)
+#define USART_RX REG32(USART_BASE + 0x04)
+#define USART_TX REG32(USART_BASE + 0x04)
+#elif defined(FAMILY_F4)
+#define USART_BASE 0x40011000
+#define USART_STATUS REG32(USART_BASE + 0x00)
+#define USART_RX REG32(USART_BASE + 0x04)
+#define USART_TX REG32(USART_BASE + 0x04)
+#else
+#error "Select device family: FAMILY_F0, FAMILY_F1 or FAMILY_F4"
+#endif
+
+#define USART_ORE (1 << 3)
+#define USART_RXNE (1 << 5)
+#define USART_TXE (1 << 7)
+
+#if defined(FAMILY_F4)
+#define FLASH_KEYR(bank) REG32(0x40023C04)
+#define FLASH_SR(bank) REG32(0x40023C0C)
+#define FLASH_CR(bank) REG32(0x40023C10)
+#define FLASH_SR_BSY (1 << 16)
+#define FLASH_SR_ERRORS 0x000000F2
+#define FLASH_CR_PG (1 << 0)
+#define FLASH_CR_PSIZE_X32 (2 << 8)
+#define FLASH_CR_LOCK (1 << 31)
+#define FLASH_BANK(address) 0
+#else
+#define FLASH_KEYR(bank) REG32(0x40022004 + (bank))
+#define FLASH_SR(bank) REG32(0x4002200C + (bank))
+#define FLASH_CR(bank) REG32(0x40022010 + (bank))
+#define FLASH_SR_BSY (1 << 0)
+#define FLASH_SR_ERRORS 0x00000014
+#define FLASH_CR_PG (1 << 0)
+#define FLASH_CR_LOCK (1 << 7)
+#define FLASH_BANK(address) ((address) >= 0x08080000 ? 0x40 : 0)
+#endif
+
+/* Must match loader.h of the host */
+#define LOADER_REQUEST 0x5A
+#define LOADER_REPLY 0xA5
+#define LOADER_WRITE 0x01
+#define LOADER_READ 0x02
+#define LOADER_COMPRESSED 0x01
+#define LOADER_HELLO 0xFF
+#define LOADER_FRAME 1024
+
+#define STATUS_DONE 0
+#define STATUS_CHECKSUM 1
+#define STATUS_FLASH 2
+#define STATUS_FRAME 3
+
+#define SLOT_FREE 0
+#define SLOT_READY 1
+
+struct slot
+{
+    volatile int state;
+    uint8_t data[12 + LOADER_FRAME + 4];
+};
+
+extern uint32_t __stack;
+extern uint32_t __bss_start;
+extern uint32_t __bss_end;
+
+void reset(void);
+
+__attribute__((section(".vectors"), used)) static const void *vectors[2] =
+{
+    &__stack,
+    reset
+};
+
+static const uint32_t table[16] =
+{
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+    0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static struct slot slots[2];
+static size_t receive_slot;
+static size_t receive_count;
+static size_t receive_size;
+static uint8_t work[LOADER_FRAME];
+static uint8_t reply[5 + LOADER_FRAME + 4];
+
+static void poll(void)
+{
+    struct slot *slot = slots + receive_slot;
+    uint32_t status = USART_STATUS;
+    uint8_t byte;
+
+#if defined(FAMILY_F0)
+    if (status & USART_ORE)
+        USART_CLEAR = USART_ORE;
+#endif
+
+    if (!(status & USART_RXNE))
+        return;
+
+    byte = USART_RX;
+
+    if (slot->state != SLOT_FREE)
+        return;
+
+    if (!receive_count && byte != LOADER_REQUEST)
+        return;
+
+    slot->data[receive_count++] = byte;
+
+    if (receive_count == 12)
+    {
+        receive_size = slot->data[8] | slot->data[9] << 8;
+
+        if (receive_size > LOADER_FRAME)
+        {
+            receive_count = 0;
+            return;
+        }
+    }
+
+    if (receive_count > 12 && receive_count == 12 + receive_size + 4)
+    {
+        slot->state = SLOT_READY;
+        receive_slot ^= 1;
+        receive_count = 0;
+    }
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (size--)
+    {
+        crc = table[(crc ^ *data) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (*data++ >> 4)) & 0x0F] ^ (crc >> 4);
+        poll();
+    }
+
+    return ~crc;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void send(const uint8_t *data, size_t size)
+{
+    while (size--)
+    {
+        while (!(USART_STATUS & USART_TXE))
+            poll();
+
+        USART_TX = *data++;
+    }
+}
+
+static void respond(uint8_t sequence, uint8_t status, size_t size)
+{
+    reply[0] = LOADER_REPLY;
+    reply[1] = sequence;
+    reply[2] = status;
+    reply[3] = size;
+    reply[4] = size >> 8;
+    put_u32(reply + 5 + size, crc32(reply, 5 + size));
+    send(reply, 5 + size + 4);
+}
+
+static int decompress(const uint8_t *p, size_t size, uint8_t *q, size_t capacity)
+{
+    const uint8_t *end = p + size;
+    uint8_t *start = q;
+    uint8_t *limit = q + capacity;
+
+    while (p < end)
+    {
+        const uint8_t token = *p++;
+        size_t length = token >> 4;
+        size_t offset;
+
+        if (length == 15)
+        {
+            do
+            {
+                if (p >= end)
+                    return -1;
+
+                length += *p;
+            }
+            while (*p++ == 255);
+        }
+
+        if (length > (size_t)(end - p) || length > (size_t)(limit - q))
+            return -1;
+
+        while (length--)
+            *q++ = *p++;
+
+        poll();
+
+        if (p >= end)
+            break;
+
+        if (end - p < 2)
+            return -1;
+
+        offset = p[0] | p[1] << 8;
+        p += 2;
+
+        if (!offset || offset > (size_t)(q - start))
+            return -1;
+
+        length = token & 0x0F;
+
+        if (length == 15)
+        {
+            do
+            {
+                if (p >= end)
+                    return -1;
+
+                length += *p;
+            }
+            while (*p++ == 255);
+        }
+
+        length += 4;
+
+        if (length > (size_t)(limit - q))
+            return -1;
+
+        while (length--)
+        {
+            *q = q[-offset];
+            q++;
+        }
+
+        poll();
+    }
+
+    return q - start;
+}
+
+static int unlock(uint32_t bank)
+{
+    if (FLASH_CR(bank) & FLASH_CR_LOCK)
+    {
+        FLASH_KEYR(bank) = 0x45670123;
+        FLASH_KEYR(bank) = 0xCDEF89AB;
+    }
+
+    return FLASH_CR(bank) & FLASH_CR_LOCK ? STATUS_FLASH : STATUS_DONE;
+}
+
+static int program(uint32_t address, const uint8_t *data, size_t size)
+{
+    const uint32_t bank = FLASH_BANK(address);
+    int status;
+
+    if ((status = unlock(bank)))
+        return status;
+
+    FLASH_SR(bank) = FLASH_SR_ERRORS;
+
+#if defined(FAMILY_F4)
+    FLASH_CR(bank) = FLASH_CR_PSIZE_X32 | FLASH_CR_PG;
+
+    for (; size >= 4; size -= 4, address += 4, data += 4)
+    {
+        if (REG32(address) == get_u32(data))
+            continue;
+
+        REG32(address) = get_u32(data);
+
+        while (FLASH_SR(bank) & FLASH_SR_BSY)
+            poll();
+
+        if (FLASH_SR(bank) & FLASH_SR_ERRORS || REG32(address) != get_u32(data))
+            break;
+    }
+#else
+    FLASH_CR(bank) = FLASH_CR_PG;
+
+    for (; size >= 2; size -= 2, address += 2, data += 2)
+    {
+        const uint16_t value = data[0] | data[1] << 8;
+
+        if (REG16(address) == value)
+            continue;
+
+        REG16(address) = value;
+
+        while (FLASH_SR(bank) & FLASH_SR_BSY)
+            poll();
+
+        if (FLASH_SR(bank) & FLASH_SR_ERRORS || REG16(address) != value)
+            break;
+    }
+#endif
+
+    FLASH_CR(bank) = 0;
+    return size ? STATUS_FLASH : STATUS_DONE;
+}
+
+static void process(struct slot *slot)
+{
+    const uint8_t *data = slot->data;
+    const uint8_t sequence = data[2];
+    const uint32_t address = get_u32(data + 4);
+    const size_t size = data[8] | data[9] << 8;
+    const size_t length = data[10] | data[11] << 8;
+    int status = STATUS_DONE;
+
+    if (crc32(data, 12 + size) != get_u32(data + 12 + size))
+    {
+        slot->state = SLOT_FREE;
+        respond(sequence, STATUS_CHECKSUM, 0);
+        return;
+    }
+
+    if (length > LOADER_FRAME)
+    {
+        slot->state = SLOT_FREE;
+        respond(sequence, STATUS_FRAME, 0);
+        return;
+    }
+
+    if (data[1] == LOADER_WRITE)
+    {
+        const uint8_t *source = data + 12;
+
+        if (data[3] & LOADER_COMPRESSED)
+        {
+            if (decompress(data + 12, size, work, sizeof(work)) != (int)length)
+                status = STATUS_FRAME;
+
+            source = work;
+        }
+        else if (size != length)
+        {
+            status = STATUS_FRAME;
+        }
+
+        if (!status)
+            status = program(address, source, length);
+
+        slot->state = SLOT_FREE;
+        respond(sequence, status, 0);
+        return;
+    }
+
+    if (data[1] == LOADER_READ)
+    {
+        const volatile uint8_t *source = (const volatile uint8_t *)address;
+        size_t index;
+
+        for (index = 0; index < length; index++)
+            reply[5 + index] = source[index];
+
+        slot->state = SLOT_FREE;
+        respond(sequence, STATUS_DONE, length);
+        return;
+    }
+
+    slot->state = SLOT_FREE;
+    respond(sequence, STATUS_FRAME, 0);
+}
+
+void reset(void)
+{
+    uint32_t *p = &__bss_start;
+    size_t work_slot = 0;
+
+    while (p < &__bss_end)
+        *p++ = 0;
+
+    respond(LOADER_HELLO, STATUS_DONE, 0);
+
+    for (;;)
+    {
+        struct slot *slot = slots + work_slot;
+
+        while (slot->state != SLOT_READY)
+            poll();
+
+        process(slot);
+        work_slot ^= 1;
+    }
+}
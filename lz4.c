@@ -0,0 +1,205 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "lz4.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define HASH_BITS 12
+#define MAX_OFFSET 0xFFFF
+
+static uint32_t hash(const uint8_t *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *p, const uint8_t *end, size_t length)
+{
+    while (length >= 255)
+    {
+        if (p >= end)
+            return 0;
+
+        *p++ = 255;
+        length -= 255;
+    }
+
+    if (p >= end)
+        return 0;
+
+    *p++ = length;
+    return p;
+}
+
+static uint8_t *put_sequence(uint8_t *p, const uint8_t *end, const uint8_t *literals, size_t count, size_t offset, size_t length)
+{
+    uint8_t *token = p++;
+
+    if (p > end)
+        return 0;
+
+    *token = (count < 15 ? count : 15) << 4;
+
+    if (count >= 15 && !(p = put_length(p, end, count - 15)))
+        return 0;
+
+    if (p + count > end)
+        return 0;
+
+    memcpy(p, literals, count);
+    p += count;
+
+    if (!offset)
+        return p;
+
+    if (p + 2 > end)
+        return 0;
+
+    *p++ = offset;
+    *p++ = offset >> 8;
+
+    length -= MIN_MATCH;
+    *token |= length < 15 ? length : 15;
+
+    if (length >= 15 && !(p = put_length(p, end, length - 15)))
+        return 0;
+
+    return p;
+}
+
+size_t compress_lz4(const uint8_t *source, size_t size, uint8_t *target, size_t capacity)
+{
+    const uint8_t *table[1 << HASH_BITS] = {0};
+    const uint8_t *anchor = source;
+    const uint8_t *p = source;
+    const uint8_t *limit = size > MATCH_LIMIT ? source + size - MATCH_LIMIT : source;
+    const uint8_t *end = source + size;
+    uint8_t *q = target;
+
+    while (p < limit)
+    {
+        const uint32_t index = hash(p);
+        const uint8_t *match = table[index];
+        size_t length = 0;
+
+        table[index] = p;
+
+        if (!match || p - match > MAX_OFFSET || memcmp(match, p, MIN_MATCH))
+        {
+            p++;
+            continue;
+        }
+
+        while (match > anchor && p > anchor && p[-1] == match[-1] && match > source)
+        {
+            match--;
+            p--;
+        }
+
+        while (p + length < end - LAST_LITERALS && p[length] == match[length])
+            length++;
+
+        if (!(q = put_sequence(q, target + capacity, anchor, p - anchor, p - match, length)))
+            return 0;
+
+        p += length;
+        anchor = p;
+    }
+
+    if (!(q = put_sequence(q, target + capacity, anchor, end - anchor, 0, 0)))
+        return 0;
+
+    return q - target;
+}
+
+static const uint8_t *get_length(const uint8_t *p, const uint8_t *end, size_t *length)
+{
+    uint8_t value;
+
+    do
+    {
+        if (p >= end)
+            return 0;
+
+        value = *p++;
+        *length += value;
+    }
+    while (value == 255);
+
+    return p;
+}
+
+size_t decompress_lz4(const uint8_t *source, size_t size, uint8_t *target, size_t capacity)
+{
+    const uint8_t *p = source;
+    const uint8_t *end = source + size;
+    uint8_t *q = target;
+
+    while (p < end)
+    {
+        const uint8_t token = *p++;
+        size_t count = token >> 4;
+        size_t offset;
+        size_t length = token & 15;
+
+        if (count == 15 && !(p = get_length(p, end, &count)))
+            return 0;
+
+        if (count > (size_t)(end - p) || count > capacity - (q - target))
+            return 0;
+
+        memcpy(q, p, count);
+        p += count;
+        q += count;
+
+        if (p == end)
+            break;
+
+        if (end - p < 2)
+            return 0;
+
+        offset = p[0] | p[1] << 8;
+        p += 2;
+
+        if (length == 15 && !(p = get_length(p, end, &length)))
+            return 0;
+
+        length += MIN_MATCH;
+
+        if (!offset || offset > (size_t)(q - target) || length > capacity - (q - target))
+            return 0;
+
+        while (length--)
+        {
+            *q = q[-offset];
+            q++;
+        }
+    }
+
+    return q - target;
+}
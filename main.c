@@ -21,47 +21,25 @@
  * THE SOFTWARE.
  */
 
-#include <time.h>
+
+
+
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stddef.h>
 #include <stdint.h>
 #include <memory.h>
-#include "buffer.h"
+#include <unistd.h>
 #include "errors.h"
-#include "serial.h"
+#include "job.h"
 #include "options.h"
 
 #ifndef VERSION
 #define VERSION 0
 #endif
 
-struct device
-{
-    uint16_t pid;
-    size_t size;
-    const char *name;
-};
-
-static const struct device devices[] =
-{
-    {0x0440, 0x00040000, "F05xxx/030x8"},
-    {0x0444, 0x00040000, "F03xx4/03xx6"},
-    {0x0442, 0x00040000, "F030xC/09xxx"},
-    {0x0445, 0x00040000, "F04xxx/070x6"},
-    {0x0448, 0x00040000, "F070xB/071xx/072xx"},
-    {0x0412, 0x00008000, "F10xxx low-density"},
-    {0x0410, 0x00020000, "F10xxx medium-density"},
-    {0x0414, 0x00080000, "F10xxx high-density"},
-    {0x0420, 0x00020000, "F10xxx medium-density value line"},
-    {0x0428, 0x00080000, "F10xxx high-density value line"},
-    {0x0418, 0x00040000, "F105xx/107xx"},
-    {0x0430, 0x00100000, "F10xxx extra-density"},
-    {0x0423, 0x00040000, "F401xB/401xC"},
-    {0x0641, 0x00020000, "Experimental"},
-};
-
 static const char *modes[] =
 {
     "reset",
@@ -72,471 +50,426 @@ static const char *modes[] =
     "clear"
 };
 
-static int rts_mode = 2;
-static int dtr_mode = 0;
-static int experimental = 0;
-static int trace_size = 4096;
-static int trace_time = 5;
-static const struct device *selected_device = devices;
-static uint8_t device_version;
-static uint8_t device_erase_command;
-static uint8_t device_buffer[512];
-static uint8_t device_memory[1024*1024];
-
-static int reset_device(int boot)
+static const struct error errors[] =
 {
-    int result;
-    const int state[2][6] =
-    {
-        {1, 0, boot, !boot, 1, 0},
-        {0, 1, boot, !boot, 1, 0}
-    };
+    {INVALID_DEVICE_MEMORY, "Device memory differs from file"},
+    {INVALID_FILE_CHECKSUM, "Invalid checksum of file"},
+    {INVALID_FILE_CONTENT, "Invalid device memory location or invalid record in file"},
+    {UNSUPPORTED_DEVICE, "Unsupported device"},
+    {INVALID_DEVICE_REPLY, "Invalid reply from device bootloader"},
+    {NO_DEVICE_REPLY, "No reply from device bootloader"},
+    {SERIAL_PORT_ALREADY_OPEN, "Serial port already open"},
+    {INTERNAL_ERROR, "Internal error"},
+    {INVALID_OPTIONS_ARGUMENT, "Invalid actual parameter"},
+    {INVALID_OPTION, "Invalid option"},
+    {DONE, "No errors, all done"},
+};
 
-    if ((result = control_serial_port(state[0][rts_mode], state[0][dtr_mode])))
-        return result;
+static struct job job;
 
-    if ((result = wait_serial_port(1)))
-        return result;
+static int select_mode(const char *mode, int *index)
+{
+    int count = sizeof(modes) / sizeof(const char *);
 
-    if ((result = control_serial_port(state[1][rts_mode], state[1][dtr_mode])))
-        return result;
+    while (count--)
+    {
+        if (!strcmp(mode, modes[count]))
+        {
+            *index = count;
+            return DONE;
+        }
+    }
 
-    return DONE;
+    return INVALID_OPTIONS_ARGUMENT;
 }
 
-static int try_to_handshake_device(void)
+static int select_rts_mode(const char *mode)
 {
-    int result;
-
-    device_buffer[0] = 0x7F;
-
-    if ((result = wait_serial_port(5)))
-        return result;
-
-    if ((result = flush_serial_port()))
-        return result;
-
-    if ((result = write_serial_port(&device_buffer, 1)))
-        return result;
+    fprintf(stdout, TTY_NONE "Selecting RTS mode \"%s\"...", mode);
+    return select_mode(mode, &job.settings.rts_mode);
+}
 
-    if ((result = read_serial_port(&device_buffer, 1)))
-        return result;
+static int select_dtr_mode(const char *mode)
+{
+    fprintf(stdout, TTY_NONE "Selecting DTR mode \"%s\"...", mode);
+    return select_mode(mode, &job.settings.dtr_mode);
+}
 
-    return device_buffer[0] == 0x79 ? DONE : INVALID_DEVICE_REPLY;
+static int experimental_mode(void)
+{
+    fprintf(stdout, TTY_NONE "Selecting experimental device...");
+    job.settings.experimental = 1;
+    return DONE;
 }
 
-static int handshake_device(void)
+static int page_erase_mode(void)
 {
-    int result;
-    int count = 5;
+    fprintf(stdout, TTY_NONE "Selecting page erase mode...");
+    job.settings.page_erase = 1;
+    return DONE;
+}
 
-    if ((result = configure_serial_port(1)))
-        return result;
+static int select_read_range(const char *range)
+{
+    long origin;
+    long size;
+    char tail;
 
-    while (count-- && (result = try_to_handshake_device()))
-        continue;
+    fprintf(stdout, TTY_NONE "Selecting read range \"%s\"...", range);
 
-    if ((result = configure_serial_port(50)))
-        return result;
+    if (sscanf(range, "%li:%li%c", &origin, &size, &tail) != 2 || origin < 0 || size <= 0 || origin + size > 0x100000000L)
+        return INVALID_OPTIONS_ARGUMENT;
 
-    return result;
+    return range_job(&job, origin, size);
 }
 
-static uint8_t device_checksum(uint8_t *data, size_t size)
+static int trim_mode(void)
 {
-    uint8_t checksum = 0x00;
+    fprintf(stdout, TTY_NONE "Selecting trim mode...");
+    job.settings.trim_read = 1;
+    return DONE;
+}
 
-    if (size == 1)
-        return ~*data;
+static int select_record_size(const char *size)
+{
+    fprintf(stdout, TTY_NONE "Selecting record size \"%s\"...", size);
 
-    while (size--)
-        checksum ^= *data++;
+    if (sscanf(size, "%d", &job.settings.record_size) != 1)
+        return INVALID_OPTIONS_ARGUMENT;
 
-    return checksum;
+    return job.settings.record_size == 16 || job.settings.record_size == 32 || job.settings.record_size == 64 || job.settings.record_size == 255 ? DONE : INVALID_OPTIONS_ARGUMENT;
 }
 
-static int device_request(size_t size)
+static int sparse_mode(void)
 {
-    int result;
+    fprintf(stdout, TTY_NONE "Selecting sparse mode...");
+    job.settings.sparse_read = 1;
+    return DONE;
+}
 
-    device_buffer[size] = device_checksum(device_buffer, size);
+static int select_base(const char *base)
+{
+    long address;
+    char tail;
 
-    if ((result = write_serial_port(device_buffer, size + 1)))
-        return result;
+    fprintf(stdout, TTY_NONE "Selecting base \"%s\"...", base);
 
-    if ((result = read_serial_port(device_buffer, 1)))
-        return result;
+    if (sscanf(base, "%li%c", &address, &tail) != 1 || address <= 0 || address > 0xFFFFFFFFL)
+        return INVALID_OPTIONS_ARGUMENT;
 
-    return device_buffer[0] == 0x79 ? DONE : INVALID_DEVICE_REPLY;
+    job.base = address;
+    return DONE;
 }
 
-static int device_response(size_t size)
+static int select_patch(const char *patch)
 {
-    int result;
+    long origin;
+    int offset = 0;
+    size_t size = 0;
+    uint8_t bytes[256];
+    const char *value;
 
-    if ((result = read_serial_port(device_buffer, size + 1)))
-        return result;
+    fprintf(stdout, TTY_NONE "Selecting patch \"%s\"...", patch);
 
-    return device_buffer[size] == 0x79 ? DONE : INVALID_DEVICE_REPLY;
-}
+    if (sscanf(patch, "%li=%n", &origin, &offset) != 1 || !offset || origin < FLASH_ORIGIN || origin >= FLASH_ORIGIN + JOB_MEMORY)
+        return INVALID_OPTIONS_ARGUMENT;
 
-static int select_device(uint16_t pid)
-{
-    int count = sizeof(devices) / sizeof(struct device);
+    value = patch + offset;
 
-    fprintf(stdout, TTY_NONE "PID%04X...", pid);
-    selected_device = devices;
+    if (*value == '@')
+        return patch_file_job(&job, origin, value + 1);
 
-    while (count--)
+    for (; isxdigit((uint8_t)value[0]) && isxdigit((uint8_t)value[1]); value += 2)
     {
-        if (selected_device->pid == pid)
-            return DONE;
+        if (size == sizeof(bytes))
+            return INVALID_OPTIONS_ARGUMENT;
 
-        selected_device++;
+        sscanf(value, "%2hhx", bytes + size++);
     }
 
-    return UNSUPPORTED_DEVICE;
+    if (*value || !size)
+        return INVALID_OPTIONS_ARGUMENT;
+
+    return patch_job(&job, origin, bytes, size);
 }
 
-static int select_mode(const char *mode, int *index)
+static int convert_image(const char *files)
 {
-    int count = sizeof(modes) / sizeof(const char *);
+    char source[PATH_MAX];
+    char output[PATH_MAX];
+    const char *target = strchr(files, '=');
+    const char *pid;
+    unsigned int value = 0;
+    size_t size;
 
-    while (count--)
+    fprintf(stdout, TTY_NONE "Converting \"%s\"...", files);
+
+    if (!target || target == files || !target[1] || target - files >= (long)sizeof(source))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    memcpy(source, files, target - files);
+    source[target - files] = 0;
+
+    size = strlen(++target);
+
+    if ((pid = strrchr(target, ':')) && pid[1] && strlen(pid + 1) <= 4 && strspn(pid + 1, "0123456789ABCDEFabcdef") == strlen(pid + 1))
     {
-        if (!strcmp(mode, modes[count]))
-        {
-            *index = count;
-            return DONE;
-        }
+        sscanf(pid + 1, "%x", &value);
+        size = pid - target;
+    }
+    else
+    {
+        pid = 0;
     }
 
-    return INVALID_OPTIONS_ARGUMENT;
+    if (!size || size >= sizeof(output))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    memcpy(output, target, size);
+    output[size] = 0;
+
+    return convert_job(&job, source, output, pid ? (int)value : -1);
 }
 
-static int select_rts_mode(const char *mode)
+static int select_loader(const char *file)
 {
-    fprintf(stdout, TTY_NONE "Selecting RTS mode \"%s\"...", mode);
-    return select_mode(mode, &rts_mode);
+    fprintf(stdout, TTY_NONE "Selecting loader \"%s\"...", file);
+    return loader_job(&job, file);
 }
 
-static int select_dtr_mode(const char *mode)
+static int compress_mode(void)
 {
-    fprintf(stdout, TTY_NONE "Selecting DTR mode \"%s\"...", mode);
-    return select_mode(mode, &dtr_mode);
+    fprintf(stdout, TTY_NONE "Selecting loader compression...");
+    job.settings.loader_compress = 1;
+    return DONE;
 }
 
-static int experimental_mode(void)
+static int verify_mode(void)
 {
-    fprintf(stdout, TTY_NONE "Selecting experimental device...");
-    experimental = 1;
+    fprintf(stdout, TTY_NONE "Selecting verify mode...");
+    job.settings.verify_write = 1;
     return DONE;
 }
 
-static int connect_device(const char *file)
+static int delta_write_mode(void)
 {
-    int result;
-
-    fprintf(stdout, TTY_NONE "Connect \"%s\"...", file);
-
-    if ((result = open_serial_port(file)))
-        return result;
-
-    if ((result = reset_device(1)))
-        return result;
-
-    if ((result = handshake_device()))
-        return result;
-
-    device_buffer[0] = 0x00;
-    if ((result = device_request(1)))
-        return result;
-
-    if ((result = device_response(13)))
-        return result;
-
-    device_version = device_buffer[1];
-    device_erase_command = device_buffer[8];
-    fprintf(stdout, TTY_NONE "V%1X.%1X...", device_version >> 4, device_version & 0x0F);
-
-    device_buffer[0] = 0x02;
-    if ((result = device_request(1)))
-        return result;
-
-    if (experimental)
-    {
-        if ((result = device_response(5)))
-            return result;
-
-        if ((result = select_device(device_buffer[1] << 8 | device_buffer[2])))
-            return result;
-    }
-    else
-    {
-        if ((result = device_response(3)))
-            return result;
-
-        if ((result = select_device(device_buffer[1] << 8 | device_buffer[2])))
-            return result;
-    }
-
+    fprintf(stdout, TTY_NONE "Selecting delta write mode...");
+    job.settings.delta_write = 1;
     return DONE;
 }
 
-static int unprotect_device(void)
+static int low_latency_mode(void)
 {
-    int result;
-
-    fprintf(stdout, TTY_NONE "Readout unprotecting...");
-
-    device_buffer[0] = 0x92;
-    if ((result = device_request(1)))
-        return result;
-
-    if ((result = device_response(0)))
-        return result;
-
-    if ((result = handshake_device()))
-        return result;
-
+    fprintf(stdout, TTY_NONE "Selecting low latency mode...");
+    job.settings.low_latency = 1;
     return DONE;
 }
 
-static int read_device_memory(const struct buffer *buffer)
+static int select_baud_rate(const char *baud)
 {
-    uint32_t address = buffer->origin;
-    uint8_t *data = buffer->data;
-    size_t size = buffer->size;
+    fprintf(stdout, TTY_NONE "Selecting baud rate \"%s\"...", baud);
 
-    while (size)
+    if (!strcmp(baud, "auto"))
     {
-        int result;
-        size_t count = size < 256 ? size : 256;
-
-        device_buffer[0] = 0x11;
-        if ((result = device_request(1)))
-            return result;
-
-        device_buffer[0] = address >> 24;
-        device_buffer[1] = address >> 16;
-        device_buffer[2] = address >> 8;
-        device_buffer[3] = address;
-        if ((result = device_request(4)))
-            return result;
-
-        device_buffer[0] = count - 1;
-        if ((result = device_request(1)))
-            return result;
-
-        if ((result = read_serial_port(data, count)))
-            return result;
-
-        size -= count;
-        data += count;
-        address += count;
+        job.settings.baud_rate = 0;
+        return DONE;
     }
 
-    return DONE;
+    return sscanf(baud, "%d", &job.settings.baud_rate) == 1 && job.settings.baud_rate > 0 ? DONE : INVALID_OPTIONS_ARGUMENT;
 }
 
-static int read_device(const char *file)
+static int connect_device(const char *file)
 {
-    int result;
-    struct buffer buffer =
-    {
-        0, 0x08000000, selected_device->size, device_memory
-    };
-
-    fprintf(stdout, TTY_NONE "Reading to \"%s\"...", file);
-
-    if ((result = read_device_memory(&buffer)))
-        return result;
+    fprintf(stdout, TTY_NONE "Connect \"%s\"...", file);
+    return connect_job(&job, file);
+}
 
-    if ((result = save_file_buffer(&buffer, file)))
-        return result;
+static int unprotect_device(void)
+{
+    return unprotect_job(&job);
+}
 
-    return DONE;
+static int read_device(const char *file)
+{
+    fprintf(stdout, TTY_NONE "Reading to \"%s\"...", file);
+    return read_job(&job, file);
 }
 
 static int erase_device(void)
 {
-    int result;
+    return erase_job(&job);
+}
 
-    fprintf(stdout, TTY_NONE "Erasing...");
+static int adjust_device(const char *mode)
+{
+    return adjust_job(&job, atoi(mode));
+}
 
-    device_buffer[0] = device_erase_command;
-    if ((result = device_request(1)))
-        return result;
+static int write_device(const char *file)
+{
+    return write_job(&job, file);
+}
 
-    device_buffer[0] = 0xFF;
-    device_buffer[1] = 0xFF;
-    if ((result = device_request(device_erase_command == 0x44 ? 2 : 1)))
-        return result;
+static int run_device(const char *file)
+{
+    return launch_job(&job, file);
+}
 
-    return DONE;
+static int protect_device(void)
+{
+    return protect_job(&job);
 }
 
-static int adjust_device(const char *mode)
+static int set_trace_time(const char *time)
 {
-    int result;
-    const uint8_t voltage = atoi(mode);
+    fprintf(stdout, TTY_NONE "Set trace time \"%s\"...", time);
+    return sscanf(time, "%d", &job.settings.trace_time) == 1 && job.settings.trace_time >= 1 && job.settings.trace_time <= 60 ? DONE : INVALID_OPTIONS_ARGUMENT;
+}
 
-    fprintf(stdout, TTY_NONE "Adjust voltage \"%d\"...", voltage);
+static int set_trace_size(const char *size)
+{
+    fprintf(stdout, TTY_NONE "Set trace size \"%s\"...", size);
+    return sscanf(size, "%d", &job.settings.trace_size) == 1 && job.settings.trace_size >= 1 ? DONE : INVALID_OPTIONS_ARGUMENT;
+}
 
-    device_buffer[0] = 0x31;
-    if ((result = device_request(1)))
-        return result;
+static int set_trace_pattern(const char *pattern)
+{
+    fprintf(stdout, TTY_NONE "Set trace pattern \"%s\"...", pattern);
 
-    device_buffer[0] = 0xFF;
-    device_buffer[1] = 0xFF;
-    device_buffer[2] = 0x00;
-    device_buffer[3] = 0x00;
-    if ((result = device_request(4)))
-        return result;
+    if (!*pattern || strlen(pattern) >= SESSION_WINDOW)
+        return INVALID_OPTIONS_ARGUMENT;
 
-    device_buffer[0] = 0;
-    device_buffer[1] = voltage;
+    job.settings.trace_pattern = pattern;
+    return DONE;
+}
 
-    if ((result = device_request(2)))
-        return result;
+static int trace_device(void)
+{
+    return trace_job(&job);
+}
 
-    return DONE;
+static int disconnect_device(void)
+{
+    return disconnect_job(&job);
 }
 
-static int write_device_memory(const struct buffer *buffer)
+static void stop_jobs(int number)
 {
-    uint32_t address = buffer->origin;
-    uint8_t *data = buffer->data;
-    size_t size = buffer->size;
+    job.stopping = 1;
+}
 
-    while (size)
-    {
-        int result;
-        size_t count = size < 256 ? size : 256;
-
-        device_buffer[0] = 0x31;
-        if ((result = device_request(1)))
-            return result;
-
-        device_buffer[0] = address >> 24;
-        device_buffer[1] = address >> 16;
-        device_buffer[2] = address >> 8;
-        device_buffer[3] = address;
-        if ((result = device_request(4)))
-            return result;
-
-        device_buffer[0] = count - 1;
-        memcpy(device_buffer + 1, data, count);
-        if ((result = device_request(1 + count)))
-            return result;
-
-        size -= count;
-        data += count;
-        address += count;
-    }
+static void catch_signals(void)
+{
+    struct sigaction action;
 
-    return DONE;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_jobs;
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+    signal(SIGPIPE, SIG_IGN);
 }
 
-static int write_device(const char *file)
+static int serve_device(const char *path)
 {
     int result;
-    struct buffer buffer =
-    {
-        0, 0x08000000, selected_device->size, device_memory
-    };
 
-    fprintf(stdout, TTY_NONE "Writing from \"%s\"...", file);
+    fprintf(stdout, TTY_NONE "Serving \"%s\"...", path);
 
-    if ((result = load_file_buffer(&buffer, file)))
-        return result;
-
-    if ((result = write_device_memory(&buffer)))
-        return result;
+    if (!(result = listen_job(&job, path)))
+        catch_signals();
 
     return result;
 }
 
-static int protect_device(void)
+static int batch_device(const char *file)
 {
     int result;
 
-    fprintf(stdout, TTY_NONE "Readout protecting...");
-
-    device_buffer[0] = 0x82;
-    if ((result = device_request(1)))
-        return result;
-
-    if ((result = device_response(0)))
-        return result;
+    fprintf(stdout, TTY_NONE "Loading batch \"%s\"...", file);
 
-    if ((result = handshake_device()))
-        return result;
+    if (!(result = batch_job(&job, file)))
+        catch_signals();
 
-    return DONE;
+    return result;
 }
 
-static int set_trace_time(const char *time)
+static int dry_run_mode(void)
 {
-    fprintf(stdout, TTY_NONE "Set trace time \"%s\"...", time);
-    return sscanf(time, "%d", &trace_time) == 1 && trace_time >= 1 && trace_time <= 60 ? DONE : INVALID_OPTIONS_ARGUMENT;
+    fprintf(stdout, TTY_NONE "Selecting dry run...");
+    return DONE;
 }
 
-static int set_trace_size(const char *size)
+static enum operation classify_call(const struct call *call)
 {
-    fprintf(stdout, TTY_NONE "Set trace size \"%s\"...", size);
-    return sscanf(size, "%d", &trace_size) == 1 && trace_size >= 1 ? DONE : INVALID_OPTIONS_ARGUMENT;
-}
+    const void *handler = call->option->handler;
 
-static int trace_device_console(void)
-{
-    int result;
-    int count = 0;
-    time_t base = time(0);
+    if (handler == (const void *)select_base)
+        return BASE_OPERATION;
 
-    if ((result = reset_device(0)))
-        return result;
+    if (handler == (const void *)page_erase_mode)
+        return PAGE_ERASE_OPERATION;
 
-    while (count < trace_size)
-    {
-        if (time(0) - base > trace_time)
-            break;
+    if (handler == (const void *)delta_write_mode)
+        return DELTA_OPERATION;
 
-        if ((result = read_serial_port(device_buffer, 1)))
-        {
-            if (result == NO_DEVICE_REPLY)
-                continue;
+    if (handler == (const void *)dry_run_mode)
+        return DRY_RUN_OPERATION;
 
-            return result;
-        }
+    if (handler == (const void *)connect_device)
+        return CONNECT_OPERATION;
 
-        fprintf(stdout, isprint(device_buffer[0]) || isspace(device_buffer[0]) ? TTY_NONE "%c" : TTY_NONE "[%02X]", device_buffer[0]);
-        fflush(stdout);
-        count++;
-        base = time(0);
-    }
+    if (handler == (const void *)unprotect_device)
+        return UNPROTECT_OPERATION;
 
-    return DONE;
-}
+    if (handler == (const void *)erase_device)
+        return ERASE_OPERATION;
 
-static int trace_device(void)
-{
-    int result = trace_device_console();
+    if (handler == (const void *)write_device)
+        return WRITE_OPERATION;
 
-    fprintf(stdout, TTY_NONE "Tracing...");
-    return result;
+    if (handler == (const void *)run_device)
+        return RUN_OPERATION;
+
+    if (handler == (const void *)read_device)
+        return READ_OPERATION;
+
+    if (handler == (const void *)adjust_device)
+        return ADJUST_OPERATION;
+
+    if (handler == (const void *)protect_device)
+        return PROTECT_OPERATION;
+
+    if (handler == (const void *)trace_device)
+        return TRACE_OPERATION;
+
+    if (handler == (const void *)disconnect_device)
+        return DISCONNECT_OPERATION;
+
+    if (handler == (const void *)convert_image || handler == (const void *)batch_device || handler == (const void *)serve_device)
+        return HOST_OPERATION;
+
+    return SETTING_OPERATION;
 }
 
-static int disconnect_device(void)
+static void divert_console(int argc, char *argv[])
 {
-    int result;
+    int index;
 
-    fprintf(stdout, TTY_NONE "Disconnecting...");
+    for (index = 1; index < argc; index++)
+    {
+        const char *arg = argv[index];
+        const int next = index + 1 < argc && !strcmp(argv[index + 1], "-");
 
-    if ((result = close_serial_port()))
-        return result;
+        if (!strcmp(arg, "-r-") || !strcmp(arg, "--read=-") || ((!strcmp(arg, "-r") || !strcmp(arg, "--read")) && next))
+        {
+            const int stream = dup(STDOUT_FILENO);
 
-    return DONE;
+            if (stream >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) >= 0)
+                job.output = stream;
+
+            return;
+        }
+    }
 }
 
 int main(int argc, char* argv[])
@@ -546,38 +479,61 @@ int main(int argc, char* argv[])
         {JOINT_OPTION, 0, "rts", "Select RTS mode: reset - for device RESET, nreset - for inverted device RESET, boot - for device BOOT0 (default), nboot - for inverted device BOOT0, set - stay at high level, clear - stay at low level", select_rts_mode},
         {JOINT_OPTION, 0, "dtr", "Select DTR mode: reset - for device RESET (default), nreset - for inverted device RESET, boot - for device BOOT0, nboot - for inverted device BOOT0, set - stay at high level, clear - stay at low level", select_dtr_mode},
         {PLAIN_OPTION, "x", "experimental", "Experimental mode", experimental_mode},
-        {JOINT_OPTION, "c", "connect", "Open serial port and connect to device bootloader", connect_device},
+        {PLAIN_OPTION, 0, "low-latency", "Select low latency mode before connect: set ASYNC_LOW_LATENCY flag and minimal USB latency timer of serial port, restored on disconnect", low_latency_mode},
+        {JOINT_OPTION, "b", "baud", "Select baud rate before connect: any rate supported by serial port (115200 default), auto - try rates from 3000000 down to 57600 and step down on errors", select_baud_rate},
+        {JOINT_OPTION, "c", "connect", "Open serial port and connect to device bootloader, or gang program several ports listed with commas or matched by a glob pattern: following operations are planned and run on every port in parallel at disconnect, then reported per port", connect_device},
         {PLAIN_OPTION, "u", "unprotect", "Erase and read-out unprotect device memory", unprotect_device},
-        {JOINT_OPTION, "r", "read", "Read data from device memory to file", read_device},
+        {JOINT_OPTION, 0, "read-range", "Select range ADDR:LEN of device memory for following reads, instead of whole device memory, repeatable", select_read_range},
+        {PLAIN_OPTION, 0, "trim", "Select trim mode: leave trailing erased pages out of following reads", trim_mode},
+        {JOINT_OPTION, 0, "record-size", "Select data size of records in file for following reads: 16 (default), 32, 64 or 255", select_record_size},
+        {PLAIN_OPTION, 0, "sparse", "Select sparse mode: leave runs of erased data, at least one record long, out of file for following reads", sparse_mode},
+        {JOINT_OPTION, "r", "read", "Read data from device memory to file: raw binary for .bin extension, Intel HEX otherwise, - for standard output", read_device},
         {PLAIN_OPTION, "e", "erase", "Erase device memory", erase_device},
+        {PLAIN_OPTION, 0, "page-erase", "Select page erase mode: erase only pages touched by each written file just before writing it, or whole device memory when that is faster", page_erase_mode},
         {JOINT_OPTION, "a", "adjust", "Adjust device voltage: 0 - [1.8 V, 2.1 V], 1 - [2.1 V, 2.4 V], 2 - [2.4 V, 2.7 V], 3 - [2.7 V, 3.6 V], 4 - [2.7 V, 3.6 V] with Vpp", adjust_device},
-        {JOINT_OPTION, "w", "write", "Write data from file to device memory", write_device},
+        {JOINT_OPTION, 0, "loader", "Select flash loader image, linked for device RAM, to write and read device memory through it instead of bootloader commands", select_loader},
+        {PLAIN_OPTION, 0, "compress", "Compress data sent to flash loader", compress_mode},
+        {PLAIN_OPTION, 0, "verify", "Select verify mode: check written data after each write, by device checksum when bootloader supports it, otherwise by reading it back", verify_mode},
+        {JOINT_OPTION, 0, "base", "Select base address of raw binary files for following writes, runs and loaders, start of memory by default, also loading files of other content than ELF, S-record or HEX as raw binary", select_base},
+        {JOINT_OPTION, 0, "convert", "Convert image file IN=OUT[:PID]: bundle for .swb extension, with hexadecimal target PID, or PID of connected device by default, raw binary for .bin extension, Intel HEX otherwise", convert_image},
+        {JOINT_OPTION, 0, "patch", "Select patch ADDR=HEX or ADDR=@FILE overlaid on images of following writes, with FILE loaded at ADDR if raw binary, repeatable", select_patch},
+        {PLAIN_OPTION, 0, "delta", "Select delta write mode: erase and write only pages changed since the last image written to the same device, known by its unique ID", delta_write_mode},
+        {JOINT_OPTION, "w", "write", "Write data from file to device memory: ELF, Motorola S-record or Intel HEX, detected from content, or raw binary for .bin extension, - for standard input", write_device},
+        {JOINT_OPTION, 0, "run", "Write data from file, linked for device RAM above the part used by the bootloader, to device RAM and start it from its vector table, with following trace option tracing it without restart", run_device},
         {PLAIN_OPTION, "p", "protect", "Read-out protect device memory", protect_device},
         {JOINT_OPTION, 0, "trace-time", "Set trace intercharacter interval in seconds (5 default)", set_trace_time},
         {JOINT_OPTION, 0, "trace-size", "Set maximum trace log size (4096 default)", set_trace_size},
+        {JOINT_OPTION, 0, "trace-pattern", "Set trace stop pattern: following traces finish as soon as device output contains it, and fail when it does not appear", set_trace_pattern},
         {PLAIN_OPTION, "t", "trace", "Restart device in user mode, with redirecting device output to stdout", trace_device},
         {PLAIN_OPTION, "d", "disconnect", "Disconnect device and close serial port", disconnect_device},
+        {PLAIN_OPTION, 0, "dry-run", "Print the plan of all options instead of running it, with redundant operations left out and estimated time at the selected baud rate, without device access", dry_run_mode},
+        {JOINT_OPTION, 0, "batch", "Program boards one after another on the connected serial port, after other options: each non-empty line of file, except # comments, holds options run for every board, with images parsed once; the next board is detected by its unique ID or by a gap without reply, until SIGINT or SIGTERM", batch_device},
+        {JOINT_OPTION, 0, "daemon", "Serve jobs on UNIX domain socket after other options: each connection sends one line of options, run with the serial port and parsed images kept from previous jobs, and receives their output, ended by a finishing job line; options before this one are defaults of every job", serve_device},
         {USAGE_OPTION, "h", "help", "Print this help", usage_options},
         {OTHER_OPTION}
     };
 
-    static const struct error errors[] =
+    static char stdout_buffer[256];
+    static const char synopsis[] = TTY_BOLD "swamp-boot" TTY_NONE " [" TTY_UNLN "OPTIONS" TTY_NONE "] ";
+    int result;
+
+    if ((result = init_job(&job, synopsis, options, errors, classify_call)))
     {
-        {INVALID_FILE_CHECKSUM, "Invalid checksum of file"},
-        {INVALID_FILE_CONTENT, "Invalid device memory location or invalid record in file"},
-        {UNSUPPORTED_DEVICE, "Unsupported device"},
-        {INVALID_DEVICE_REPLY, "Invalid reply from device bootloader"},
-        {NO_DEVICE_REPLY, "No reply from device bootloader"},
-        {SERIAL_PORT_ALREADY_OPEN, "Serial port already open"},
-        {INTERNAL_ERROR, "Internal error"},
-        {INVALID_OPTIONS_ARGUMENT, "Invalid actual parameter"},
-        {INVALID_OPTION, "Invalid option"},
-        {DONE, "No errors, all done"},
-    };
+        fprintf(stdout, TTY_NONE "Allocating buffers...");
+        return report_options(errors, result);
+    }
 
-    static char stdout_buffer[256];
+    divert_console(argc, argv);
     setvbuf(stdout, stdout_buffer, _IOLBF, sizeof(stdout_buffer));
     fprintf(stdout, TTY_NONE "Swamp-boot, version 0.%d\n", VERSION);
 
-    return invoke_options(TTY_BOLD "swamp-boot" TTY_NONE " [" TTY_UNLN "OPTIONS" TTY_NONE "] ", options, errors, argc, argv);
+    result = finish_job(&job, run_job(&job, argc, argv));
+
+    if (job.batch.count && !result)
+        result = repeat_job(&job);
+    else if (job.server.fd >= 0 && !result)
+        result = serve_job(&job);
+
+    close_job(&job);
+    return result;
 }
@@ -51,6 +51,7 @@ struct context
     const struct option *option;
     const char *s;
     int result;
+    struct script *script;
 };
 
 typedef int (* match_t)(const struct option *option, const char *p, int size);
@@ -99,59 +100,49 @@ static int has_argument(const struct context *context)
 
 static enum state fail(struct context *context, int result)
 {
-    const struct error *error = context->errors;
-    const char *usage = "Unexpected error";
-
-    context->result = result;
-
-    while (error->result)
-    {
-        if (result == error->result)
-        {
-            usage = result == INTERNAL_ERROR ? strerror(errno) : error->usage;
-            break;
-        }
-        error++;
-    }
-
-    fprintf(stdout, TTY_NONE " " TTY_BOLD "FAILED" TTY_NONE " [%s, %d]\n", usage, result);
+    context->result = report_options(context->errors, result);
     return FAIL_STATE;
 }
 
-static enum state done(enum state state)
-{
-    fprintf(stdout, TTY_NONE " done\n");
-    return state;
-}
-
-static enum state invoke(struct context *context, const char *p, enum state state)
+static int call(const struct script *script, const struct call *call)
 {
-    int result = INVALID_OPTION;
-
-    switch (context->option->role)
+    switch (call->option->role)
     {
     case PLAIN_OPTION:
-        result = ((plain_handler_t)context->option->handler)();
-        break;
+        return ((plain_handler_t)call->option->handler)();
 
     case JOINT_OPTION:
-        result = ((joint_handler_t)context->option->handler)(context->s);
-        break;
+        return ((joint_handler_t)call->option->handler)(call->argument);
 
     case USAGE_OPTION:
-        result = ((usage_handler_t)context->option->handler)(context->synopsis, context->options, context->errors);
-        break;
+        return ((usage_handler_t)call->option->handler)(script->synopsis, script->options, script->errors);
 
     case OTHER_OPTION:
-        result = ((other_handler_t)context->option->handler)(context->s);
-        break;
+        return ((other_handler_t)call->option->handler)(call->argument);
 
     default:
         break;
     }
 
+    return INVALID_OPTION;
+}
+
+static enum state invoke(struct context *context, const char *p, enum state state)
+{
+    struct script *script = context->script;
+
+    if (script->count == OPTIONS_CALLS)
+    {
+        fprintf(stdout, TTY_NONE "Processing \"%s\"...", context->s);
+        return fail(context, INVALID_OPTION);
+    }
+
+    script->calls[script->count].option = context->option;
+    script->calls[script->count].argument = context->option->role == JOINT_OPTION || context->option->role == OTHER_OPTION ? context->s : 0;
+    script->count++;
+
     context->s = 0;
-    return result ? fail(context, result) : done(state);
+    return state;
 }
 
 static enum state invalid(struct context *context, const char *p)
@@ -259,12 +250,93 @@ static enum state process(struct context *context, enum state state, const char
     return invalid(context, p);
 }
 
-int invoke_options(const char *synopsis, const struct option options[], const struct error errors[], int argc, char *argv[])
+int report_options(const struct error errors[], int result)
 {
-    struct context context = {synopsis, options, errors, 0, 0, 0};
+    const struct error *error = errors;
+    const char *usage = "Unexpected error";
+
+    if (!result)
+    {
+        fprintf(stdout, TTY_NONE " done\n");
+        return result;
+    }
+
+    while (error->result)
+    {
+        if (result == error->result)
+        {
+            usage = result == INTERNAL_ERROR ? strerror(errno) : error->usage;
+            break;
+        }
+        error++;
+    }
+
+    fprintf(stdout, TTY_NONE " " TTY_BOLD "FAILED" TTY_NONE " [%s, %d]\n", usage, result);
+    return result;
+}
+
+int split_options(const char *line, char *words, char *argv[], int size, int *count)
+{
+    const char *p = line;
+    char *q = words;
+    char quote = 0;
+    int word = 0;
+
+    *count = 0;
+
+    for (;; p++)
+    {
+        if (!quote && (!*p || isspace(*p)))
+        {
+            if (word)
+            {
+                *q++ = 0;
+                word = 0;
+            }
+
+            if (!*p)
+                break;
+
+            continue;
+        }
+
+        if (!word)
+        {
+            if (*count == size - 1)
+                return INVALID_OPTIONS_ARGUMENT;
+
+            argv[(*count)++] = q;
+            word = 1;
+        }
+
+        if (!*p)
+            return INVALID_OPTIONS_ARGUMENT;
+
+        if (*p == quote)
+            quote = 0;
+        else if (!quote && (*p == '"' || *p == '\''))
+            quote = *p;
+        else if (*p == '\\' && quote != '\'' && p[1])
+            *q++ = *++p;
+        else
+            *q++ = *p;
+    }
+
+    argv[*count] = 0;
+    return DONE;
+}
+
+int parse_options(struct script *script, const char *synopsis, const struct option options[], const struct error errors[], int argc, char *argv[])
+{
+    struct context context = {synopsis, options, errors, 0, 0, 0, script};
     enum state state = ENTRY_STATE;
     const char *p = (argc--, *++argv);
 
+    script->synopsis = synopsis;
+    script->options = options;
+    script->errors = errors;
+    script->count = 0;
+
     while (argc)
     {
         if ((state = process(&context, state, p)) == FAIL_STATE)
@@ -279,6 +351,11 @@ int invoke_options(const char *synopsis, const struct option options[], const st
     return context.result;
 }
 
+int call_options(const struct script *script, const struct call *entry)
+{
+    return report_options(script->errors, call(script, entry));
+}
+
 static void usage(FILE *file, const char *p, int width)
 {
     const char *s = p;
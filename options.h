@@ -34,6 +34,8 @@
 #define TTY_NONE "\e[0m"
 #endif
 
+#define OPTIONS_CALLS 256
+
 enum role
 {
     PLAIN_OPTION,
@@ -57,12 +59,30 @@ struct error
     const char *usage;
 };
 
+struct call
+{
+    const struct option *option;
+    const char *argument;
+};
+
+struct script
+{
+    const char *synopsis;
+    const struct option *options;
+    const struct error *errors;
+    int count;
+    struct call calls[OPTIONS_CALLS];
+};
+
 typedef int (* plain_handler_t)(void);
 typedef int (* joint_handler_t)(const char *argument);
 typedef int (* usage_handler_t)(const char *synopsis, const struct option options[], const struct error errors[]);
 typedef int (* other_handler_t)(const char *operand);
 
-int invoke_options(const char *synopsis, const struct option options[], const struct error errors[], int argc, char *argv[]);
+int split_options(const char *line, char *words, char *argv[], int size, int *count);
+int parse_options(struct script *script, const char *synopsis, const struct option options[], const struct error errors[], int argc, char *argv[]);
+int call_options(const struct script *script, const struct call *call);
+int report_options(const struct error errors[], int result);
 int usage_options(const char *synopsis, const struct option options[], const struct error errors[]);
 
 #endif
@@ -0,0 +1,147 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <memory.h>
+#include <unistd.h>
+#include "errors.h"
+#include "queue.h"
+
+static void *work_queue(void *argument)
+{
+    struct queue *queue = argument;
+    const int result = queue->work(queue->argument);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopped = 1;
+    queue->result = result;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+int open_queue(struct queue *queue, int (*work)(void *argument), void *argument)
+{
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = 0;
+    queue->stopped = 0;
+    queue->cancelled = 0;
+    queue->result = DONE;
+    queue->work = work;
+    queue->argument = argument;
+
+    if (pipe(queue->wake) < 0)
+        return INTERNAL_ERROR;
+
+    pthread_mutex_init(&queue->lock, 0);
+    pthread_cond_init(&queue->changed, 0);
+
+    if (pthread_create(&queue->thread, 0, work_queue, queue))
+    {
+        pthread_cond_destroy(&queue->changed);
+        pthread_mutex_destroy(&queue->lock);
+        close(queue->wake[0]);
+        close(queue->wake[1]);
+        return INTERNAL_ERROR;
+    }
+
+    return DONE;
+}
+
+int push_queue(struct queue *queue, uint32_t origin, const void *data, size_t size)
+{
+    int result = DONE;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->count == QUEUE_BLOCKS && !queue->cancelled && !queue->stopped)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+
+    if (queue->cancelled || queue->stopped)
+    {
+        result = queue->result ? queue->result : INTERNAL_ERROR;
+    }
+    else
+    {
+        const size_t index = (queue->head + queue->count) % QUEUE_BLOCKS;
+
+        queue->blocks[index].origin = origin;
+        queue->blocks[index].size = size;
+        memcpy(queue->data[index], data, size);
+        queue->count++;
+        pthread_cond_broadcast(&queue->changed);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return result;
+}
+
+int pull_queue(struct queue *queue, struct extent *block, void *data)
+{
+    int pulled = 0;
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (!queue->count && !queue->closed && !queue->stopped && !queue->cancelled)
+        pthread_cond_wait(&queue->changed, &queue->lock);
+
+    if (queue->cancelled)
+    {
+        pulled = -1;
+    }
+    else if (queue->count && !queue->result)
+    {
+        *block = queue->blocks[queue->head];
+        memcpy(data, queue->data[queue->head], block->size);
+        queue->head = (queue->head + 1) % QUEUE_BLOCKS;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+        pulled = 1;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return pulled;
+}
+
+int close_queue(struct queue *queue, int result)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    queue->cancelled = result != DONE;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+
+    if (result != DONE)
+        close(queue->wake[1]);
+
+    pthread_join(queue->thread, 0);
+    pthread_cond_destroy(&queue->changed);
+    pthread_mutex_destroy(&queue->lock);
+
+    if (result == DONE)
+        close(queue->wake[1]);
+
+    close(queue->wake[0]);
+
+    return result ? result : queue->result;
+}
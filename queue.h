@@ -0,0 +1,57 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "buffer.h"
+
+#define QUEUE_BLOCKS 64
+
+struct queue
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int wake[2];
+    struct extent blocks[QUEUE_BLOCKS];
+    uint8_t data[QUEUE_BLOCKS][BUFFER_BLOCK];
+    size_t head;
+    size_t count;
+    int closed;
+    int stopped;
+    int cancelled;
+    int result;
+    int (*work)(void *argument);
+    void *argument;
+};
+
+int open_queue(struct queue *queue, int (*work)(void *argument), void *argument);
+int push_queue(struct queue *queue, uint32_t origin, const void *data, size_t size);
+int pull_queue(struct queue *queue, struct extent *block, void *data);
+int close_queue(struct queue *queue, int result);
+
+#endif
@@ -22,74 +22,224 @@
  */
 
 #include <time.h>
+#include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <poll.h>
 #include <unistd.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <linux/serial.h>
 #include "errors.h"
 #include "serial.h"
 
-static int fd = -1;
-static struct termios shadow_options;
-static struct termios active_options;
-static int shadow_status;
-static int active_status;
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
 
-int open_serial_port(const char *file)
+struct speed
 {
-    if (fd >= 0)
-        return SERIAL_PORT_ALREADY_OPEN;
+    int baud;
+    speed_t code;
+};
 
-    if ((fd = open(file, O_RDWR | O_NOCTTY)) < 0)
-        return INTERNAL_ERROR;
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+
+static const struct speed speeds[] =
+{
+    {1200, B1200},
+    {2400, B2400},
+    {4800, B4800},
+    {9600, B9600},
+    {19200, B19200},
+    {38400, B38400},
+    {57600, B57600},
+    {115200, B115200},
+    {230400, B230400},
+    {460800, B460800},
+    {500000, B500000},
+    {576000, B576000},
+    {921600, B921600},
+    {1000000, B1000000},
+    {1152000, B1152000},
+    {1500000, B1500000},
+    {2000000, B2000000},
+    {2500000, B2500000},
+    {3000000, B3000000},
+    {3500000, B3500000},
+    {4000000, B4000000}
+};
+
+void init_serial_port(struct serial *serial)
+{
+    serial->fd = -1;
+    serial->timeout = 500;
+    serial->shadow_flags = -1;
+    serial->shadow_latency = -1;
+}
 
-    if (tcgetattr(fd, &shadow_options) < 0)
+static int setup_serial_port(struct serial *serial, const char *file)
+{
+    if (tcgetattr(serial->fd, &serial->shadow_options) < 0)
         return INTERNAL_ERROR;
 
-    active_options = shadow_options;
+    serial->active_options = serial->shadow_options;
 
-    if (ioctl(fd, TIOCMGET, &shadow_options) < 0)
+    if (ioctl(serial->fd, TIOCMGET, &serial->shadow_status) < 0)
         return INTERNAL_ERROR;
 
-    active_status = shadow_status;
+    serial->active_status = serial->shadow_status;
 
-    active_options.c_cflag = B115200 | PARENB | CS8 | CLOCAL | CREAD;
-    active_options.c_iflag = IGNBRK | IGNPAR;
-    active_options.c_oflag = 0;
-    active_options.c_lflag = 0;
-    active_options.c_cc[VMIN] = 0;
-    active_options.c_cc[VTIME] = 5;
+    if (!realpath(file, serial->latency_file))
+        return INTERNAL_ERROR;
+
+    serial->active_options.c_cflag = B115200 | PARENB | CS8 | CLOCAL | CREAD;
+    serial->active_options.c_iflag = IGNBRK | IGNPAR;
+    serial->active_options.c_oflag = 0;
+    serial->active_options.c_lflag = 0;
+    serial->active_options.c_cc[VMIN] = 0;
+    serial->active_options.c_cc[VTIME] = 0;
 
-    if (tcflush(fd, TCIFLUSH) < 0)
+    if (tcflush(serial->fd, TCIFLUSH) < 0)
         return INTERNAL_ERROR;
 
-    if (tcsetattr(fd, TCSANOW, &active_options) < 0)
+    if (tcsetattr(serial->fd, TCSANOW, &serial->active_options) < 0)
         return INTERNAL_ERROR;
 
     return DONE;
 }
 
-int close_serial_port(void)
+int open_serial_port(struct serial *serial, const char *file)
 {
-    if (ioctl(fd, TIOCMSET, &shadow_status) < 0)
+    int result;
+
+    if (serial->fd >= 0)
+        return SERIAL_PORT_ALREADY_OPEN;
+
+    if ((serial->fd = open(file, O_RDWR | O_NOCTTY)) < 0)
         return INTERNAL_ERROR;
 
-    if (tcsetattr(fd, TCSANOW, &shadow_options) < 0)
+    if ((result = setup_serial_port(serial, file)))
+    {
+        close(serial->fd);
+        serial->fd = -1;
+    }
+
+    return result;
+}
+
+static int read_latency_timer(const struct serial *serial)
+{
+    int latency;
+    FILE *stream = fopen(serial->latency_file, "rt");
+
+    if (!stream)
+        return -1;
+
+    if (fscanf(stream, "%d", &latency) != 1)
+        latency = -1;
+
+    fclose(stream);
+    return latency;
+}
+
+static int write_latency_timer(const struct serial *serial, int latency)
+{
+    FILE *stream = fopen(serial->latency_file, "wt");
+
+    if (!stream)
+        return INTERNAL_ERROR;
+
+    if (fprintf(stream, "%d\n", latency) < 0)
+    {
+        fclose(stream);
         return INTERNAL_ERROR;
+    }
 
-    if (close(fd) < 0)
+    if (fclose(stream))
         return INTERNAL_ERROR;
 
-    fd = -1;
     return DONE;
 }
 
-int write_serial_port(const void *data, size_t size)
+int latency_serial_port(struct serial *serial)
+{
+    struct serial_struct line;
+    char name[NAME_MAX + 1];
+
+    if (ioctl(serial->fd, TIOCGSERIAL, &line) == 0)
+    {
+        serial->shadow_flags = line.flags;
+        line.flags |= ASYNC_LOW_LATENCY;
+
+        if (ioctl(serial->fd, TIOCSSERIAL, &line) < 0)
+            serial->shadow_flags = -1;
+    }
+
+    snprintf(name, sizeof(name), "%s", basename(serial->latency_file));
+    snprintf(serial->latency_file, sizeof(serial->latency_file), "/sys/class/tty/%s/device/latency_timer", name);
+
+    if ((serial->shadow_latency = read_latency_timer(serial)) > 1 && write_latency_timer(serial, 1))
+        serial->shadow_latency = -1;
+
+    return DONE;
+}
+
+int close_serial_port(struct serial *serial)
+{
+    struct serial_struct line;
+    int result = DONE;
+
+    if (serial->shadow_flags >= 0 && ioctl(serial->fd, TIOCGSERIAL, &line) == 0)
+    {
+        line.flags = serial->shadow_flags;
+        serial->shadow_flags = -1;
+
+        if (ioctl(serial->fd, TIOCSSERIAL, &line) < 0)
+            result = INTERNAL_ERROR;
+    }
+
+    if (serial->shadow_latency > 1)
+    {
+        int status = write_latency_timer(serial, serial->shadow_latency);
+
+        serial->shadow_latency = -1;
+
+        if (status && !result)
+            result = status;
+    }
+
+    if (ioctl(serial->fd, TIOCMSET, &serial->shadow_status) < 0 && !result)
+        result = INTERNAL_ERROR;
+
+    if (tcsetattr(serial->fd, TCSANOW, &serial->shadow_options) < 0 && !result)
+        result = INTERNAL_ERROR;
+
+    if (close(serial->fd) < 0 && !result)
+        result = INTERNAL_ERROR;
+
+    serial->fd = -1;
+    return result;
+}
+
+int write_serial_port(struct serial *serial, const void *data, size_t size)
 {
     while (size)
     {
-        ssize_t count = write(fd, data, size);
+        ssize_t count = write(serial->fd, data, size);
 
         if (count < 0)
         {
@@ -106,11 +256,31 @@ int write_serial_port(const void *data, size_t size)
     return DONE;
 }
 
-int read_serial_port(void *data, size_t size)
+int read_serial_port(struct serial *serial, void *data, size_t size)
 {
+    int64_t deadline = clock_serial_port() + (int64_t)serial->timeout * 1000;
+
     while (size)
     {
-        ssize_t count = read(fd, data, size);
+        ssize_t count;
+        struct pollfd pollfd = {serial->fd, POLLIN, 0};
+        int64_t rest = deadline - clock_serial_port();
+
+        if (rest <= 0)
+            return NO_DEVICE_REPLY;
+
+        if ((count = poll(&pollfd, 1, (rest + 999) / 1000)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return INTERNAL_ERROR;
+        }
+
+        if (count == 0)
+            return NO_DEVICE_REPLY;
+
+        count = read(serial->fd, data, size);
 
         if (count < 0)
         {
@@ -130,40 +300,92 @@ int read_serial_port(void *data, size_t size)
     return DONE;
 }
 
-int flush_serial_port(void)
+int flush_serial_port(struct serial *serial)
 {
-    if (tcflush(fd, TCIOFLUSH) < 0)
+    if (tcflush(serial->fd, TCIOFLUSH) < 0)
         return INTERNAL_ERROR;
 
     return DONE;
 }
 
-int configure_serial_port(int timeout)
+int configure_serial_port(struct serial *serial, int ms)
 {
-    active_options.c_cc[VTIME] = timeout;
+    if (ms <= 0)
+        return INTERNAL_ERROR;
 
-    if (tcsetattr(fd, TCSANOW, &active_options) < 0)
+    serial->timeout = ms;
+    return DONE;
+}
+
+static int custom_speed_serial_port(struct serial *serial, int baud)
+{
+#ifdef TCSETS2
+    struct termios2 options;
+
+    if (ioctl(serial->fd, TCGETS2, &options) < 0)
+        return INTERNAL_ERROR;
+
+    options.c_cflag = (options.c_cflag & ~CBAUD) | BOTHER;
+    options.c_ispeed = baud;
+    options.c_ospeed = baud;
+
+    if (ioctl(serial->fd, TCSETS2, &options) < 0)
+        return INTERNAL_ERROR;
+
+    if (tcgetattr(serial->fd, &serial->active_options) < 0)
         return INTERNAL_ERROR;
 
     return DONE;
+#else
+    return INVALID_OPTIONS_ARGUMENT;
+#endif
+}
+
+int speed_serial_port(struct serial *serial, int baud)
+{
+    int count = sizeof(speeds) / sizeof(struct speed);
+
+    while (count--)
+    {
+        if (speeds[count].baud == baud)
+        {
+            if (cfsetispeed(&serial->active_options, speeds[count].code) < 0 || cfsetospeed(&serial->active_options, speeds[count].code) < 0)
+                return INTERNAL_ERROR;
+
+            if (tcsetattr(serial->fd, TCSANOW, &serial->active_options) < 0)
+                return INTERNAL_ERROR;
+
+            return DONE;
+        }
+    }
+
+    return custom_speed_serial_port(serial, baud);
 }
 
-int control_serial_port(int rts, int dtr)
+int control_serial_port(struct serial *serial, int rts, int dtr)
 {
-    active_status &= ~(TIOCM_RTS | TIOCM_DTR);
+    serial->active_status &= ~(TIOCM_RTS | TIOCM_DTR);
 
     if (rts)
-        active_status |= TIOCM_RTS;
+        serial->active_status |= TIOCM_RTS;
 
     if (dtr)
-        active_status |= TIOCM_DTR;
+        serial->active_status |= TIOCM_DTR;
 
-    if (ioctl(fd, TIOCMSET, &active_status) < 0)
+    if (ioctl(serial->fd, TIOCMSET, &serial->active_status) < 0)
         return INTERNAL_ERROR;
 
     return DONE;
 }
 
+int64_t clock_serial_port(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
 int wait_serial_port(int ms)
 {
     int result;
@@ -26,16 +26,35 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
+#include <termios.h>
 
-int open_serial_port(const char *file);
-int close_serial_port(void);
+struct serial
+{
+    int fd;
+    struct termios shadow_options;
+    struct termios active_options;
+    int shadow_status;
+    int active_status;
+    int timeout;
+    int shadow_flags;
+    int shadow_latency;
+    char latency_file[PATH_MAX];
+};
 
-int write_serial_port(const void *data, size_t size);
-int read_serial_port(void *data, size_t size);
-int flush_serial_port(void);
+void init_serial_port(struct serial *serial);
+int open_serial_port(struct serial *serial, const char *file);
+int close_serial_port(struct serial *serial);
+int latency_serial_port(struct serial *serial);
 
-int configure_serial_port(int timeout);
-int control_serial_port(int rts, int dtr);
+int write_serial_port(struct serial *serial, const void *data, size_t size);
+int read_serial_port(struct serial *serial, void *data, size_t size);
+int flush_serial_port(struct serial *serial);
+
+int configure_serial_port(struct serial *serial, int ms);
+int speed_serial_port(struct serial *serial, int baud);
+int control_serial_port(struct serial *serial, int rts, int dtr);
 int wait_serial_port(int ms);
+int64_t clock_serial_port(void);
 
 #endif
@@ -0,0 +1,278 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "errors.h"
+#include "options.h"
+#include "server.h"
+
+void init_server(struct server *server)
+{
+    memset(server, 0, sizeof(struct server));
+    server->fd = -1;
+    server->client = -1;
+}
+
+static int clear_server(const struct sockaddr_un *address)
+{
+    int fd;
+    int result = DONE;
+    struct stat status;
+
+    if (lstat(address->sun_path, &status) < 0)
+        return errno == ENOENT ? DONE : INTERNAL_ERROR;
+
+    if (!S_ISSOCK(status.st_mode))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return INTERNAL_ERROR;
+
+    if (!connect(fd, (const struct sockaddr *)address, sizeof(*address)))
+        result = SERIAL_PORT_ALREADY_OPEN;
+    else if (errno != ECONNREFUSED || unlink(address->sun_path) < 0)
+        result = INTERNAL_ERROR;
+
+    close(fd);
+    return result;
+}
+
+int open_server(struct server *server, const char *path)
+{
+    int result;
+    mode_t mask;
+    struct sockaddr_un address;
+
+    if (server->fd >= 0)
+        return SERIAL_PORT_ALREADY_OPEN;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (snprintf(address.sun_path, sizeof(address.sun_path), "%s", path) >= (int)sizeof(address.sun_path))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if ((result = clear_server(&address)))
+        return result;
+
+    if ((server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return INTERNAL_ERROR;
+
+    mask = umask(0177);
+    result = bind(server->fd, (const struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+
+    if (result < 0 || listen(server->fd, 8) < 0)
+    {
+        close(server->fd);
+        server->fd = -1;
+        return INTERNAL_ERROR;
+    }
+
+    snprintf(server->path, sizeof(server->path), "%s", path);
+    return DONE;
+}
+
+static int read_request(struct server *server)
+{
+    size_t size = 0;
+
+    while (size < sizeof(server->request) - 1)
+    {
+        const ssize_t count = read(server->client, server->request + size, sizeof(server->request) - 1 - size);
+        char *end;
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return INTERNAL_ERROR;
+        }
+
+        server->request[size + count] = 0;
+
+        if ((end = memchr(server->request + size, '\n', count)))
+        {
+            *end = 0;
+            return DONE;
+        }
+
+        if (!count)
+            return size ? DONE : INVALID_OPTIONS_ARGUMENT;
+
+        size += count;
+    }
+
+    return INVALID_OPTIONS_ARGUMENT;
+}
+
+int accept_server(struct server *server)
+{
+    int result;
+    const struct timeval timeout =
+    {
+        SERVER_TIMEOUT, 0
+    };
+
+    if ((server->client = accept(server->fd, 0, 0)) < 0)
+        return INTERNAL_ERROR;
+
+    if (setsockopt(server->client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+        return INTERNAL_ERROR;
+
+    if (setsockopt(server->client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+        return INTERNAL_ERROR;
+
+    server->jobs++;
+    server->request[0] = 0;
+
+    if ((result = read_request(server)))
+        return result;
+
+    if ((result = split_options(server->request, server->line, server->argv + 1, SERVER_ARGUMENTS - 1, &server->argc)))
+        return result;
+
+    server->argv[0] = "swamp-boot";
+    server->argc++;
+    return DONE;
+}
+
+void finish_server(struct server *server)
+{
+    if (server->client < 0)
+        return;
+
+    shutdown(server->client, SHUT_RDWR);
+    close(server->client);
+    server->client = -1;
+}
+
+static struct held *find_held(struct server *server, const char *file, uint32_t origin, size_t size, uint32_t base, const struct stat *status)
+{
+    size_t index;
+    struct held *oldest = server->images;
+
+    for (index = 0; index < SERVER_IMAGES; index++)
+    {
+        struct held *held = server->images + index;
+
+        if (held->buffer && !strcmp(held->file, file) && held->origin == origin && held->size == size && held->base == base
+            && held->status.st_dev == status->st_dev && held->status.st_ino == status->st_ino && held->status.st_size == status->st_size
+            && held->status.st_mtim.tv_sec == status->st_mtim.tv_sec && held->status.st_mtim.tv_nsec == status->st_mtim.tv_nsec)
+            return held;
+
+        if (held->used < oldest->used)
+            oldest = held;
+    }
+
+    if (oldest->buffer)
+    {
+        unload_file_buffer(oldest->buffer);
+        free(oldest->buffer);
+        oldest->buffer = 0;
+    }
+
+    return oldest;
+}
+
+int load_server(struct server *server, const char *file, uint32_t origin, size_t size, uint32_t base, const struct buffer **buffer)
+{
+    int result;
+    struct stat status;
+    struct held *held;
+    struct buffer *image;
+
+    if (stat(file, &status) < 0)
+        return INTERNAL_ERROR;
+
+    held = find_held(server, file, origin, size, base, &status);
+    held->used = server->jobs;
+
+    if (held->buffer)
+    {
+        *buffer = held->buffer;
+        return DONE;
+    }
+
+    if (snprintf(held->file, sizeof(held->file), "%s", file) >= (int)sizeof(held->file))
+        return INVALID_OPTIONS_ARGUMENT;
+
+    if (!(image = malloc(sizeof(struct buffer) + size)))
+        return INTERNAL_ERROR;
+
+    memset(image, 0, sizeof(struct buffer));
+    image->origin = origin;
+    image->size = size;
+    image->data = image + 1;
+
+    if ((result = load_file_buffer(image, file, base)))
+    {
+        unload_file_buffer(image);
+        free(image);
+        return result;
+    }
+
+    held->status = status;
+    held->origin = origin;
+    held->size = size;
+    held->base = base;
+    held->buffer = image;
+    *buffer = image;
+    return DONE;
+}
+
+void close_server(struct server *server)
+{
+    size_t index;
+
+    finish_server(server);
+
+    for (index = 0; index < SERVER_IMAGES; index++)
+    {
+        struct held *held = server->images + index;
+
+        if (held->buffer)
+        {
+            unload_file_buffer(held->buffer);
+            free(held->buffer);
+            held->buffer = 0;
+        }
+    }
+
+    if (server->fd >= 0)
+    {
+        close(server->fd);
+        unlink(server->path);
+    }
+
+    server->fd = -1;
+}
@@ -0,0 +1,69 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "buffer.h"
+
+#define SERVER_IMAGES 8
+#define SERVER_REQUEST 4096
+#define SERVER_ARGUMENTS 256
+#define SERVER_TIMEOUT 10
+
+struct held
+{
+    char file[PATH_MAX];
+    struct stat status;
+    uint32_t origin;
+    uint32_t base;
+    size_t size;
+    unsigned long used;
+    struct buffer *buffer;
+};
+
+struct server
+{
+    int fd;
+    int client;
+    char path[PATH_MAX];
+    unsigned long jobs;
+    struct held images[SERVER_IMAGES];
+    char request[SERVER_REQUEST];
+    char line[SERVER_REQUEST];
+    int argc;
+    char *argv[SERVER_ARGUMENTS];
+};
+
+void init_server(struct server *server);
+int open_server(struct server *server, const char *path);
+int accept_server(struct server *server);
+void finish_server(struct server *server);
+int load_server(struct server *server, const char *file, uint32_t origin, size_t size, uint32_t base, const struct buffer **buffer);
+void close_server(struct server *server);
+
+#endif
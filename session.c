@@ -0,0 +1,1538 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <time.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <memory.h>
+#include "crc.h"
+#include "cache.h"
+#include "queue.h"
+#include "errors.h"
+#include "options.h"
+#include "session.h"
+
+struct dump
+{
+    struct session *session;
+    struct queue queue;
+    const char *file;
+    int descriptor;
+    uint32_t next;
+    int started;
+    int whole;
+    int pending;
+    int finished;
+    size_t count;
+    size_t index;
+    size_t trimmed;
+    struct extent block;
+    uint8_t data[BUFFER_BLOCK];
+    struct extent held[BUFFER_EXTENTS];
+};
+
+static const struct sector small_pages[] =
+{
+    {0x00000400, 1024, 20},
+    {0}
+};
+
+static const struct sector large_pages[] =
+{
+    {0x00000800, 512, 20},
+    {0}
+};
+
+static const struct sector f4_sectors[] =
+{
+    {0x00004000, 4, 250},
+    {0x00010000, 1, 550},
+    {0x00020000, 7, 1000},
+    {0}
+};
+
+static const struct device devices[] =
+{
+    {0x0440, 0x00040000, "F05xxx/030x8", small_pages, 40, 0x1FFFF7AC, 0x1FFFF7CC, 0x00002000, 0x00000800},
+    {0x0444, 0x00040000, "F03xx4/03xx6", small_pages, 40, 0x1FFFF7AC, 0x1FFFF7CC, 0x00001000, 0x00000800},
+    {0x0442, 0x00040000, "F030xC/09xxx", large_pages, 40, 0x1FFFF7AC, 0x1FFFF7CC, 0x00008000, 0x00000800},
+    {0x0445, 0x00040000, "F04xxx/070x6", small_pages, 40, 0x1FFFF7AC, 0x1FFFF7CC, 0x00001800, 0x00000800},
+    {0x0448, 0x00040000, "F070xB/071xx/072xx", large_pages, 40, 0x1FFFF7AC, 0x1FFFF7CC, 0x00004000, 0x00000800},
+    {0x0412, 0x00008000, "F10xxx low-density", small_pages, 40, 0x1FFFF7E8, 0x1FFFF7E0, 0x00002800, 0x00000200},
+    {0x0410, 0x00020000, "F10xxx medium-density", small_pages, 40, 0x1FFFF7E8, 0x1FFFF7E0, 0x00005000, 0x00000200},
+    {0x0414, 0x00080000, "F10xxx high-density", large_pages, 40, 0x1FFFF7E8, 0x1FFFF7E0, 0x00010000, 0x00000200},
+    {0x0420, 0x00020000, "F10xxx medium-density value line", small_pages, 40, 0x1FFFF7E8, 0x1FFFF7E0, 0x00002000, 0x00000200},
+    {0x0428, 0x00080000, "F10xxx high-density value line", large_pages, 40, 0x1FFFF7E8, 0x1FFFF7E0, 0x00008000, 0x00000200},
+    {0x0418, 0x00040000, "F105xx/107xx", large_pages, 40, 0x1FFFF7E8, 0x1FFFF7E0, 0x00010000, 0x00000200},
+    {0x0430, 0x00100000, "F10xxx extra-density", large_pages, 40, 0x1FFFF7E8, 0x1FFFF7E0, 0x00018000, 0x00000200},
+    {0x0423, 0x00040000, "F401xB/401xC", f4_sectors, 2000, 0x1FFF7A10, 0x1FFF7A22, 0x00010000, 0x00003000},
+    {0x0641, 0x00020000, "Experimental", 0, 0, 0, 0, 0x00002000, 0},
+};
+
+static const int bauds[] =
+{
+    3000000,
+    2000000,
+    1000000,
+    921600,
+    460800,
+    230400,
+    115200,
+    57600,
+    0
+};
+
+int session_baud(int index)
+{
+    return bauds[index];
+}
+
+void init_session(struct session *session, const struct settings *settings, FILE *console)
+{
+    memset(session, 0, sizeof(struct session));
+    session->settings = settings;
+    session->console = console;
+    session->loader.serial = &session->serial;
+    session->device = devices;
+    session->baud = DEFAULT_BAUD;
+    session->baud_index = -1;
+    init_serial_port(&session->serial);
+}
+
+static int reset_device(struct session *session, int boot)
+{
+    int result;
+    const int state[2][6] =
+    {
+        {1, 0, boot, !boot, 1, 0},
+        {0, 1, boot, !boot, 1, 0}
+    };
+
+    if ((result = control_serial_port(&session->serial, state[0][session->settings->rts_mode], state[0][session->settings->dtr_mode])))
+        return result;
+
+    if ((result = wait_serial_port(1)))
+        return result;
+
+    if ((result = control_serial_port(&session->serial, state[1][session->settings->rts_mode], state[1][session->settings->dtr_mode])))
+        return result;
+
+    return DONE;
+}
+
+static int try_to_handshake_device(struct session *session)
+{
+    int result;
+
+    session->buffer[0] = 0x7F;
+
+    if ((result = wait_serial_port(5)))
+        return result;
+
+    if ((result = flush_serial_port(&session->serial)))
+        return result;
+
+    if ((result = write_serial_port(&session->serial, &session->buffer, 1)))
+        return result;
+
+    if ((result = read_serial_port(&session->serial, &session->buffer, 1)))
+        return result;
+
+    return session->buffer[0] == 0x79 ? DONE : INVALID_DEVICE_REPLY;
+}
+
+static int handshake_device(struct session *session)
+{
+    int result;
+    int count = 5;
+
+    if ((result = configure_serial_port(&session->serial, HANDSHAKE_TIMEOUT)))
+        return result;
+
+    while (count-- && (result = try_to_handshake_device(session)))
+        continue;
+
+    return result;
+}
+
+uint8_t session_checksum(const uint8_t *data, size_t size)
+{
+    uint8_t checksum = 0x00;
+
+    if (size == 1)
+        return ~*data;
+
+    while (size--)
+        checksum ^= *data++;
+
+    return checksum;
+}
+
+int session_timeout(const struct session *session, int timeout, size_t size)
+{
+    return timeout + (int)(size * 11000 / session->baud) + 1;
+}
+
+static const struct buffer *device_loader(const struct session *session)
+{
+    const struct buffer *loader = session->settings->loader;
+
+    return loader && loader->count ? loader : 0;
+}
+
+int session_erase_timeout(const struct session *session)
+{
+    return ERASE_TIMEOUT + (int)(session->size >> 10) * 16;
+}
+
+static int device_request(struct session *session, size_t size, int timeout)
+{
+    int result;
+    int64_t time = clock_serial_port();
+
+    if ((result = configure_serial_port(&session->serial, session_timeout(session, timeout, size + 1))))
+        return result;
+
+    session->buffer[size] = session_checksum(session->buffer, size);
+
+    if ((result = write_serial_port(&session->serial, session->buffer, size + 1)))
+        return result;
+
+    if ((result = read_serial_port(&session->serial, session->buffer, 1)))
+        return result;
+
+    session->ack_time += clock_serial_port() - time;
+    session->acks++;
+
+    return session->buffer[0] == 0x79 ? DONE : INVALID_DEVICE_REPLY;
+}
+
+static void report_device_acks(struct session *session)
+{
+    if (session->acks)
+        fprintf(session->console, TTY_NONE "%d.%03d ms/ACK...", (int)(session->ack_time / session->acks / 1000), (int)(session->ack_time / session->acks % 1000));
+
+    session->acks = 0;
+    session->ack_time = 0;
+}
+
+static int device_response(struct session *session, size_t size, int timeout)
+{
+    int result;
+
+    if ((result = configure_serial_port(&session->serial, session_timeout(session, timeout, size + 1))))
+        return result;
+
+    if ((result = read_serial_port(&session->serial, session->buffer, size + 1)))
+        return result;
+
+    return session->buffer[size] == 0x79 ? DONE : INVALID_DEVICE_REPLY;
+}
+
+static void layout_device(struct session *session)
+{
+    const struct sector *sector = session->device->sectors;
+    uint32_t address = FLASH_ORIGIN;
+
+    session->page_count = 0;
+
+    while (sector && sector->size)
+    {
+        int index;
+
+        for (index = 0; index < sector->count && address < FLASH_ORIGIN + session->size && session->page_count < MAX_PAGES; index++)
+        {
+            session->page_origins[session->page_count] = address;
+            session->page_times[session->page_count] = sector->time;
+            session->page_count++;
+            address += sector->size;
+        }
+
+        sector++;
+    }
+
+    session->page_origins[session->page_count] = address;
+}
+
+int select_session(struct session *session, uint16_t pid)
+{
+    int count = sizeof(devices) / sizeof(struct device);
+
+    fprintf(session->console, TTY_NONE "PID%04X...", pid);
+    session->device = devices;
+    session->selected = 0;
+
+    while (count--)
+    {
+        if (session->device->pid == pid)
+        {
+            session->size = session->device->size;
+            session->selected = 1;
+            layout_device(session);
+            return DONE;
+        }
+
+        session->device++;
+    }
+
+    return UNSUPPORTED_DEVICE;
+}
+
+static int restart_device(struct session *session, int baud)
+{
+    int result;
+
+    if ((result = speed_serial_port(&session->serial, baud)))
+        return result;
+
+    session->baud = baud;
+
+    if ((result = reset_device(session, 1)))
+        return result;
+
+    if ((result = handshake_device(session)))
+        return result;
+
+    return DONE;
+}
+
+static int negotiate_device(struct session *session)
+{
+    int result;
+
+    if (session->baud_index < 0)
+    {
+        fprintf(session->console, TTY_NONE "%d baud...", session->settings->baud_rate);
+        return restart_device(session, session->settings->baud_rate);
+    }
+
+    for (session->baud_index = 0; bauds[session->baud_index]; session->baud_index++)
+    {
+        if ((result = speed_serial_port(&session->serial, bauds[session->baud_index])) == INVALID_OPTIONS_ARGUMENT)
+            continue;
+
+        if (result)
+            return result;
+
+        if ((result = restart_device(session, bauds[session->baud_index])) != NO_DEVICE_REPLY && result != INVALID_DEVICE_REPLY)
+            break;
+    }
+
+    if (!bauds[session->baud_index])
+    {
+        session->baud_index = 0;
+        return NO_DEVICE_REPLY;
+    }
+
+    fprintf(session->console, TTY_NONE "%d baud...", bauds[session->baud_index]);
+    return result;
+}
+
+static int recover_device(struct session *session, int result)
+{
+    if (session->baud_index < 0 || (result != NO_DEVICE_REPLY && result != INVALID_DEVICE_REPLY))
+        return result;
+
+    if (session->errors++)
+    {
+        if (!bauds[session->baud_index + 1])
+            return result;
+
+        session->baud_index++;
+        session->errors = 0;
+    }
+
+    session->blocks = 0;
+    fprintf(session->console, TTY_NONE "%d baud...", bauds[session->baud_index]);
+    return restart_device(session, bauds[session->baud_index]);
+}
+
+void account_session(struct session *session)
+{
+    if (++session->blocks < 64)
+        return;
+
+    session->blocks = 0;
+    session->errors = 0;
+}
+
+static int read_device_block(struct session *session, uint32_t address, uint8_t *data, size_t count)
+{
+    int result;
+
+    session->buffer[0] = 0x11;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    session->buffer[0] = address >> 24;
+    session->buffer[1] = address >> 16;
+    session->buffer[2] = address >> 8;
+    session->buffer[3] = address;
+    if ((result = device_request(session, 4, ACK_TIMEOUT)))
+        return result;
+
+    session->buffer[0] = count - 1;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    if ((result = configure_serial_port(&session->serial, session_timeout(session, BLOCK_TIMEOUT, count))))
+        return result;
+
+    if ((result = read_serial_port(&session->serial, data, count)))
+        return result;
+
+    return DONE;
+}
+
+void resize_session(struct session *session, const uint8_t *data)
+{
+    const size_t size = (size_t)(data[0] | data[1] << 8) << 10;
+
+    if (!size || size >= session->size)
+        return;
+
+    session->size = size;
+    fprintf(session->console, TTY_NONE "%dK...", (int)(session->size >> 10));
+    layout_device(session);
+}
+
+static int probe_device(struct session *session)
+{
+    int result;
+    uint8_t data[2];
+
+    if (!session->device->capacity)
+        return DONE;
+
+    if ((result = read_device_block(session, session->device->capacity, data, sizeof(data))))
+        return result == INVALID_DEVICE_REPLY ? DONE : result;
+
+    resize_session(session, data);
+    return DONE;
+}
+
+int connect_session(struct session *session, const char *file)
+{
+    int result;
+
+    if ((result = open_serial_port(&session->serial, file)))
+        return result;
+
+    if (session->settings->low_latency && (result = latency_serial_port(&session->serial)))
+        return result;
+
+    return restart_session(session);
+}
+
+int restart_session(struct session *session)
+{
+    int result;
+    uint8_t count;
+
+    session->baud_index = session->settings->baud_rate ? -1 : 0;
+    session->erased = 0;
+    session->identified = 0;
+    session->running = 0;
+
+    if ((result = negotiate_device(session)))
+        return result;
+
+    session->buffer[0] = 0x00;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    if ((result = configure_serial_port(&session->serial, session_timeout(session, ACK_TIMEOUT, 1))))
+        return result;
+
+    if ((result = read_serial_port(&session->serial, &count, 1)))
+        return result;
+
+    if (count < 7 || (size_t)count + 1 > sizeof(session->buffer))
+        return INVALID_DEVICE_REPLY;
+
+    if ((result = device_response(session, count + 1, ACK_TIMEOUT)))
+        return result;
+
+    session->version = session->buffer[0];
+    session->erase_command = session->buffer[7];
+    session->checksum_command = memchr(session->buffer + 1, 0xA1, count) != 0;
+    fprintf(session->console, TTY_NONE "V%1X.%1X...", session->version >> 4, session->version & 0x0F);
+
+    session->buffer[0] = 0x02;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    if (session->settings->experimental)
+    {
+        if ((result = device_response(session, 5, ACK_TIMEOUT)))
+            return result;
+
+        if ((result = select_session(session, session->buffer[1] << 8 | session->buffer[2])))
+            return result;
+    }
+    else
+    {
+        if ((result = device_response(session, 3, ACK_TIMEOUT)))
+            return result;
+
+        if ((result = select_session(session, session->buffer[1] << 8 | session->buffer[2])))
+            return result;
+    }
+
+    if ((result = probe_device(session)))
+        return result;
+
+    return DONE;
+}
+
+int identify_session(struct session *session)
+{
+    int result;
+
+    if (session->identified || !session->device->uid)
+        return DONE;
+
+    if ((result = read_device_block(session, session->device->uid, session->uid, DEVICE_UID_SIZE)))
+        return result == INVALID_DEVICE_REPLY ? DONE : result;
+
+    session->identified = 1;
+    return DONE;
+}
+
+static void forget_device(struct session *session)
+{
+    if (session->identified)
+        drop_device_cache(session->uid);
+}
+
+int unprotect_session(struct session *session)
+{
+    int result;
+
+    fprintf(session->console, TTY_NONE "Readout unprotecting...");
+
+    session->buffer[0] = 0x92;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    if ((result = device_response(session, 0, session_erase_timeout(session))))
+        return result;
+
+    if ((result = handshake_device(session)))
+        return result;
+
+    if ((result = identify_session(session)))
+        return result;
+
+    forget_device(session);
+
+    session->erased = 1;
+    return DONE;
+}
+
+static int read_device_extent(struct session *session, const struct buffer *buffer, uint32_t address, size_t size)
+{
+    uint8_t *data = (uint8_t *)buffer->data + address - buffer->origin;
+
+    while (size)
+    {
+        int result;
+        size_t count = size < 256 ? size : 256;
+
+        if ((result = read_device_block(session, address, data, count)))
+        {
+            if ((result = recover_device(session, result)))
+                return result;
+
+            continue;
+        }
+
+        account_session(session);
+        size -= count;
+        data += count;
+        address += count;
+    }
+
+    return DONE;
+}
+
+static int erase_device_memory(struct session *session)
+{
+    int result;
+
+    session->buffer[0] = session->erase_command;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    session->buffer[0] = 0xFF;
+    session->buffer[1] = 0xFF;
+    if ((result = device_request(session, session->erase_command == 0x44 ? 2 : 1, session_erase_timeout(session))))
+        return result;
+
+    return DONE;
+}
+
+int erase_session(struct session *session)
+{
+    int result;
+
+    fprintf(session->console, TTY_NONE "Erasing...");
+
+    if ((result = identify_session(session)))
+        return result;
+
+    forget_device(session);
+
+    if ((result = erase_device_memory(session)))
+        return result;
+
+    session->erased = 1;
+    return DONE;
+}
+
+static size_t plan_device_pages(struct session *session, const struct buffer *buffer, int *time)
+{
+    size_t page;
+    size_t count = 0;
+
+    *time = 0;
+
+    for (page = 0; page < session->page_count; page++)
+    {
+        if (overlap_buffer(buffer, session->page_origins[page], session->page_origins[page + 1] - session->page_origins[page]))
+        {
+            session->pages[count++] = page;
+            *time += session->page_times[page];
+        }
+    }
+
+    return count;
+}
+
+static int erase_device_batch(struct session *session, const uint16_t *pages, size_t count, int time)
+{
+    int result;
+    size_t index;
+
+    session->buffer[0] = session->erase_command;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    if (session->erase_command == 0x44)
+    {
+        session->buffer[0] = (count - 1) >> 8;
+        session->buffer[1] = count - 1;
+
+        for (index = 0; index < count; index++)
+        {
+            session->buffer[2 + 2 * index] = pages[index] >> 8;
+            session->buffer[3 + 2 * index] = pages[index];
+        }
+
+        return device_request(session, 2 + 2 * count, ERASE_TIMEOUT + 2 * time);
+    }
+
+    session->buffer[0] = count - 1;
+
+    for (index = 0; index < count; index++)
+        session->buffer[1 + index] = pages[index];
+
+    return device_request(session, 1 + count, ERASE_TIMEOUT + 2 * time);
+}
+
+static int prefer_mass_erase(struct session *session, size_t count, int time, int mass)
+{
+    return time >= mass || (session->erase_command != 0x44 && session->pages[count - 1] > 0xFE);
+}
+
+static int erase_device_list(struct session *session, size_t count, int time, int mass)
+{
+    int result;
+    size_t index = 0;
+    const size_t batch = session->erase_command == 0x44 ? (sizeof(session->buffer) - 3) / 2 : 255;
+
+    if (!session->page_count)
+        return erase_session(session);
+
+    if (!count)
+        return DONE;
+
+    if (prefer_mass_erase(session, count, time, mass))
+        return erase_session(session);
+
+    fprintf(session->console, TTY_NONE "Erasing %d pages...", (int)count);
+
+    while (index < count)
+    {
+        const size_t size = count - index < batch ? count - index : batch;
+
+        if ((result = erase_device_batch(session, session->pages + index, size, (int)(time * size / count))))
+            return result;
+
+        index += size;
+    }
+
+    session->erased = 1;
+    return DONE;
+}
+
+static int erase_device_pages(struct session *session, const struct buffer *buffer)
+{
+    int time;
+    size_t count = plan_device_pages(session, buffer, &time);
+
+    return erase_device_list(session, count, time, session->device->mass);
+}
+
+int adjust_session(struct session *session, uint8_t voltage)
+{
+    int result;
+
+    fprintf(session->console, TTY_NONE "Adjust voltage \"%d\"...", voltage);
+
+    session->buffer[0] = 0x31;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    session->buffer[0] = 0xFF;
+    session->buffer[1] = 0xFF;
+    session->buffer[2] = 0x00;
+    session->buffer[3] = 0x00;
+    if ((result = device_request(session, 4, ACK_TIMEOUT)))
+        return result;
+
+    session->buffer[0] = 0;
+    session->buffer[1] = voltage;
+
+    if ((result = device_request(session, 2, BLOCK_TIMEOUT)))
+        return result;
+
+    return DONE;
+}
+
+static int write_device_block(struct session *session, uint32_t address, const uint8_t *data, size_t count)
+{
+    int result;
+
+    session->buffer[0] = 0x31;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    session->buffer[0] = address >> 24;
+    session->buffer[1] = address >> 16;
+    session->buffer[2] = address >> 8;
+    session->buffer[3] = address;
+    if ((result = device_request(session, 4, ACK_TIMEOUT)))
+        return result;
+
+    session->buffer[0] = count - 1;
+    memcpy(session->buffer + 1, data, count);
+    if ((result = device_request(session, 1 + count, BLOCK_TIMEOUT)))
+        return result;
+
+    return DONE;
+}
+
+static int write_device_extent(struct session *session, const struct buffer *buffer, uint32_t address, size_t size)
+{
+    const uint8_t *data = (const uint8_t *)buffer->data + address - buffer->origin;
+
+    while (size)
+    {
+        int result;
+        size_t count = size < 256 ? size : 256;
+
+        if (session->erased && address >= FLASH_ORIGIN && address < FLASH_ORIGIN + session->size && blank_buffer(buffer, address, count))
+        {
+            session->skipped++;
+            session->skipped_bytes += count;
+        }
+        else if ((result = write_device_block(session, address, data, count)))
+        {
+            if ((result = recover_device(session, result)))
+                return result;
+
+            continue;
+        }
+
+        account_session(session);
+        size -= count;
+        data += count;
+        address += count;
+    }
+
+    return DONE;
+}
+
+static int write_device_memory(struct session *session, const struct buffer *buffer)
+{
+    size_t index;
+
+    if (!buffer->count)
+        return write_device_extent(session, buffer, buffer->origin, buffer->size);
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        int result;
+
+        if ((result = write_device_extent(session, buffer, buffer->extents[index].origin, buffer->extents[index].size)))
+            return result;
+    }
+
+    return DONE;
+}
+
+static int go_device(struct session *session, uint32_t address)
+{
+    int result;
+
+    session->buffer[0] = 0x21;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    session->buffer[0] = address >> 24;
+    session->buffer[1] = address >> 16;
+    session->buffer[2] = address >> 8;
+    session->buffer[3] = address;
+    if ((result = device_request(session, 4, ACK_TIMEOUT)))
+        return result;
+
+    return DONE;
+}
+
+static int fit_device_ram(struct session *session, const struct buffer *buffer)
+{
+    size_t index;
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        const struct extent *extent = buffer->extents + index;
+
+        if (extent->origin < RAM_ORIGIN + session->device->reserved || (uint64_t)extent->origin + extent->size > RAM_ORIGIN + session->device->ram)
+            return INVALID_FILE_CONTENT;
+    }
+
+    return DONE;
+}
+
+static int start_loader(struct session *session)
+{
+    int result;
+    const struct buffer *loader = device_loader(session);
+
+    fprintf(session->console, TTY_NONE "Loader...");
+
+    if ((result = fit_device_ram(session, loader)))
+        return result;
+
+    if ((result = write_device_memory(session, loader)))
+        return result;
+
+    if ((result = go_device(session, loader->extents[0].origin)))
+        return result;
+
+    if ((result = sync_loader(&session->loader)))
+        return result;
+
+    return DONE;
+}
+
+static int write_device_stream(struct session *session, const struct buffer *buffer)
+{
+    int result;
+
+    if (!device_loader(session))
+        return write_device_memory(session, buffer);
+
+    if ((result = start_loader(session)))
+        return result;
+
+    if ((result = write_loader_memory(&session->loader, buffer, session->settings->loader_compress, session->erased ? &session->skipped : 0, &session->skipped_bytes)))
+        return result;
+
+    return restart_device(session, session->baud);
+}
+
+static int checksum_device_block(struct session *session, uint32_t address, size_t size, uint32_t *crc)
+{
+    const uint32_t parameters[] = {address, size, 0x04C11DB7, 0xFFFFFFFF};
+    size_t index;
+    int result;
+
+    session->buffer[0] = 0xA1;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    for (index = 0; index < 4; index++)
+    {
+        session->buffer[0] = parameters[index] >> 24;
+        session->buffer[1] = parameters[index] >> 16;
+        session->buffer[2] = parameters[index] >> 8;
+        session->buffer[3] = parameters[index];
+        if ((result = device_request(session, 4, ACK_TIMEOUT)))
+            return result;
+    }
+
+    if ((result = configure_serial_port(&session->serial, session_timeout(session, CHECKSUM_TIMEOUT + (int)(size >> 12), 6))))
+        return result;
+
+    if ((result = read_serial_port(&session->serial, session->buffer, 6)))
+        return result;
+
+    if (session->buffer[0] != 0x79 || session_checksum(session->buffer + 1, 4) != session->buffer[5])
+        return INVALID_DEVICE_REPLY;
+
+    *crc = (uint32_t)session->buffer[1] << 24 | session->buffer[2] << 16 | session->buffer[3] << 8 | session->buffer[4];
+    return DONE;
+}
+
+static int compare_device_extent(struct session *session, const uint8_t *data, uint32_t address, size_t size, int *match)
+{
+    *match = 1;
+
+    while (size)
+    {
+        int result;
+        const size_t count = size < sizeof(session->window) ? size : sizeof(session->window);
+        const struct buffer window =
+        {
+            0, address, count, session->window
+        };
+
+        if (device_loader(session))
+            result = read_loader_memory(&session->loader, &window);
+        else
+            result = read_device_extent(session, &window, address, count);
+
+        if (result)
+            return result;
+
+        if (memcmp(data, session->window, count))
+            *match = 0;
+
+        size -= count;
+        data += count;
+        address += count;
+    }
+
+    return DONE;
+}
+
+static int verify_device_memory(struct session *session, const struct buffer *buffer)
+{
+    int result;
+    int mismatches = 0;
+    size_t index;
+    const int readback = !session->checksum_command;
+
+    if (!buffer->count)
+        return DONE;
+
+    if (readback && device_loader(session) && (result = start_loader(session)))
+        return result;
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        const struct extent *extent = buffer->extents + index;
+        const uint8_t *data = (const uint8_t *)buffer->data + extent->origin - buffer->origin;
+        int match;
+
+        if (readback)
+        {
+            if ((result = compare_device_extent(session, data, extent->origin, extent->size, &match)))
+                return result;
+        }
+        else
+        {
+            uint32_t crc;
+
+            if ((result = checksum_device_block(session, extent->origin, extent->size, &crc)))
+                return result;
+
+            match = crc == crc32_words(0xFFFFFFFF, data, extent->size);
+        }
+
+        if (!match)
+        {
+            fprintf(session->console, TTY_NONE "%08X-%08X mismatch...", extent->origin, (uint32_t)(extent->origin + extent->size - 1));
+            mismatches++;
+        }
+    }
+
+    if (readback && device_loader(session) && (result = restart_device(session, session->baud)))
+        return result;
+
+    return mismatches ? INVALID_DEVICE_MEMORY : DONE;
+}
+
+static uint32_t device_page_origin(struct session *session, uint32_t address)
+{
+    size_t page = session->page_count;
+
+    while (page && session->page_origins[page - 1] > address)
+        page--;
+
+    return page && address < session->page_origins[session->page_count] ? session->page_origins[page - 1] : address & ~0xFF;
+}
+
+static uint32_t device_page_above(struct session *session, uint32_t address)
+{
+    size_t page = 0;
+
+    if (device_page_origin(session, address) == address)
+        return address;
+
+    if (!session->page_count || address < session->page_origins[0] || address >= session->page_origins[session->page_count])
+        return (address | 0xFF) + 1;
+
+    while (session->page_origins[page] <= address)
+        page++;
+
+    return session->page_origins[page];
+}
+
+static void trim_dump(struct dump *dump)
+{
+    size_t index;
+
+    for (index = 0; index < dump->count; index++)
+        dump->trimmed += dump->held[index].size;
+
+    if (dump->count && !dump->whole)
+    {
+        struct extent *held = dump->held;
+        const uint32_t end = held->origin + held->size;
+        const uint32_t cut = device_page_above(dump->session, held->origin);
+
+        held->size = (cut < end ? cut : end) - held->origin;
+        dump->trimmed -= held->size;
+        dump->count = 1;
+    }
+    else
+    {
+        dump->count = 0;
+    }
+
+    dump->index = 0;
+}
+
+static int hold_dump_block(struct dump *dump, int joined)
+{
+    struct buffer window =
+    {
+        0, dump->block.origin, dump->block.size, dump->data
+    };
+
+    if (!dump->session->settings->trim_read || dump->count == BUFFER_EXTENTS || !blank_buffer(&window, window.origin, window.size))
+        return 0;
+
+    if (dump->count && joined)
+    {
+        dump->held[dump->count - 1].size += dump->block.size;
+        return 1;
+    }
+
+    if (!dump->count)
+        dump->whole = !joined;
+
+    dump->held[dump->count++] = dump->block;
+    return 1;
+}
+
+static int pull_dump_block(void *argument, struct extent *block, uint8_t *data)
+{
+    struct dump *dump = argument;
+
+    for (;;)
+    {
+        int joined;
+        int pulled;
+
+        if ((dump->pending || dump->finished) && dump->index < dump->count)
+        {
+            struct extent *held = dump->held + dump->index;
+
+            block->origin = held->origin;
+            block->size = held->size < BUFFER_BLOCK ? held->size : BUFFER_BLOCK;
+            memset(data, 0xFF, block->size);
+            held->origin += block->size;
+            held->size -= block->size;
+            dump->index += !held->size;
+            return 1;
+        }
+
+        if (dump->pending)
+        {
+            dump->index = dump->count = 0;
+            *block = dump->block;
+            memcpy(data, dump->data, block->size);
+            dump->pending = 0;
+            return 1;
+        }
+
+        if (dump->finished)
+            return 0;
+
+        if ((pulled = pull_queue(&dump->queue, &dump->block, dump->data)) < 0)
+            return pulled;
+
+        if (!pulled)
+        {
+            dump->finished = 1;
+            trim_dump(dump);
+            continue;
+        }
+
+        joined = dump->started && dump->block.origin == dump->next;
+        dump->next = dump->block.origin + dump->block.size;
+        dump->started = 1;
+        dump->pending = !hold_dump_block(dump, joined);
+    }
+}
+
+static int save_dump(void *argument)
+{
+    struct dump *dump = argument;
+
+    const struct settings *settings = dump->session->settings;
+
+    return save_file_stream(dump->file, dump->descriptor, settings->record_size, settings->sparse_read, pull_dump_block, dump);
+}
+
+static int read_device_blocks(struct session *session, struct queue *queue, uint32_t address, size_t size)
+{
+    uint8_t data[BUFFER_BLOCK];
+
+    while (size)
+    {
+        int result;
+        const size_t count = size < BUFFER_BLOCK - address % BUFFER_BLOCK ? size : BUFFER_BLOCK - address % BUFFER_BLOCK;
+
+        if ((result = read_device_block(session, address, data, count)))
+        {
+            if ((result = recover_device(session, result)))
+                return result;
+
+            continue;
+        }
+
+        account_session(session);
+
+        if ((result = push_queue(queue, address, data, count)))
+            return result;
+
+        size -= count;
+        address += count;
+    }
+
+    return DONE;
+}
+
+static int read_loader_blocks(struct session *session, struct queue *queue, uint32_t address, size_t size)
+{
+    while (size)
+    {
+        int result;
+        size_t offset;
+        const size_t count = size < sizeof(session->window) - address % BUFFER_BLOCK ? size : sizeof(session->window) - address % BUFFER_BLOCK;
+        const struct buffer window =
+        {
+            0, address, count, session->window
+        };
+
+        if ((result = read_loader_memory(&session->loader, &window)))
+            return result;
+
+        for (offset = 0; offset < count; )
+        {
+            const uint32_t origin = address + offset;
+            const size_t piece = count - offset < BUFFER_BLOCK - origin % BUFFER_BLOCK ? count - offset : BUFFER_BLOCK - origin % BUFFER_BLOCK;
+
+            if ((result = push_queue(queue, origin, session->window + offset, piece)))
+                return result;
+
+            offset += piece;
+        }
+
+        size -= count;
+        address += count;
+    }
+
+    return DONE;
+}
+
+static int read_device_dump(struct session *session, struct dump *dump, const struct extent *ranges, size_t count)
+{
+    int result;
+    size_t index;
+    const struct extent whole = {FLASH_ORIGIN, session->size};
+    const struct extent *extents = count ? ranges : &whole;
+
+    if (!count)
+        count = 1;
+
+    if (device_loader(session) && (result = start_loader(session)))
+        return result;
+
+    for (index = 0; index < count; index++)
+    {
+        if (device_loader(session))
+            result = read_loader_blocks(session, &dump->queue, extents[index].origin, extents[index].size);
+        else
+            result = read_device_blocks(session, &dump->queue, extents[index].origin, extents[index].size);
+
+        if (result)
+            return result;
+    }
+
+    return device_loader(session) ? restart_device(session, session->baud) : DONE;
+}
+
+int read_session(struct session *session, const char *file, int descriptor, const struct extent *ranges, size_t count)
+{
+    int result;
+    struct dump dump;
+
+    dump.session = session;
+    dump.file = file;
+    dump.descriptor = descriptor;
+    dump.started = 0;
+    dump.pending = 0;
+    dump.finished = 0;
+    dump.count = 0;
+    dump.index = 0;
+    dump.trimmed = 0;
+
+    if ((result = open_queue(&dump.queue, save_dump, &dump)))
+        return result;
+
+    if ((result = close_queue(&dump.queue, read_device_dump(session, &dump, ranges, count))))
+        return result;
+
+    report_device_acks(session);
+
+    if (dump.trimmed)
+        fprintf(session->console, TTY_NONE "%d erased bytes trimmed...", (int)dump.trimmed);
+
+    return DONE;
+}
+
+static int write_device_pages(struct session *session, const struct buffer *buffer, size_t count)
+{
+    size_t page;
+
+    for (page = 0; page < count; page++)
+    {
+        const uint32_t first = session->page_origins[session->pages[page]];
+        const uint32_t last = session->page_origins[session->pages[page] + 1];
+        size_t index;
+
+        for (index = 0; index < buffer->count; index++)
+        {
+            int result;
+            const struct extent *extent = buffer->extents + index;
+            const uint32_t begin = extent->origin > first ? extent->origin : first;
+            const uint32_t end = extent->origin + extent->size < last ? extent->origin + extent->size : last;
+
+            if (begin < end && (result = write_device_extent(session, buffer, begin, end - begin)))
+                return result;
+        }
+    }
+
+    return DONE;
+}
+
+static int write_device_delta(struct session *session, const struct buffer *buffer)
+{
+    int result;
+    int time = 0;
+    int mass = session->device->mass;
+    size_t page;
+    size_t count = 0;
+
+    for (page = 0; page < session->page_count; page++)
+    {
+        const uint32_t origin = session->page_origins[page];
+
+        session->hashes[page] = hash_buffer(buffer, origin, session->page_origins[page + 1] - origin);
+    }
+
+    if (load_device_cache(session->uid, session->device->pid, session->cached_hashes, session->page_count))
+    {
+        if ((result = erase_session(session)))
+            return result;
+
+        if ((result = write_device_stream(session, buffer)))
+            return result;
+
+        save_device_cache(session->uid, session->device->pid, session->hashes, session->page_count);
+        return DONE;
+    }
+
+    for (page = 0; page < session->page_count; page++)
+    {
+        const uint32_t origin = session->page_origins[page];
+        const size_t size = session->page_origins[page + 1] - origin;
+
+        if (session->hashes[page] != session->cached_hashes[page])
+        {
+            session->pages[count++] = page;
+            time += session->page_times[page];
+        }
+        else if (overlap_buffer(buffer, origin, size))
+        {
+            mass += session_timeout(session, 0, size);
+        }
+    }
+
+    fprintf(session->console, TTY_NONE "%d pages changed...", (int)count);
+
+    if (!count)
+        return DONE;
+
+    forget_device(session);
+
+    if (prefer_mass_erase(session, count, time, mass))
+    {
+        if ((result = erase_session(session)))
+            return result;
+
+        if ((result = write_device_stream(session, buffer)))
+            return result;
+    }
+    else
+    {
+        if ((result = erase_device_list(session, count, time, mass)))
+            return result;
+
+        if ((result = write_device_pages(session, buffer, count)))
+            return result;
+    }
+
+    save_device_cache(session->uid, session->device->pid, session->hashes, session->page_count);
+    return DONE;
+}
+
+void report_session(struct session *session)
+{
+    if (session->skipped)
+        fprintf(session->console, TTY_NONE "%d blank blocks (%d bytes) skipped...", session->skipped, (int)session->skipped_bytes);
+
+    report_device_acks(session);
+}
+
+int write_session(struct session *session, const struct buffer *buffer)
+{
+    int result;
+
+    if ((result = identify_session(session)))
+        return result;
+
+    if (buffer->pid && buffer->pid != session->device->pid)
+        return UNSUPPORTED_DEVICE;
+
+    session->skipped = 0;
+    session->skipped_bytes = 0;
+
+    if (session->settings->delta_write && session->identified && session->page_count)
+    {
+        if ((result = write_device_delta(session, buffer)))
+            return result;
+    }
+    else
+    {
+        forget_device(session);
+
+        if (session->settings->page_erase && (result = erase_device_pages(session, buffer)))
+            return result;
+
+        if ((result = write_device_stream(session, buffer)))
+            return result;
+    }
+
+    report_session(session);
+    return session->settings->verify_write ? verify_session(session, buffer) : DONE;
+}
+
+int stream_session(struct session *session, const struct buffer *buffer, int (*pull)(void *argument, struct extent *block, uint8_t *data), void *argument)
+{
+    int result;
+    int pulled;
+    struct extent block;
+    uint8_t data[BUFFER_BLOCK];
+    struct buffer slot =
+    {
+        0, 0, BUFFER_BLOCK, data
+    };
+
+    if ((result = identify_session(session)))
+        return result;
+
+    forget_device(session);
+
+    session->skipped = 0;
+    session->skipped_bytes = 0;
+
+    while ((pulled = pull(argument, &block, data)) > 0)
+    {
+        slot.origin = block.origin;
+
+        if ((result = write_device_extent(session, &slot, block.origin, block.size)))
+            return result;
+    }
+
+    if (pulled < 0)
+        return INTERNAL_ERROR;
+
+    report_session(session);
+    return DONE;
+}
+
+int verify_session(struct session *session, const struct buffer *buffer)
+{
+    fprintf(session->console, TTY_NONE "Verifying...");
+    return verify_device_memory(session, buffer);
+}
+
+int run_session(struct session *session, const struct buffer *buffer)
+{
+    int result;
+
+    if (!buffer->count)
+        return INVALID_FILE_CONTENT;
+
+    if ((result = fit_device_ram(session, buffer)))
+        return result;
+
+    if ((result = write_device_memory(session, buffer)))
+        return result;
+
+    report_device_acks(session);
+
+    if ((result = go_device(session, buffer->extents[0].origin)))
+        return result;
+
+    session->running = 1;
+    return DONE;
+}
+
+int protect_session(struct session *session)
+{
+    int result;
+
+    fprintf(session->console, TTY_NONE "Readout protecting...");
+
+    if ((result = identify_session(session)))
+        return result;
+
+    forget_device(session);
+
+    session->buffer[0] = 0x82;
+    if ((result = device_request(session, 1, ACK_TIMEOUT)))
+        return result;
+
+    if ((result = device_response(session, 0, BLOCK_TIMEOUT)))
+        return result;
+
+    if ((result = handshake_device(session)))
+        return result;
+
+    return DONE;
+}
+
+static int match_trace_pattern(struct session *session, size_t *length)
+{
+    const char *pattern = session->settings->trace_pattern;
+    const size_t size = strlen(pattern);
+
+    if (*length == sizeof(session->window))
+    {
+        memmove(session->window, session->window + 1, *length - 1);
+        (*length)--;
+    }
+
+    session->window[(*length)++] = session->buffer[0];
+    return *length >= size && !memcmp(session->window + *length - size, pattern, size);
+}
+
+static int trace_device_console(struct session *session)
+{
+    int result;
+    int count = 0;
+    size_t length = 0;
+    time_t base = time(0);
+    const char *pattern = session->settings->trace_pattern;
+
+    if (!session->running && (result = reset_device(session, 0)))
+        return result;
+
+    if ((result = configure_serial_port(&session->serial, TRACE_TIMEOUT)))
+        return result;
+
+    while (count < session->settings->trace_size)
+    {
+        if (time(0) - base > session->settings->trace_time)
+            break;
+
+        if ((result = read_serial_port(&session->serial, session->buffer, 1)))
+        {
+            if (result == NO_DEVICE_REPLY)
+                continue;
+
+            return result;
+        }
+
+        fprintf(session->console, isprint(session->buffer[0]) || isspace(session->buffer[0]) ? TTY_NONE "%c" : TTY_NONE "[%02X]", session->buffer[0]);
+        fflush(session->console);
+        count++;
+        base = time(0);
+
+        if (pattern && match_trace_pattern(session, &length))
+            return DONE;
+    }
+
+    return pattern ? NO_DEVICE_REPLY : DONE;
+}
+
+int trace_session(struct session *session)
+{
+    int result = trace_device_console(session);
+
+    fprintf(session->console, TTY_NONE "Tracing...");
+    return result;
+}
+
+int disconnect_session(struct session *session)
+{
+    int result;
+
+    fprintf(session->console, TTY_NONE "Disconnecting...");
+
+    if ((result = close_serial_port(&session->serial)))
+        return result;
+
+    return DONE;
+}
+
@@ -0,0 +1,157 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "cache.h"
+#include "buffer.h"
+#include "loader.h"
+#include "serial.h"
+
+#define FLASH_ORIGIN 0x08000000
+#define RAM_ORIGIN 0x20000000
+#define MAX_PAGES 1024
+#define SESSION_WINDOW (16*1024)
+#define DEFAULT_BAUD 115200
+
+#define HANDSHAKE_TIMEOUT 100
+#define ACK_TIMEOUT 100
+#define BLOCK_TIMEOUT 250
+#define ERASE_TIMEOUT 1000
+#define TRACE_TIMEOUT 100
+#define CHECKSUM_TIMEOUT 250
+
+enum line
+{
+    RESET_LINE,
+    NRESET_LINE,
+    BOOT_LINE,
+    NBOOT_LINE,
+    SET_LINE,
+    CLEAR_LINE
+};
+
+struct sector
+{
+    uint32_t size;
+    uint16_t count;
+    uint16_t time;
+};
+
+struct device
+{
+    uint16_t pid;
+    size_t size;
+    const char *name;
+    const struct sector *sectors;
+    uint16_t mass;
+    uint32_t uid;
+    uint32_t capacity;
+    size_t ram;
+    size_t reserved;
+};
+
+struct settings
+{
+    int rts_mode;
+    int dtr_mode;
+    int experimental;
+    int low_latency;
+    int baud_rate;
+    int page_erase;
+    int delta_write;
+    int verify_write;
+    int trim_read;
+    int sparse_read;
+    int record_size;
+    int loader_compress;
+    const struct buffer *loader;
+    int trace_size;
+    int trace_time;
+    const char *trace_pattern;
+};
+
+struct session
+{
+    const struct settings *settings;
+    FILE *console;
+    struct serial serial;
+    struct loader loader;
+    const struct device *device;
+    size_t size;
+    int baud;
+    int baud_index;
+    int errors;
+    int blocks;
+    int erased;
+    int skipped;
+    size_t skipped_bytes;
+    int acks;
+    int64_t ack_time;
+    uint8_t version;
+    uint8_t erase_command;
+    int checksum_command;
+    int selected;
+    int identified;
+    int running;
+    uint8_t uid[DEVICE_UID_SIZE];
+    size_t page_count;
+    uint32_t page_origins[MAX_PAGES + 1];
+    uint16_t page_times[MAX_PAGES];
+    uint32_t hashes[MAX_PAGES];
+    uint32_t cached_hashes[MAX_PAGES];
+    uint16_t pages[MAX_PAGES];
+    uint8_t buffer[512];
+    uint8_t window[SESSION_WINDOW];
+};
+
+void init_session(struct session *session, const struct settings *settings, FILE *console);
+int connect_session(struct session *session, const char *file);
+int restart_session(struct session *session);
+int identify_session(struct session *session);
+int disconnect_session(struct session *session);
+int unprotect_session(struct session *session);
+int protect_session(struct session *session);
+int erase_session(struct session *session);
+int adjust_session(struct session *session, uint8_t voltage);
+int write_session(struct session *session, const struct buffer *buffer);
+int stream_session(struct session *session, const struct buffer *buffer, int (*pull)(void *argument, struct extent *block, uint8_t *data), void *argument);
+int verify_session(struct session *session, const struct buffer *buffer);
+int read_session(struct session *session, const char *file, int descriptor, const struct extent *ranges, size_t count);
+int run_session(struct session *session, const struct buffer *buffer);
+int trace_session(struct session *session);
+
+uint8_t session_checksum(const uint8_t *data, size_t size);
+int session_timeout(const struct session *session, int timeout, size_t size);
+int session_erase_timeout(const struct session *session);
+int session_baud(int index);
+int select_session(struct session *session, uint16_t pid);
+void resize_session(struct session *session, const uint8_t *data);
+void account_session(struct session *session);
+void report_session(struct session *session);
+
+#endif
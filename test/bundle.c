@@ -0,0 +1,252 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Bundle conversion: a bundle converted without a connected device, and
+ * without a PID after the output file, must fit any device. A bundle of
+ * several extents, with compressible and incompressible pages, must load
+ * back as the same image and convert back to the same HEX and raw bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "errors.h"
+#include "buffer.h"
+#include "job.h"
+
+#define FAKE_ORIGIN 0x08000000
+#define FAKE_SIZE (64*1024)
+
+static const struct option options[] =
+{
+    {OTHER_OPTION}
+};
+
+static const struct error errors[] =
+{
+    {DONE, "No errors, all done"}
+};
+
+static struct job job;
+static uint8_t image_memory[FAKE_SIZE];
+static uint8_t loaded_memory[FAKE_SIZE];
+static uint8_t converted_memory[FAKE_SIZE];
+
+static const struct extent extents[] =
+{
+    {FAKE_ORIGIN + 0x0000, 0x0C00},
+    {FAKE_ORIGIN + 0x0C80, 0x0124},
+    {FAKE_ORIGIN + 0x2344, 0x1800},
+    {FAKE_ORIGIN + 0xF000, 0x1000}
+};
+static int failures;
+
+static enum operation classify(const struct call *call)
+{
+    return SETTING_OPERATION;
+}
+
+static void init_buffer(struct buffer *buffer, uint8_t *data)
+{
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->origin = FAKE_ORIGIN;
+    buffer->size = FAKE_SIZE;
+    buffer->data = data;
+    clear_buffer(buffer, 0xFF);
+}
+
+static void report(const char *name, int passed)
+{
+    if (!passed)
+        failures++;
+
+    fprintf(stdout, "%-24s %s\n", name, passed ? "passed" : "FAILED");
+}
+
+static int temporary(char *file, int suffix)
+{
+    const int stream = mkstemps(file, suffix);
+
+    if (stream < 0)
+        return 0;
+
+    close(stream);
+    return 1;
+}
+
+static int save_image(const char *file)
+{
+    struct buffer image;
+    size_t index;
+
+    init_buffer(&image, image_memory);
+
+    for (index = 0; index < 3000; index++)
+        image_memory[0x400 + index] = index * 7;
+
+    image.count = 1;
+    image.extents[0].origin = FAKE_ORIGIN + 0x400;
+    image.extents[0].size = 3000;
+    return save_file_buffer(&image, file, 16, 0);
+}
+
+static void fill_extents(struct buffer *image)
+{
+    size_t index;
+
+    init_buffer(image, image_memory);
+
+    for (index = 0; index < sizeof(extents) / sizeof(extents[0]); index++)
+    {
+        uint8_t *data = image_memory + extents[index].origin - FAKE_ORIGIN;
+        size_t byte;
+
+        for (byte = 0; byte < extents[index].size; byte++)
+            data[byte] = index == 2 ? rand() : index == 3 ? 0 : byte / 64;
+
+        image->extents[index] = extents[index];
+    }
+
+    image->count = index;
+    image->startup = FAKE_ORIGIN + 0x131;
+}
+
+static int same_bytes(const struct buffer *buffer, uint32_t origin, size_t size)
+{
+    return origin >= buffer->origin && origin - buffer->origin + size <= buffer->size
+        && !memcmp((const uint8_t *)buffer->data + origin - buffer->origin, image_memory + origin - FAKE_ORIGIN, size);
+}
+
+static int same_extents(const struct buffer *buffer)
+{
+    size_t index;
+
+    if (buffer->count != sizeof(extents) / sizeof(extents[0]))
+        return 0;
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        if (buffer->extents[index].origin != extents[index].origin || buffer->extents[index].size != extents[index].size)
+            return 0;
+
+        if (!same_bytes(buffer, extents[index].origin, extents[index].size))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void check_convert(const char *name, const char *bundle, const char *suffix)
+{
+    char output[32];
+    struct buffer converted;
+    uint32_t end = extents[3].origin + extents[3].size;
+    int passed;
+
+    snprintf(output, sizeof(output), "/tmp/bundle-XXXXXX%s", suffix);
+    init_buffer(&converted, converted_memory);
+
+    if (!temporary(output, strlen(suffix)))
+    {
+        report(name, 0);
+        return;
+    }
+
+    passed = !convert_job(&job, bundle, output, -1) && !load_file_buffer(&converted, output, FAKE_ORIGIN);
+    unlink(output);
+
+    if (!strcmp(suffix, ".bin"))
+        passed = passed && converted.count == 1 && converted.extents[0].origin == FAKE_ORIGIN && converted.extents[0].size == end - FAKE_ORIGIN && same_bytes(&converted, FAKE_ORIGIN, end - FAKE_ORIGIN);
+    else
+        passed = passed && same_extents(&converted);
+
+    report(name, passed);
+    unload_file_buffer(&converted);
+}
+
+static void check_bundle(void)
+{
+    char bundle[] = "/tmp/bundle-XXXXXX.swb";
+    struct buffer image, loaded;
+    int passed;
+
+    fill_extents(&image);
+    init_buffer(&loaded, loaded_memory);
+
+    if (!temporary(bundle, 4))
+    {
+        report("bundle round trip", 0);
+        return;
+    }
+
+    passed = !save_file_buffer(&image, bundle, 16, 0) && !load_file_buffer(&loaded, bundle, 0);
+    report("bundle round trip", passed && loaded.startup == image.startup && loaded.pid == 0 && same_extents(&loaded));
+    unload_file_buffer(&loaded);
+
+    check_convert("bundle to hex", bundle, ".hex");
+    check_convert("bundle to bin", bundle, ".bin");
+    unlink(bundle);
+}
+
+static void check_pid(const char *name, const char *source, const char *pid, uint16_t expected)
+{
+    char output[] = "/tmp/bundle-XXXXXX.swb";
+    struct buffer loaded;
+    int passed;
+
+    if (!temporary(output, 4))
+    {
+        report(name, 0);
+        return;
+    }
+
+    init_buffer(&loaded, loaded_memory);
+    passed = !convert_job(&job, source, output, pid ? (int)strtol(pid, 0, 16) : -1) && !load_file_buffer(&loaded, output, 0);
+    unlink(output);
+
+    report(name, passed && loaded.pid == expected && loaded.count == 1 && loaded.extents[0].size == 3000 && !memcmp(loaded_memory + 0x400, image_memory + 0x400, 3000));
+    unload_file_buffer(&loaded);
+}
+
+int main(void)
+{
+    char source[] = "/tmp/bundle-XXXXXX.hex";
+
+    setenv("SWAMP_BOOT_CACHE", "0", 1);
+
+    if (init_job(&job, "", options, errors, classify) || !temporary(source, 4) || save_image(source))
+    {
+        report("setup", 0);
+        return EXIT_FAILURE;
+    }
+
+    check_pid("offline pid", source, 0, 0);
+    check_pid("explicit pid", source, "0414", 0x0414);
+    check_bundle();
+
+    unlink(source);
+    close_job(&job);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
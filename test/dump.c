@@ -0,0 +1,236 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Streamed dump: a fake bootloader at the far end of a socket pair answers
+ * Read Memory commands from a simulated flash, and the dump saved while it
+ * is read must keep the programmed bytes, the erased gaps between them and
+ * the erased tail up to the next page boundary only.
+ */
+
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "errors.h"
+#include "buffer.h"
+#include "session.h"
+
+#define FAKE_PID 0x0412
+#define FAKE_SIZE (32*1024)
+#define FAKE_TRIMMED 20480
+
+struct target
+{
+    int fd;
+    uint8_t flash[FAKE_SIZE];
+};
+
+static struct target target;
+static struct session session;
+static uint8_t loaded_memory[FAKE_SIZE];
+static int failures;
+
+static void report(const char *name, int passed)
+{
+    if (!passed)
+        failures++;
+
+    fprintf(stdout, "%-24s %s\n", name, passed ? "passed" : "FAILED");
+}
+
+static int receive(struct target *target, uint8_t *data, size_t size)
+{
+    while (size)
+    {
+        const ssize_t count = read(target->fd, data, size);
+
+        if (count <= 0)
+            return 0;
+
+        data += count;
+        size -= count;
+    }
+
+    return 1;
+}
+
+static int acknowledge(struct target *target)
+{
+    static const uint8_t ack = 0x79;
+
+    return write(target->fd, &ack, 1) == 1;
+}
+
+static void *run_target(void *argument)
+{
+    struct target *target = argument;
+    uint8_t request[5];
+
+    while (receive(target, request, 2) && request[0] == 0x11 && request[1] == 0xEE && acknowledge(target))
+    {
+        uint32_t address;
+        size_t count;
+
+        if (!receive(target, request, 5) || !acknowledge(target))
+            break;
+
+        address = (uint32_t)request[0] << 24 | request[1] << 16 | request[2] << 8 | request[3];
+
+        if (!receive(target, request, 2) || address < FLASH_ORIGIN || address - FLASH_ORIGIN + request[0] + 1 > FAKE_SIZE)
+            break;
+
+        count = request[0] + 1;
+
+        if (!acknowledge(target) || write(target->fd, target->flash + address - FLASH_ORIGIN, count) != (ssize_t)count)
+            break;
+    }
+
+    return 0;
+}
+
+static void fill_flash(void)
+{
+    size_t index;
+
+    memset(target.flash, 0xFF, sizeof(target.flash));
+
+    for (index = 0; index < 4500; index++)
+        target.flash[index] = index * 3 + (index >> 8);
+
+    for (index = 20000; index < 20100; index++)
+        target.flash[index] = index;
+}
+
+static int dump(const char *file, int trim)
+{
+    static const struct settings settings = {0};
+    struct settings dumping = settings;
+    pthread_t thread;
+    FILE *console;
+    int pair[2];
+    int result;
+
+    dumping.trim_read = trim;
+    dumping.record_size = 16;
+
+    if (!(console = fopen("/dev/null", "w")))
+        return INTERNAL_ERROR;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        fclose(console);
+        return INTERNAL_ERROR;
+    }
+
+    init_session(&session, &dumping, console);
+    session.serial.fd = pair[0];
+    target.fd = pair[1];
+
+    if ((result = select_session(&session, FAKE_PID)) || pthread_create(&thread, 0, run_target, &target))
+    {
+        close(pair[0]);
+        close(pair[1]);
+        fclose(console);
+        return result ? result : INTERNAL_ERROR;
+    }
+
+    result = read_session(&session, file, -1, 0, 0);
+
+    shutdown(pair[0], SHUT_RDWR);
+    pthread_join(thread, 0);
+    close(pair[0]);
+    close(pair[1]);
+    fclose(console);
+    return result;
+}
+
+static void check_hex(void)
+{
+    char output[] = "/tmp/dump-XXXXXX.hex";
+    struct buffer loaded;
+    int stream;
+    int passed;
+
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.origin = FLASH_ORIGIN;
+    loaded.size = FAKE_SIZE;
+    loaded.data = loaded_memory;
+
+    if ((stream = mkstemps(output, 4)) < 0 || close(stream))
+    {
+        report("trimmed hex dump", 0);
+        return;
+    }
+
+    passed = !dump(output, 1) && !load_file_buffer(&loaded, output, 0);
+    unlink(output);
+
+    report("trimmed hex dump", passed && loaded.count == 1 && loaded.extents[0].origin == FLASH_ORIGIN && loaded.extents[0].size == FAKE_TRIMMED
+        && !memcmp(loaded_memory, target.flash, FAKE_TRIMMED));
+
+    unload_file_buffer(&loaded);
+}
+
+static void check_binary(const char *name, int trim, size_t size)
+{
+    char output[] = "/tmp/dump-XXXXXX.bin";
+    struct stat status;
+    FILE *stream;
+    int passed;
+    int file;
+
+    if ((file = mkstemps(output, 4)) < 0 || close(file))
+    {
+        report(name, 0);
+        return;
+    }
+
+    passed = !dump(output, trim) && !stat(output, &status) && (size_t)status.st_size == size && (stream = fopen(output, "rb"));
+
+    if (passed)
+    {
+        passed = fread(loaded_memory, 1, size, stream) == size && !memcmp(loaded_memory, target.flash, size);
+        fclose(stream);
+    }
+
+    unlink(output);
+    report(name, passed);
+}
+
+int main(void)
+{
+    setenv("SWAMP_BOOT_CACHE", "0", 1);
+    signal(SIGPIPE, SIG_IGN);
+    fill_flash();
+
+    check_hex();
+    check_binary("trimmed bin dump", 1, FAKE_TRIMMED);
+    check_binary("whole bin dump", 0, FAKE_SIZE);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
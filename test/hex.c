@@ -0,0 +1,161 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Intel HEX parsing: a file large enough to be split into chunks parsed in
+ * parallel, with CRLF line ends and extended address records out of order,
+ * must load exactly as written, and save back to the same image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "errors.h"
+#include "buffer.h"
+
+#define FAKE_ORIGIN 0x08000000
+#define FAKE_SIZE (1024*1024)
+#define FAKE_STARTUP 0x08000131
+
+static const int segments[] = {3, 0, 6, 1, 5, 2};
+
+static uint8_t expected[FAKE_SIZE];
+static uint8_t loaded_memory[FAKE_SIZE];
+static uint8_t saved_memory[FAKE_SIZE];
+static int failures;
+
+static void init_buffer(struct buffer *buffer, uint8_t *data)
+{
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->origin = FAKE_ORIGIN;
+    buffer->size = FAKE_SIZE;
+    buffer->data = data;
+}
+
+static void report(const char *name, int passed)
+{
+    if (!passed)
+        failures++;
+
+    fprintf(stdout, "%-24s %s\n", name, passed ? "passed" : "FAILED");
+}
+
+static void put_record(FILE *stream, uint8_t type, uint16_t offset, const uint8_t *data, uint8_t size)
+{
+    uint8_t checksum = size + (offset >> 8) + offset + type;
+    size_t index;
+
+    fprintf(stream, ":%02X%04X%02X", size, offset, type);
+
+    for (index = 0; index < size; index++)
+    {
+        fprintf(stream, "%02X", data[index]);
+        checksum += data[index];
+    }
+
+    fprintf(stream, "%02X\r\n", (uint8_t)-checksum);
+}
+
+static int write_image(const char *file)
+{
+    static const uint8_t startup[] = {FAKE_STARTUP >> 24, FAKE_STARTUP >> 16 & 0xFF, FAKE_STARTUP >> 8 & 0xFF, FAKE_STARTUP & 0xFF};
+    FILE *stream = fopen(file, "wb");
+    size_t index;
+
+    if (!stream)
+        return 0;
+
+    memset(expected, 0xFF, sizeof(expected));
+
+    for (index = 0; index < sizeof(segments) / sizeof(segments[0]); index++)
+    {
+        const uint16_t high = (FAKE_ORIGIN >> 16) + segments[index];
+        const uint8_t address[] = {high >> 8, high & 0xFF};
+        uint32_t offset;
+
+        put_record(stream, 0x04, 0, address, sizeof(address));
+
+        for (offset = 0; offset < 0x10000; offset += 16)
+        {
+            uint8_t *data = expected + segments[index] * 0x10000 + offset;
+            size_t byte;
+
+            for (byte = 0; byte < 16; byte++)
+                data[byte] = (offset + byte) * 31 + segments[index] * 17 + (offset >> 8);
+
+            put_record(stream, 0x00, offset, data, 16);
+        }
+
+        if (index == 2)
+            put_record(stream, 0x05, 0, startup, sizeof(startup));
+    }
+
+    put_record(stream, 0x01, 0, 0, 0);
+    return !fclose(stream);
+}
+
+static int matches(const struct buffer *buffer, const uint8_t *memory)
+{
+    return buffer->count == 2 && buffer->extents[0].origin == FAKE_ORIGIN && buffer->extents[0].size == 4 * 0x10000
+        && buffer->extents[1].origin == FAKE_ORIGIN + 5 * 0x10000 && buffer->extents[1].size == 2 * 0x10000
+        && !memcmp(memory, expected, 4 * 0x10000) && !memcmp(memory + 5 * 0x10000, expected + 5 * 0x10000, 2 * 0x10000);
+}
+
+int main(void)
+{
+    char source[] = "/tmp/hex-XXXXXX.hex";
+    char output[] = "/tmp/hex-XXXXXX.hex";
+    struct buffer loaded, saved;
+    int stream;
+    int passed;
+
+    setenv("SWAMP_BOOT_CACHE", "0", 1);
+    setenv("SWAMP_BOOT_THREADS", "4", 1);
+    init_buffer(&loaded, loaded_memory);
+    init_buffer(&saved, saved_memory);
+
+    if ((stream = mkstemps(source, 4)) < 0 || close(stream) || !write_image(source))
+    {
+        report("parallel hex", 0);
+        return EXIT_FAILURE;
+    }
+
+    passed = !load_file_buffer(&loaded, source, 0);
+    unlink(source);
+    report("parallel hex", passed && loaded.startup == FAKE_STARTUP && matches(&loaded, loaded_memory));
+
+    if ((stream = mkstemps(output, 4)) < 0 || close(stream))
+    {
+        report("hex round trip", 0);
+        return EXIT_FAILURE;
+    }
+
+    passed = passed && !save_file_buffer(&loaded, output, 32, 0) && !load_file_buffer(&saved, output, 0);
+    unlink(output);
+    report("hex round trip", passed && matches(&saved, saved_memory));
+
+    unload_file_buffer(&loaded);
+    unload_file_buffer(&saved);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,242 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * S-record and ELF parsing: records must land at their own addresses with
+ * the start address taken from the termination record or the entry point,
+ * ELF segments must load at their physical (LMA) addresses with empty ones
+ * skipped, and both must save back to the same HEX image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <elf.h>
+#include "errors.h"
+#include "buffer.h"
+
+#define FAKE_ORIGIN 0x08000000
+#define FAKE_SIZE (64*1024)
+#define FAKE_STARTUP 0x08000131
+#define FAKE_RAM 0x20000000
+
+#define TEXT_SIZE 1024
+#define DATA_SIZE 256
+#define TABLE_OFFSET 0x8000
+#define TABLE_SIZE 100
+
+static uint8_t expected[FAKE_SIZE];
+static uint8_t loaded_memory[FAKE_SIZE];
+static uint8_t saved_memory[FAKE_SIZE];
+static int failures;
+
+static void init_buffer(struct buffer *buffer, uint8_t *data)
+{
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->origin = FAKE_ORIGIN;
+    buffer->size = FAKE_SIZE;
+    buffer->data = data;
+}
+
+static void report(const char *name, int passed)
+{
+    if (!passed)
+        failures++;
+
+    fprintf(stdout, "%-24s %s\n", name, passed ? "passed" : "FAILED");
+}
+
+static int temporary(char *file, int suffix)
+{
+    const int stream = mkstemps(file, suffix);
+
+    if (stream < 0)
+        return 0;
+
+    close(stream);
+    return 1;
+}
+
+static void fill_expected(void)
+{
+    size_t index;
+
+    memset(expected, 0xFF, sizeof(expected));
+
+    for (index = 0; index < TEXT_SIZE + DATA_SIZE; index++)
+        expected[index] = index * 13 + (index >> 8);
+
+    for (index = 0; index < TABLE_SIZE; index++)
+        expected[TABLE_OFFSET + index] = index ^ 0x5A;
+}
+
+static void put_srec(FILE *stream, int type, uint32_t address, const uint8_t *data, size_t size)
+{
+    const size_t width = type == 0 || type == 9 ? 2 : 4;
+    uint8_t checksum = width + size + 1;
+    size_t index;
+
+    fprintf(stream, "S%d%02X", type, (unsigned)(width + size + 1));
+
+    for (index = width; index-- > 0;)
+    {
+        fprintf(stream, "%02X", (unsigned)(address >> index * 8 & 0xFF));
+        checksum += address >> index * 8;
+    }
+
+    for (index = 0; index < size; index++)
+    {
+        fprintf(stream, "%02X", data[index]);
+        checksum += data[index];
+    }
+
+    fprintf(stream, "%02X\n", (uint8_t)~checksum);
+}
+
+static int write_srec(const char *file)
+{
+    static const uint8_t name[] = "image";
+    FILE *stream = fopen(file, "wb");
+    uint32_t offset;
+
+    if (!stream)
+        return 0;
+
+    put_srec(stream, 0, 0, name, sizeof(name) - 1);
+
+    for (offset = 0; offset < TABLE_SIZE; offset += 32)
+        put_srec(stream, 3, FAKE_ORIGIN + TABLE_OFFSET + offset, expected + TABLE_OFFSET + offset, TABLE_SIZE - offset < 32 ? TABLE_SIZE - offset : 32);
+
+    for (offset = 0; offset < TEXT_SIZE + DATA_SIZE; offset += 16)
+        put_srec(stream, 3, FAKE_ORIGIN + offset, expected + offset, 16);
+
+    put_srec(stream, 7, FAKE_STARTUP, 0, 0);
+    return !fclose(stream);
+}
+
+static void put_segment(Elf32_Phdr *segment, uint32_t type, uint32_t offset, uint32_t vaddr, uint32_t paddr, uint32_t filesz, uint32_t memsz)
+{
+    memset(segment, 0, sizeof(*segment));
+    segment->p_type = type;
+    segment->p_offset = offset;
+    segment->p_vaddr = vaddr;
+    segment->p_paddr = paddr;
+    segment->p_filesz = filesz;
+    segment->p_memsz = memsz;
+}
+
+static int write_elf(const char *file)
+{
+    const uint32_t base = sizeof(Elf32_Ehdr) + 5 * sizeof(Elf32_Phdr);
+    Elf32_Phdr segments[5];
+    Elf32_Ehdr header;
+    FILE *stream = fopen(file, "wb");
+    int written;
+
+    if (!stream)
+        return 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS32;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_ARM;
+    header.e_version = EV_CURRENT;
+    header.e_entry = FAKE_STARTUP;
+    header.e_phoff = sizeof(header);
+    header.e_ehsize = sizeof(header);
+    header.e_phentsize = sizeof(Elf32_Phdr);
+    header.e_phnum = 5;
+
+    put_segment(&segments[0], PT_LOAD, base + TEXT_SIZE, FAKE_RAM, FAKE_ORIGIN + TEXT_SIZE, DATA_SIZE, DATA_SIZE);
+    put_segment(&segments[1], PT_NOTE, base, FAKE_RAM + 0x1000, FAKE_RAM + 0x1000, 16, 16);
+    put_segment(&segments[2], PT_LOAD, base, FAKE_ORIGIN, FAKE_ORIGIN, TEXT_SIZE, TEXT_SIZE);
+    put_segment(&segments[3], PT_LOAD, base + TEXT_SIZE + DATA_SIZE, FAKE_RAM + DATA_SIZE, FAKE_RAM + DATA_SIZE, 0, 512);
+    put_segment(&segments[4], PT_LOAD, base + TEXT_SIZE + DATA_SIZE, FAKE_ORIGIN + TABLE_OFFSET, FAKE_ORIGIN + TABLE_OFFSET, TABLE_SIZE, TABLE_SIZE);
+
+    written = fwrite(&header, sizeof(header), 1, stream) == 1
+        && fwrite(segments, sizeof(segments), 1, stream) == 1
+        && fwrite(expected, TEXT_SIZE + DATA_SIZE, 1, stream) == 1
+        && fwrite(expected + TABLE_OFFSET, TABLE_SIZE, 1, stream) == 1;
+
+    return !fclose(stream) && written;
+}
+
+static int matches(const struct buffer *buffer, const uint8_t *memory)
+{
+    return buffer->count == 2 && buffer->extents[0].origin == FAKE_ORIGIN && buffer->extents[0].size == TEXT_SIZE + DATA_SIZE
+        && buffer->extents[1].origin == FAKE_ORIGIN + TABLE_OFFSET && buffer->extents[1].size == TABLE_SIZE
+        && !memcmp(memory, expected, TEXT_SIZE + DATA_SIZE) && !memcmp(memory + TABLE_OFFSET, expected + TABLE_OFFSET, TABLE_SIZE);
+}
+
+static void check_image(const char *name, const char *suffix, int (*write)(const char *file))
+{
+    char source[32], output[] = "/tmp/image-XXXXXX.hex";
+    char round[32];
+    struct buffer loaded, saved;
+    int passed;
+
+    snprintf(source, sizeof(source), "/tmp/image-XXXXXX%s", suffix);
+    snprintf(round, sizeof(round), "%s round trip", name);
+    init_buffer(&loaded, loaded_memory);
+    init_buffer(&saved, saved_memory);
+
+    if (!temporary(source, strlen(suffix)) || !write(source))
+    {
+        unlink(source);
+        report(name, 0);
+        return;
+    }
+
+    passed = !load_file_buffer(&loaded, source, 0);
+    unlink(source);
+    report(name, passed && loaded.startup == FAKE_STARTUP && matches(&loaded, loaded_memory));
+
+    if (!temporary(output, 4))
+    {
+        report(round, 0);
+        unload_file_buffer(&loaded);
+        return;
+    }
+
+    passed = passed && !save_file_buffer(&loaded, output, 16, 0) && !load_file_buffer(&saved, output, 0);
+    unlink(output);
+    report(round, passed && matches(&saved, saved_memory));
+
+    unload_file_buffer(&loaded);
+    unload_file_buffer(&saved);
+}
+
+int main(void)
+{
+    setenv("SWAMP_BOOT_CACHE", "0", 1);
+    fill_expected();
+
+    check_image("srec", ".srec", write_srec);
+    check_image("elf lma", ".elf", write_elf);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
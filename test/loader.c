@@ -0,0 +1,360 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Host-side fake of the RAM flash loader: the target end of a socket pair
+ * speaks the frame protocol of loader/loader.c against a simulated flash,
+ * and drops, damages or rejects chosen frames to exercise the host backend.
+ */
+
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "crc.h"
+#include "lz4.h"
+#include "errors.h"
+#include "serial.h"
+#include "loader.h"
+
+#define FAKE_ORIGIN 0x08000000
+#define FAKE_SIZE (64*1024)
+
+#define STATUS_DONE 0
+#define STATUS_CHECKSUM 1
+#define STATUS_FLASH 2
+#define STATUS_FRAME 3
+
+enum fault
+{
+    NO_FAULT,
+    NACK_FAULT,
+    DROP_REQUEST_FAULT,
+    LOSE_BYTE_FAULT,
+    DROP_REPLY_FAULT,
+    DAMAGE_REPLY_FAULT,
+    ALWAYS_NACK_FAULT
+};
+
+struct target
+{
+    int fd;
+    enum fault fault;
+    int frame;
+    int frames;
+    int programmed;
+    uint8_t flash[FAKE_SIZE];
+    uint8_t request[12 + LOADER_FRAME + 4];
+    uint8_t reply[5 + LOADER_FRAME + 4];
+    uint8_t work[LOADER_FRAME];
+};
+
+static struct target target;
+static struct serial serial;
+static struct loader loader;
+static uint8_t image[FAKE_SIZE];
+static uint8_t readback[FAKE_SIZE];
+static int failures;
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static int faulty(struct target *target, enum fault fault)
+{
+    return target->fault == fault && target->frames == target->frame;
+}
+
+static void respond(struct target *target, uint8_t sequence, uint8_t status, size_t size)
+{
+    target->reply[0] = LOADER_REPLY;
+    target->reply[1] = sequence;
+    target->reply[2] = status;
+    target->reply[3] = size;
+    target->reply[4] = size >> 8;
+    put_u32(target->reply + 5 + size, crc32(0, target->reply, 5 + size));
+
+    if (faulty(target, DROP_REPLY_FAULT))
+        return;
+
+    if (faulty(target, DAMAGE_REPLY_FAULT))
+        target->reply[5 + size] ^= 0xFF;
+
+    if (write(target->fd, target->reply, 5 + size + 4) < 0)
+        return;
+}
+
+static int receive(struct target *target)
+{
+    size_t count = 0;
+    size_t size = 0;
+    size_t index = 0;
+    uint8_t byte;
+
+    while (read(target->fd, &byte, 1) == 1)
+    {
+        if (faulty(target, LOSE_BYTE_FAULT) && index++ == 100)
+            continue;
+
+        if (!count && byte != LOADER_REQUEST)
+            continue;
+
+        target->request[count++] = byte;
+
+        if (count == 12 && (size = target->request[8] | target->request[9] << 8) > LOADER_FRAME)
+            count = 0;
+
+        if (count > 12 && count == 12 + size + 4)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int program(struct target *target, uint32_t address, const uint8_t *data, size_t size)
+{
+    size_t index;
+
+    if (address < FAKE_ORIGIN || address + size > FAKE_ORIGIN + FAKE_SIZE)
+        return STATUS_FLASH;
+
+    for (index = 0; index < size; index++)
+    {
+        uint8_t *cell = target->flash + address - FAKE_ORIGIN + index;
+
+        if (*cell != 0xFF && *cell != data[index])
+            return STATUS_FLASH;
+
+        *cell = data[index];
+    }
+
+    target->programmed += size;
+    return STATUS_DONE;
+}
+
+static void process(struct target *target)
+{
+    const uint8_t *data = target->request;
+    const uint8_t sequence = data[2];
+    const uint32_t address = get_u32(data + 4);
+    const size_t size = data[8] | data[9] << 8;
+    const size_t length = data[10] | data[11] << 8;
+    const uint8_t *source = data + 12;
+    int status = STATUS_DONE;
+
+    if (crc32(0, data, 12 + size) != get_u32(data + 12 + size))
+    {
+        respond(target, sequence, STATUS_CHECKSUM, 0);
+        return;
+    }
+
+    if (faulty(target, DROP_REQUEST_FAULT))
+        return;
+
+    if (faulty(target, NACK_FAULT) || target->fault == ALWAYS_NACK_FAULT || length > LOADER_FRAME)
+    {
+        respond(target, sequence, STATUS_FRAME, 0);
+        return;
+    }
+
+    if (data[1] == LOADER_WRITE)
+    {
+        if (data[3] & LOADER_COMPRESSED)
+        {
+            if (decompress_lz4(data + 12, size, target->work, sizeof(target->work)) != length)
+                status = STATUS_FRAME;
+
+            source = target->work;
+        }
+        else if (size != length)
+        {
+            status = STATUS_FRAME;
+        }
+
+        if (!status)
+            status = program(target, address, source, length);
+
+        respond(target, sequence, status, 0);
+        return;
+    }
+
+    if (data[1] == LOADER_READ && address >= FAKE_ORIGIN && address + length <= FAKE_ORIGIN + FAKE_SIZE)
+    {
+        memcpy(target->reply + 5, target->flash + address - FAKE_ORIGIN, length);
+        respond(target, sequence, STATUS_DONE, length);
+        return;
+    }
+
+    respond(target, sequence, STATUS_FRAME, 0);
+}
+
+static void *run_target(void *argument)
+{
+    struct target *target = argument;
+
+    respond(target, LOADER_HELLO, STATUS_DONE, 0);
+
+    while (receive(target))
+    {
+        process(target);
+        target->frames++;
+    }
+
+    return 0;
+}
+
+static int start_target(pthread_t *thread, enum fault fault, int frame)
+{
+    int pair[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+        return INTERNAL_ERROR;
+
+    memset(target.flash, 0xFF, sizeof(target.flash));
+    target.fd = pair[1];
+    target.fault = fault;
+    target.frame = frame;
+    target.frames = 0;
+    target.programmed = 0;
+
+    init_serial_port(&serial);
+    serial.fd = pair[0];
+    loader.serial = &serial;
+
+    if (pthread_create(thread, 0, run_target, &target))
+    {
+        close(pair[0]);
+        close(pair[1]);
+        return INTERNAL_ERROR;
+    }
+
+    return DONE;
+}
+
+static void stop_target(pthread_t thread)
+{
+    shutdown(serial.fd, SHUT_RDWR);
+    pthread_join(thread, 0);
+    close(serial.fd);
+    close(target.fd);
+}
+
+static void fill_image(struct buffer *buffer)
+{
+    size_t index;
+
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->origin = FAKE_ORIGIN;
+    buffer->size = sizeof(image);
+    buffer->data = image;
+    buffer->count = 2;
+    buffer->extents[0].origin = FAKE_ORIGIN;
+    buffer->extents[0].size = 5000;
+    buffer->extents[1].origin = FAKE_ORIGIN + 0x2002;
+    buffer->extents[1].size = 3 * LOADER_FRAME;
+
+    for (index = 0; index < sizeof(image); index++)
+        image[index] = index % 7 == 0 ? rand() : index >> 4;
+}
+
+static int match_image(const struct buffer *buffer, const uint8_t *memory)
+{
+    size_t index;
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        const struct extent *extent = buffer->extents + index;
+        const size_t offset = extent->origin - FAKE_ORIGIN;
+
+        if (memcmp(memory + offset, image + offset, extent->size))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void check(const char *name, enum fault fault, int frame, int compress, int expected)
+{
+    pthread_t thread;
+    struct buffer buffer;
+    struct buffer reading;
+    int result;
+
+    fill_image(&buffer);
+
+    if ((result = start_target(&thread, fault, frame)))
+    {
+        failures++;
+        return;
+    }
+
+    if (!(result = sync_loader(&loader)) && !(result = write_loader_memory(&loader, &buffer, compress, 0, 0)))
+    {
+        reading = buffer;
+        reading.data = readback;
+        memset(readback, 0, sizeof(readback));
+
+        if (!(result = read_loader_memory(&loader, &reading)) && (!match_image(&buffer, target.flash) || !match_image(&buffer, readback)))
+            result = INVALID_DEVICE_MEMORY;
+    }
+
+    stop_target(thread);
+
+    if (result != expected)
+        failures++;
+
+    fprintf(stdout, "%-24s %d frames, %d bytes programmed, result %d: %s\n", name, target.frames, target.programmed, result, result == expected ? "passed" : "FAILED");
+}
+
+int main(void)
+{
+    srand(1);
+    signal(SIGPIPE, SIG_IGN);
+
+    check("plain", NO_FAULT, 0, 0, DONE);
+    check("compressed", NO_FAULT, 0, 1, DONE);
+    check("nack write", NACK_FAULT, 3, 0, DONE);
+    check("nack read", NACK_FAULT, 11, 0, DONE);
+    check("drop write request", DROP_REQUEST_FAULT, 2, 1, DONE);
+    check("drop read request", DROP_REQUEST_FAULT, 10, 0, DONE);
+    check("lose byte of write", LOSE_BYTE_FAULT, 4, 0, DONE);
+    check("drop write reply", DROP_REPLY_FAULT, 5, 0, DONE);
+    check("drop read reply", DROP_REPLY_FAULT, 12, 0, DONE);
+    check("damage write reply", DAMAGE_REPLY_FAULT, 1, 1, DONE);
+    check("damage read reply", DAMAGE_REPLY_FAULT, 9, 0, DONE);
+    check("always nack", ALWAYS_NACK_FAULT, 0, 0, INVALID_DEVICE_REPLY);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
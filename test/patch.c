@@ -0,0 +1,157 @@
+/*
+ * Swamp-boot - flash memory programming for the STM32 microcontrollers
+ * Copyright (c) 2016 rksdna, fasked
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Patches overlaid on an image: only the patched bytes may change, while
+ * the extents of the merged buffer stay word aligned for programming.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "errors.h"
+#include "buffer.h"
+
+#define FAKE_ORIGIN 0x08000000
+#define FAKE_SIZE 4096
+
+static uint8_t image_memory[FAKE_SIZE];
+static uint8_t patch_memory[FAKE_SIZE];
+static uint8_t merged_memory[FAKE_SIZE];
+static int failures;
+
+static void init_buffer(struct buffer *buffer, uint8_t *data)
+{
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->origin = FAKE_ORIGIN;
+    buffer->size = FAKE_SIZE;
+    buffer->data = data;
+    clear_buffer(buffer, 0xFF);
+}
+
+static int aligned(const struct buffer *buffer)
+{
+    size_t index;
+
+    for (index = 0; index < buffer->count; index++)
+    {
+        if (buffer->extents[index].origin % 4 || buffer->extents[index].size % 4)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void report(const char *name, int passed)
+{
+    if (!passed)
+        failures++;
+
+    fprintf(stdout, "%-24s %s\n", name, passed ? "passed" : "FAILED");
+}
+
+static int merge(struct buffer *merged, const struct buffer *image, const struct buffer *patches)
+{
+    init_buffer(merged, merged_memory);
+    return merge_buffer(merged, image) || merge_buffer(merged, patches);
+}
+
+static void check_bytes(void)
+{
+    static const uint8_t bytes[] = {0xA5, 0x5A};
+    struct buffer image, patches, merged;
+    uint8_t expected[0x11];
+    size_t index;
+
+    init_buffer(&image, image_memory);
+    init_buffer(&patches, patch_memory);
+
+    for (index = 0; index < sizeof(expected); index++)
+        expected[index] = index;
+
+    patch_buffer(&image, FAKE_ORIGIN + 0x800, expected, sizeof(expected));
+    memcpy(expected + 2, bytes, sizeof(bytes));
+
+    if (patch_buffer(&patches, FAKE_ORIGIN + 0x802, bytes, sizeof(bytes)) || merge(&merged, &image, &patches))
+    {
+        report("unaligned bytes", 0);
+        return;
+    }
+
+    report("unaligned bytes", patches.count == 1 && patches.extents[0].origin == FAKE_ORIGIN + 0x802 && patches.extents[0].size == 2
+        && !memcmp(merged_memory + 0x800, expected, sizeof(expected)) && merged_memory[0x800 + sizeof(expected)] == 0xFF && aligned(&merged));
+}
+
+static void check_file(void)
+{
+    static const uint8_t bytes[] = {0x12, 0x34, 0x56, 0x78, 0x9A};
+    char file[] = "/tmp/patch-XXXXXX.bin";
+    struct buffer image, patches, loaded, merged;
+    size_t index;
+    int stream;
+    int passed;
+
+    init_buffer(&image, image_memory);
+    init_buffer(&patches, patch_memory);
+    init_buffer(&loaded, merged_memory);
+
+    for (index = 0; index < 16; index++)
+        ((uint8_t *)image.data)[0x100 + index] = 0x80 + index;
+
+    image.count = 1;
+    image.extents[0].origin = FAKE_ORIGIN + 0x100;
+    image.extents[0].size = 16;
+
+    if ((stream = mkstemps(file, 4)) < 0)
+    {
+        report("unaligned file", 0);
+        return;
+    }
+
+    passed = write(stream, bytes, sizeof(bytes)) == sizeof(bytes) && !load_patch_buffer(&loaded, file, FAKE_ORIGIN + 0x103);
+    close(stream);
+    unlink(file);
+
+    for (index = 0; passed && index < loaded.count; index++)
+        passed = !patch_buffer(&patches, loaded.extents[index].origin, (const uint8_t *)loaded.data + loaded.extents[index].origin - loaded.origin, loaded.extents[index].size);
+
+    unload_file_buffer(&loaded);
+
+    if (!passed || merge(&merged, &image, &patches))
+    {
+        report("unaligned file", 0);
+        return;
+    }
+
+    report("unaligned file", patches.count == 1 && patches.extents[0].size == sizeof(bytes) && !memcmp(merged_memory + 0x103, bytes, sizeof(bytes))
+        && merged_memory[0x102] == 0x82 && merged_memory[0x108] == 0x88 && aligned(&merged));
+}
+
+int main(void)
+{
+    check_bytes();
+    check_file();
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}